@@ -1 +0,0 @@
-../src/macro_def.h
\ No newline at end of file
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef ACCEL_H
+#define ACCEL_H
+
+#include "geometry.h"
+
+/** available acceleration structures, selected at startup */
+enum AccelType {
+	ACCEL_OCTREE,
+	ACCEL_BVH,
+	ACCEL_BVH4
+};
+
+/** base class for acceleration structures for ray face intersection */
+class AccelStruct {
+public:
+	virtual ~AccelStruct() {};
+
+	/**
+	 * find first intersection of ray with a face
+	 *
+	 * @param point stores the point intersected here
+	 * @param face stores the face intersected here
+	 * @param r the ray with which to intersect
+	 *
+	 * @return true if a face was hit
+	 */
+	virtual bool first_ray_face_intersect(Vec *point, Face **face, const Ray &r)
+	{
+		(void)point;
+		(void)face;
+		(void)r;
+		return false;
+	}
+
+	/**
+	 * as first_ray_face_intersect(), also storing the Face::material_index
+	 * of the face hit in material_index; structures of TriBlocks read it
+	 * next to the face pointer, so sorting hits by material does not load
+	 * the faces. The default reads it from the face.
+	 */
+	virtual bool first_ray_material_intersect(Vec *point, Face **face,
+		int *material_index, const Ray &r)
+	{
+		if (!first_ray_face_intersect(point, face, r)) {
+			return false;
+		}
+		*material_index = (*face)->material_index;
+		return true;
+	}
+
+	/**
+	 * any-hit query for shadow rays: true if some face is hit at distance
+	 * (from GEOMETRY_EPSILON tolerance) less than tmax. Stops at the first
+	 * face found and need not order children. The default falls back to
+	 * the closest hit.
+	 *
+	 * @param r the ray with which to intersect
+	 * @param tmax e.g. the distance to a light, less tolerance
+	 */
+	virtual bool occluded(const Ray &r, float tmax)
+	{
+		Vec point;
+		Face *face;
+		return first_ray_face_intersect(&point, &face, r)
+			&& (point - r.orig) * r.dir < tmax;
+	}
+
+	/**
+	 * closest hits of n rays from one origin, e.g. camera rays, whose
+	 * directions are dir[xyz][0...n-1]. The default traces them one at a
+	 * time.
+	 *
+	 * @param point stores the points intersected here, point[xyz][k]
+	 * @param face stores the faces intersected here, nullptr for misses
+	 * @param material_index stores their Face::material_index here (see
+	 * first_ray_material_intersect()), unset for misses
+	 */
+	virtual void first_ray_face_intersect_packet(const Vec &orig,
+		const float *const dir[3], int n, float *const point[3], Face **face,
+		int *material_index)
+	{
+		for (int k = 0; k < n; k++) {
+			const Ray r{orig, Vec{dir[0][k], dir[1][k], dir[2][k]}};
+			Vec p;
+			if (first_ray_material_intersect(&p, &face[k], &material_index[k], r)) {
+				for (int i = 0; i < 3; i++) {
+					point[i][k] = p.x[i];
+				}
+			} else {
+				face[k] = nullptr;
+			}
+		}
+	}
+
+	/** @return approximate memory used */
+	virtual size_t bytes() const { return 0; }
+};
+
+#endif /* ACCEL_H */
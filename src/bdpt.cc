@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Bidirectional path tracing.
+ *
+ * Follows Veach's thesis (ch. 10): with s light and t camera subpath vertices
+ * in a connection, the prob dens of the neighbouring strategies only differ in
+ * one vertex each, so the MIS weight follows from the pdf_fwd/pdf_rev ratios
+ * along both subpaths once those at the connection are recomputed.
+ *
+ * The camera importance is chosen so that a camera subpath starts with
+ * throughput 1, as in PathTracer, so both integrators give the same image.
+ */
+
+#include <climits>
+#include "bdpt.h"
+
+/* see scene.cc */
+extern float global_characteristic_length_scale;
+
+BidirectionalPathTracer::BidirectionalPathTracer(int tid, Scene &scene,
+	unsigned long samples_before_update, int nthread)
+: RenderThread(tid, scene, samples_before_update, nthread), rng{tid * (UINT_MAX / nthread)}
+{
+	max_samples = AVG_SAMPLE_PER_PIX * camera.nx * camera.ny / nthread;
+	light_path.adjoint = true;
+
+	for (auto &material : scene.all_materials) {
+		if (dynamic_cast<DispersiveGlassMaterial *>(material.get())) {
+			dispersive = true;
+		}
+	}
+}
+
+/** @return |cos| between the face of v and dir, or 1 for the camera */
+static inline float abs_cos(const BDPTVertex &v, const Vec &dir)
+{
+	return v.face != nullptr ? fabsf(v.face->n * dir) : 1;
+}
+
+/**
+ * extend a subpath from verts[0] along path.rays[0], sampled with prob dens
+ * pdf_dir wrt solid angle; path.I is the throughput. Lights end subpaths:
+ * camera subpaths keep the light vertex, light subpaths drop it. Camera
+ * subpaths have up to 2 vertices more than bounces, light subpaths 1.
+ *
+ * @return number of vertices
+ */
+template<int MAX_BOUNCES>
+int BidirectionalPathTracer::random_walk(Path &path, BDPTVertex *verts,
+	float pdf_dir, bool is_camera)
+{
+	AccelStruct &accel = *scene.accel;
+	const int max_verts = bounce_cap<MAX_BOUNCES>(max_bounces) + (is_camera ? 2 : 1);
+
+	for (int k = 1; k < max_verts; k++) {
+		stats.rays++;
+		if (!accel.first_ray_face_intersect(&path.rays[k].orig,
+			&path.faces[k], path.rays[k-1])) {
+			if (is_camera) {
+				stats.escaped++;
+			}
+			return k;
+		}
+
+		const Material &material = *path.faces[k]->material;
+
+		// set path normals[k] to be on same side of rays[k]
+		const Vec &face_normal = path.faces[k]->n;
+		const float cos_in = face_normal * path.rays[k-1].dir;
+		if (cos_in < 0) {
+			path.normals[k] = face_normal;
+			path.rays[k-1].cosines[1] = -cos_in;
+		} else {
+			path.normals[k] = -1 * face_normal;
+			path.rays[k-1].cosines[1] = cos_in;
+		}
+
+		BDPTVertex &v = verts[k];
+		BDPTVertex &prev = verts[k-1];
+		const Vec d = path.rays[k].orig - prev.p;
+		const float dist2 = d * d;
+
+		v.type = BDPT_SURFACE;
+		v.p = path.rays[k].orig;
+		v.face = path.faces[k];
+		v.path = &path;
+		v.pind = k;
+		v.beta = path.I;
+		v.pdf_fwd = pdf_dir * path.rays[k-1].cosines[1] / dist2;
+		v.pdf_rev = 0;
+		v.delta = false;
+
+		if (material.is_light) {
+			if (!is_camera) {
+				return k;
+			}
+			v.type = BDPT_LIGHT;
+			stats.reached_light++;
+			return k + 1;
+		}
+
+		if (k + 1 == max_verts) {
+			if (is_camera) {
+				stats.max_depth++;
+			}
+			return k + 1;
+		}
+
+		float u[MATERIAL_NRAND];
+		for (int n = 0; n < MATERIAL_NRAND; n++) {
+			u[n] = rng.next();
+		}
+		material.sample_ray(path, k, u);
+		path.I /= path.prob_dens[k];
+		material.transfer(path, k);
+
+		float pdf_rev_dir;
+		if (material.can_connect) {
+			pdf_dir = path.prob_dens[k];
+			pdf_rev_dir = material.connect_pdf(path, k, -1 * path.rays[k-1].dir);
+		} else {
+			v.delta = true;
+			pdf_dir = 0;
+			pdf_rev_dir = 0;
+		}
+		prev.pdf_rev = pdf_rev_dir * abs_cos(prev, path.rays[k-1].dir) / dist2;
+	}
+
+	return max_verts;
+}
+
+/** @return number of camera subpath vertices, including the camera */
+template<int MAX_BOUNCES>
+int BidirectionalPathTracer::camera_subpath()
+{
+	const Camera &camera = scene.camera;
+	Path &path = camera_path;
+
+	path.film_x = rng.next() * camera.film_width - camera.film_width / 2;
+	path.film_y = rng.next() * camera.film_height - camera.film_height / 2;
+	camera.get_init_ray(path.rays[0], path.film_x, path.film_y);
+	path.rays[0].ior = SPACE_INDEX_REFRACT;
+	path.I = 1.0f;
+
+	BDPTVertex &v = camera_verts[0];
+	v.type = BDPT_CAMERA;
+	v.p = camera.position;
+	v.face = nullptr;
+	v.path = &path;
+	v.pind = 0;
+	v.beta = path.I;
+	v.pdf_fwd = 1;
+	v.pdf_rev = 0;
+	v.delta = false;
+
+	return random_walk<MAX_BOUNCES>(path, camera_verts, camera.pdf_dir(path.rays[0].dir), true);
+}
+
+/**
+ * start at a point sampled on an emitter, in a cosine distributed direction
+ * on either side (emitters are two sided)
+ *
+ * @return number of light subpath vertices, including the one on the emitter
+ */
+template<int MAX_BOUNCES>
+int BidirectionalPathTracer::light_subpath()
+{
+	const EmitterList &emitters = scene.emitters;
+	Path &path = light_path;
+
+	Vec point;
+	Face *face;
+	const float pdf_area = emitters.sample(&point, &face, rng.next(), rng.next(), rng.next());
+	const EmitterMaterial &light = *static_cast<EmitterMaterial *>(face->material);
+
+	const Vec normal = rng.next() < 0.5f ? face->n : -1 * face->n;
+	const float r0 = rng.next();
+	const float phi = rng.next() * (2 * PI_F);
+	const float z = sqrtf(r0 + GEOMETRY_EPSILON*GEOMETRY_EPSILON*(1 - r0));
+	Ray &ray = path.rays[0];
+	ray.orig = point;
+	ray.dir.x[0] = sqrtf(1 - z*z) * cosf(phi);
+	ray.dir.x[1] = sqrtf(1 - z*z) * sinf(phi);
+	ray.dir.x[2] = z;
+	z_to_normal_rotation(normal, ray.dir, 1);
+	ray.ior = SPACE_INDEX_REFRACT;
+	ray.cosines[0] = z;
+	path.faces[0] = face;
+	path.normals[0] = normal;
+
+	BDPTVertex &v = light_verts[0];
+	v.type = BDPT_LIGHT;
+	v.p = point;
+	v.face = face;
+	v.path = &path;
+	v.pind = 0;
+	// take the wavelengths (lanes, monochromatic) of path.I, then the
+	// emission at them
+	v.beta = path.I;
+	v.beta = light.emission;
+	v.beta /= pdf_area;
+	v.pdf_fwd = pdf_area;
+	v.pdf_rev = 0;
+	v.delta = false;
+
+	// emission * cos / (pdf_area * pdf_dir) with pdf_dir = cos / (2 pi)
+	path.I = light.emission;
+	path.I *= 2 * PI_F / pdf_area;
+
+	return random_walk<MAX_BOUNCES>(path, light_verts, z * INV_2PI_F, false);
+}
+
+/**
+ * @return prob dens wrt area at next of sampling it from v, where v is an end
+ * of a connection (camera, light or connectable surface)
+ */
+float BidirectionalPathTracer::pdf(const BDPTVertex &v, const BDPTVertex &next) const
+{
+	Vec dir = next.p - v.p;
+	const float dist2 = dir * dir;
+	dir = (1 / sqrtf(dist2)) * dir;
+
+	float pdf_dir;
+	switch (v.type) {
+	case BDPT_CAMERA:
+		pdf_dir = scene.camera.pdf_dir(dir);
+		break;
+	case BDPT_LIGHT:
+		pdf_dir = abs_cos(v, dir) * INV_2PI_F;
+		break;
+	case BDPT_SURFACE:
+	default:
+		pdf_dir = v.face->material->connect_pdf(*v.path, v.pind, dir);
+		break;
+	}
+
+	return pdf_dir * abs_cos(next, dir) / dist2;
+}
+
+/** remap delta (zero) prob dens so they cancel in ratios */
+static inline float remap0(float pdf)
+{
+	return pdf != 0 ? pdf : 1;
+}
+
+/**
+ * power heuristic weight of connecting s light and t camera subpath vertices
+ * against the other strategies for the same path
+ *
+ * @param light the light subpath, or the sampled light vertex if s == 1
+ */
+template<int MAX_BOUNCES>
+float BidirectionalPathTracer::mis_weight(const BDPTVertex *light, int s, int t) const
+{
+	if (s + t == 2) {
+		return 1;
+	}
+
+	constexpr int nbounce = MAX_BOUNCES > 0 ? MAX_BOUNCES : MAX_BOUNCES_LIMIT;
+	float cam_fwd[nbounce + 2];
+	float cam_rev[nbounce + 2];
+	bool cam_delta[nbounce + 2];
+	float light_fwd[nbounce + 1];
+	float light_rev[nbounce + 1];
+	bool light_delta[nbounce + 1];
+
+	for (int i = 0; i < t; i++) {
+		cam_fwd[i] = camera_verts[i].pdf_fwd;
+		cam_rev[i] = camera_verts[i].pdf_rev;
+		cam_delta[i] = camera_verts[i].delta;
+	}
+	for (int i = 0; i < s; i++) {
+		light_fwd[i] = light[i].pdf_fwd;
+		light_rev[i] = light[i].pdf_rev;
+		light_delta[i] = light[i].delta;
+	}
+
+	// the connection replaces the densities around it
+	const BDPTVertex &pt = camera_verts[t-1];
+	cam_delta[t-1] = false;
+	if (s > 0) {
+		const BDPTVertex &qs = light[s-1];
+		light_delta[s-1] = false;
+		cam_rev[t-1] = pdf(qs, pt);
+		light_rev[s-1] = pdf(pt, qs);
+		if (t > 1) {
+			cam_rev[t-2] = pdf(pt, camera_verts[t-2]);
+		}
+		if (s > 1) {
+			light_rev[s-2] = pdf(qs, light[s-2]);
+		}
+	} else {
+		cam_rev[t-1] = scene.emitters.pdf_area(*pt.face);
+		cam_rev[t-2] = pdf(pt, camera_verts[t-2]);
+	}
+
+	float sum = 0;
+	float ratio = 1;
+	for (int i = t - 1; i > 0; i--) {
+		ratio *= remap0(cam_rev[i]) / remap0(cam_fwd[i]);
+		if (!cam_delta[i] && !cam_delta[i-1]) {
+			sum += SQR(ratio);
+		}
+	}
+	ratio = 1;
+	for (int i = s - 1; i >= 0; i--) {
+		ratio *= remap0(light_rev[i]) / remap0(light_fwd[i]);
+		if (!light_delta[i] && !(i > 0 && light_delta[i-1])) {
+			sum += SQR(ratio);
+		}
+	}
+
+	return 1 / (1 + sum);
+}
+
+/** shadow ray between two vertices */
+bool BidirectionalPathTracer::visible(const Vec &a, const Vec &b)
+{
+	const float tol = GEOMETRY_EPSILON * global_characteristic_length_scale;
+	const float dist = (b - a).len();
+	if (dist <= 2 * tol) {
+		return false;
+	}
+
+	Ray shadow_ray;
+	shadow_ray.orig = a;
+	shadow_ray.dir = (1 / dist) * (b - a);
+	stats.shadow_rays++;
+	return !scene.accel->occluded(shadow_ray, dist - tol);
+}
+
+/**
+ * splat the MIS weighted contribution of the path with the first s light
+ * and t camera subpath vertices, to pixel i, j unless t == 1
+ */
+template<int MAX_BOUNCES>
+void BidirectionalPathTracer::connect(int s, int t, int pix_i, int pix_j)
+{
+	const Camera &camera = scene.camera;
+	const BDPTVertex &pt = camera_verts[t-1];
+	const BDPTVertex *light = light_verts;
+	BDPTVertex sampled;
+	SpecificIntensity I;
+
+	if (s == 0) {
+		// camera subpath hit a light
+		if (pt.type != BDPT_LIGHT) {
+			return;
+		}
+		I = pt.beta;
+		I *= static_cast<EmitterMaterial *>(pt.face->material)->emission;
+
+	} else if (t == 1) {
+		// light subpath vertex seen by the camera
+		const BDPTVertex &qs = light_verts[s-1];
+		if (!qs.can_connect()) {
+			return;
+		}
+		Vec dir = qs.p - camera.position;
+		const float dist2 = dir * dir;
+		dir = (1 / sqrtf(dist2)) * dir;
+
+		float film_x, film_y;
+		if (!camera.get_film_xy(&film_x, &film_y, dir)) {
+			return;
+		}
+		I = qs.beta;
+		if (qs.face->material->connect_transfer(I, *qs.path, qs.pind, -1 * dir) <= 0) {
+			return;
+		}
+		if (!visible(qs.p, camera.position)) {
+			return;
+		}
+		// importance * cos at the camera = camera.pdf_dir()
+		I *= camera.pdf_dir(dir) / dist2;
+		camera.get_ij(&pix_i, &pix_j, film_x, film_y);
+
+	} else if (s == 1) {
+		// light sampled for camera subpath vertex, as in next event estimation
+		if (!pt.can_connect()) {
+			return;
+		}
+		Vec point;
+		Face *face;
+		const float pdf_area = scene.emitters.sample(&point, &face,
+			rng.next(), rng.next(), rng.next());
+		const EmitterMaterial &emitter = *static_cast<EmitterMaterial *>(face->material);
+
+		sampled.type = BDPT_LIGHT;
+		sampled.p = point;
+		sampled.face = face;
+		sampled.path = nullptr;
+		sampled.pind = 0;
+		sampled.pdf_fwd = pdf_area;
+		sampled.pdf_rev = 0;
+		sampled.delta = false;
+		light = &sampled;
+
+		Vec dir = point - pt.p;
+		const float dist2 = dir * dir;
+		dir = (1 / sqrtf(dist2)) * dir;
+		const float cos_light = abs_cos(sampled, dir);
+		if (cos_light <= GEOMETRY_EPSILON) {
+			return;
+		}
+		I = pt.beta;
+		if (pt.face->material->connect_transfer(I, *pt.path, pt.pind, dir) <= 0) {
+			return;
+		}
+		if (!visible(pt.p, point)) {
+			return;
+		}
+		I *= emitter.emission;
+		I *= cos_light / (pdf_area * dist2);
+
+	} else {
+		// connect inner vertices of both subpaths
+		const BDPTVertex &qs = light_verts[s-1];
+		if (!pt.can_connect() || !qs.can_connect()) {
+			return;
+		}
+		Vec dir = qs.p - pt.p;
+		const float dist2 = dir * dir;
+		dir = (1 / sqrtf(dist2)) * dir;
+
+		I = pt.beta;
+		if (pt.face->material->connect_transfer(I, *pt.path, pt.pind, dir) <= 0
+			|| qs.face->material->connect_transfer(I, *qs.path, qs.pind, -1 * dir) <= 0) {
+			return;
+		}
+		if (!visible(pt.p, qs.p)) {
+			return;
+		}
+		I *= qs.beta;
+		I /= dist2;
+	}
+
+	I *= mis_weight<MAX_BOUNCES>(light, s, t);
+	splat(pix_i, pix_j, I);
+}
+
+/** sample one camera and one light subpath and splat all their connections */
+template<int MAX_BOUNCES>
+void BidirectionalPathTracer::trace()
+{
+	const Camera &camera = scene.camera;
+
+	// both subpaths must share the wavelengths
+	camera_path.I.start(rng.next());
+	if (dispersive) {
+		camera_path.I.make_monochromatic(rng.next());
+	}
+	light_path.I = camera_path.I;
+
+	const int nc = camera_subpath<MAX_BOUNCES>();
+	const int nl = scene.emitters.empty() ? 0 : light_subpath<MAX_BOUNCES>();
+	const int nbounce = bounce_cap<MAX_BOUNCES>(max_bounces);
+
+	int pix_i, pix_j;
+	camera.get_ij(&pix_i, &pix_j, camera_path.film_x, camera_path.film_y);
+
+	for (int t = 1; t <= nc; t++) {
+		for (int s = 0; s <= nl; s++) {
+			const int bounces = s + t - 2;
+			if ((s == 1 && t == 1) || bounces < 0 || bounces > nbounce) {
+				continue;
+			}
+			connect<MAX_BOUNCES>(s, t, pix_i, pix_j);
+		}
+	}
+}
+
+template<int MAX_BOUNCES>
+void BidirectionalPathTracer::render_samples()
+{
+	for (unsigned long long samples = 0, since_update_samples = 0; samples < max_samples;) {
+		if (unlikely(samples % DEADLINE_CHECK_SAMPLES == 0) && past_deadline()) {
+			break;
+		}
+		trace<MAX_BOUNCES>();
+
+		samples++;
+		stats.paths++;
+		stats.samples++;
+		since_update_samples++;
+
+		if (!BENCHMARKING && unlikely(since_update_samples >= samples_before_update)) {
+			since_update_samples = 0;
+			update_pixel_data();
+		}
+	}
+}
+
+void BidirectionalPathTracer::render()
+{
+	with_bounce_cap(max_bounces, [this](auto cap) {
+		render_samples<decltype(cap)::value>();
+	});
+}
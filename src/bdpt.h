@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "render.h"
+
+enum BDPTVertexType {
+	BDPT_CAMERA,
+	BDPT_LIGHT,
+	BDPT_SURFACE
+};
+
+/**
+ * Vertex of a camera or light subpath. Prob densities are wrt area at the
+ * vertex: pdf_fwd for sampling it from the previous vertex of its subpath,
+ * pdf_rev for sampling it from the next one (i.e. from the other side).
+ */
+class BDPTVertex {
+public:
+	BDPTVertexType type;
+	Vec p;
+	/** nullptr for the camera */
+	Face *face;
+	/** subpath and index there of a surface vertex, for its material */
+	const Path *path;
+	int pind;
+	/** throughput of the subpath arriving at this vertex */
+	SpecificIntensity beta;
+	float pdf_fwd;
+	float pdf_rev;
+	/** specular: cannot be connected and has no prob dens */
+	bool delta;
+
+	bool can_connect() const
+	{
+		return type == BDPT_SURFACE && face->material->can_connect;
+	}
+};
+
+/**
+ * Bidirectional path tracer: each sample traces a camera subpath and a light
+ * subpath (from an emitter), then every pair of their vertices is connected,
+ * with the s = 0 (camera subpath hits a light), s = 1 (light sampled as in
+ * next event estimation) and t = 1 (light subpath vertex splatted to the
+ * film) strategies included. Every connection is weighted against all other
+ * strategies for the same path with the power heuristic. Paths have at most
+ * max_bounces bounces.
+ *
+ * Paths through dispersive materials are made monochromatic for the whole
+ * sample since both subpaths must agree on the wavelength.
+ */
+class BidirectionalPathTracer : public RenderThread {
+public:
+	Path camera_path;
+	Path light_path;
+	BDPTVertex camera_verts[MAX_BOUNCES_LIMIT + 2];
+	BDPTVertex light_verts[MAX_BOUNCES_LIMIT + 1];
+	RandRng rng;
+	/** some material is dispersive: all samples are monochromatic */
+	bool dispersive = false;
+	/** render() returns after this many samples */
+	unsigned long long max_samples;
+	/** at most MAX_BOUNCES_LIMIT, the kernels being compiled per cap (see
+	 * with_bounce_cap()); set before start() */
+	int max_bounces = MAX_BOUNCES_PER_PATH;
+
+	BidirectionalPathTracer(int tid, Scene &scene, unsigned long samples_before_update,
+		int nthread = NTHREAD);
+
+	template<int MAX_BOUNCES> int random_walk(Path &path, BDPTVertex *verts,
+		float pdf_dir, bool is_camera);
+	template<int MAX_BOUNCES> int camera_subpath();
+	template<int MAX_BOUNCES> int light_subpath();
+	float pdf(const BDPTVertex &v, const BDPTVertex &next) const;
+	template<int MAX_BOUNCES> float mis_weight(const BDPTVertex *light, int s, int t) const;
+	bool visible(const Vec &a, const Vec &b);
+	template<int MAX_BOUNCES> void connect(int s, int t, int pix_i, int pix_j);
+	template<int MAX_BOUNCES> void trace();
+	template<int MAX_BOUNCES> void render_samples();
+	void render();
+};
+
+#endif /* BDPT_H */
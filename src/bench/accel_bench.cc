@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Benchmark of acceleration structure build time (against thread
+ * count) and ray throughput.
+ *
+ * usage: bench/accel_bench [OBJ_FILE MTL_FILE]...
+ * With no arguments, uses the scenes in ../scenes and a synthetic mesh.
+ */
+
+#include <cfloat>
+#include <ctime>
+#include "color.h"
+#include "obj_reader.h"
+#include "scene.h"
+#include "tri_block.h"
+
+#define BENCH_NRAY (1 << 20)
+#define SYNTHETIC_NSTEP 512
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Camera bench_camera()
+{
+	return Camera{43, 35, Vec{0,-7,-0.5}, Vec{0,1,0}, IMAGE_WIDTH, IMAGE_HEIGHT};
+}
+
+static Scene scene_from_files(const char *obj_fname, const char *mtl_fname)
+{
+	ObjReader obj_reader{obj_fname, mtl_fname};
+	return Scene{std::move(obj_reader.all_faces), std::move(obj_reader.all_materials), bench_camera()};
+}
+
+/** bumpy sphere with 2 * SYNTHETIC_NSTEP^2 triangles */
+static Scene synthetic_scene()
+{
+	std::vector<std::unique_ptr<Material>> all_materials;
+	float white[3] = {0.8, 0.8, 0.8};
+	all_materials.push_back(std::make_unique<DiffuseMaterial>(white));
+
+	const int n = SYNTHETIC_NSTEP;
+	std::vector<Vec> grid;
+	for (int i = 0; i <= n; i++) {
+		float theta = PI_F * i / n;
+		for (int j = 0; j <= n; j++) {
+			float phi = 2 * PI_F * j / n;
+			float r = 1.0f + 0.05f * sinf(17 * theta) * cosf(23 * phi);
+			grid.emplace_back(r * sinf(theta) * cosf(phi), r * sinf(theta) * sinf(phi), r * cosf(theta));
+		}
+	}
+
+	std::vector<std::unique_ptr<Face>> all_faces;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			const Vec &a = grid[i*(n+1) + j];
+			const Vec &b = grid[i*(n+1) + j + 1];
+			const Vec &c = grid[(i+1)*(n+1) + j];
+			const Vec &d = grid[(i+1)*(n+1) + j + 1];
+			all_faces.push_back(std::make_unique<Face>(a, b, d));
+			all_faces.push_back(std::make_unique<Face>(a, d, c));
+			all_faces[all_faces.size() - 1]->material = all_materials[0].get();
+			all_faces[all_faces.size() - 2]->material = all_materials[0].get();
+		}
+	}
+
+	return Scene{std::move(all_faces), std::move(all_materials), bench_camera()};
+}
+
+/** random origins inside the scene bounding box with isotropic directions */
+static std::vector<Ray> make_rays(const Scene &scene)
+{
+	std::vector<Ray> rays;
+	RandRng rng{1};
+	const Box &b = scene.bounding_box;
+	for (int n = 0; n < BENCH_NRAY; n++) {
+		Vec orig, dir;
+		for (int i = 0; i < 3; i++) {
+			orig.x[i] = b.corners[0][i] + rng.next() * (b.corners[1][i] - b.corners[0][i]);
+		}
+		float z = 2 * rng.next() - 1;
+		float phi = 2 * PI_F * rng.next();
+		dir = Vec{sqrtf(1 - z*z) * cosf(phi), sqrtf(1 - z*z) * sinf(phi), z};
+		rays.emplace_back(orig, dir);
+	}
+	return rays;
+}
+
+static void bench_accel(Scene &scene, const std::vector<Ray> &rays,
+	AccelType type, const char *type_name)
+{
+	double t0 = now();
+	scene.build_accel(type);
+	double build_time = now() - t0;
+
+	printf("  %-8s build %8.3f ms  %6.1f bytes/face\n", type_name,
+		1e3 * build_time, (double)scene.accel->bytes() / scene.all_faces.size());
+
+	printf("    build ms by threads:");
+	for (int nthread : {1, 2, 4, 8, NTHREAD}) {
+		t0 = now();
+		scene.build_accel(type, nthread);
+		printf("  %d: %.3f", nthread, 1e3 * (now() - t0));
+	}
+	printf("\n");
+
+	const char *default_kernel = tri_block_kernel_name();
+	for (const char *kernel : {"scalar", "sse4.1", "avx2"}) {
+		if (!tri_block_select_kernel(kernel)) {
+			continue;
+		}
+
+		Vec point;
+		Face *face;
+		unsigned long nhit = 0;
+		t0 = now();
+		for (auto &r : rays) {
+			nhit += scene.accel->first_ray_face_intersect(&point, &face, r);
+		}
+		double trace_time = now() - t0;
+
+		printf("    %-8s closest hit %7.3f Mrays/s  (%lu hits)\n", kernel,
+			rays.size() / trace_time / 1e6, nhit);
+
+		/* same rays as shadow rays: the hit count must agree */
+		unsigned long noccluded = 0;
+		t0 = now();
+		for (auto &r : rays) {
+			noccluded += scene.accel->occluded(r, FLT_MAX);
+		}
+		trace_time = now() - t0;
+
+		printf("    %-8s occluded    %7.3f Mrays/s  (%lu hits)\n", kernel,
+			rays.size() / trace_time / 1e6, noccluded);
+	}
+	tri_block_select_kernel(default_kernel);
+}
+
+static void bench_scene(Scene &scene, const char *name)
+{
+	scene.init(ACCEL_OCTREE);
+	printf("%s: %zu faces\n", name, scene.all_faces.size());
+	std::vector<Ray> rays = make_rays(scene);
+	bench_accel(scene, rays, ACCEL_OCTREE, "octree");
+	bench_accel(scene, rays, ACCEL_BVH, "bvh");
+	bench_accel(scene, rays, ACCEL_BVH4, "bvh4");
+}
+
+int main(int argc, char **argv)
+{
+	Color::init();
+
+	if (argc >= 3) {
+		for (int i = 1; i + 1 < argc; i += 2) {
+			Scene scene = scene_from_files(argv[i], argv[i+1]);
+			bench_scene(scene, argv[i]);
+		}
+	} else {
+		Scene cornell_box = scene_from_files("../scenes/cornell_box.obj", "../scenes/cornell_box.mtl");
+		bench_scene(cornell_box, "cornell_box");
+		Scene prism = scene_from_files("../scenes/prism.obj", "../scenes/prism.mtl");
+		bench_scene(prism, "prism");
+		Scene synthetic = synthetic_scene();
+		bench_scene(synthetic, "synthetic");
+	}
+
+	return 0;
+}
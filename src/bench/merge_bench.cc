@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Benchmark of merging thread films into the camera against thread
+ * count, with the image broadcaster converting images concurrently.
+ *
+ * usage: bench/merge_bench
+ *
+ * Each thread splats SAMPLES_PER_BROADCAST random samples then merges, which
+ * is merge-heavy compared to rendering. "global" is the old scheme: one lock
+ * for the whole frame, also held by the broadcaster during conversion;
+ * "stripe" is Camera::update_pixel_data() with the broadcaster converting a
+ * snapshot.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "color.h"
+#include "scene.h"
+#include "srgb_img.h"
+
+#define BENCH_SECONDS 1.0
+#define BENCH_MAX_THREAD 64
+
+enum MergeScheme {
+	MERGE_GLOBAL,
+	MERGE_STRIPE
+};
+
+class MergeResult {
+public:
+	unsigned long long merges = 0;
+	double wait = 0;
+	unsigned long long images = 0;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** old scheme: whole frame under camera.mutex */
+static double global_merge(Camera &camera, MultiArray<float> &film)
+{
+	const double t0 = now();
+	camera.mutex.lock();
+	const double wait = now() - t0;
+	camera.raw += film;
+	camera.mutex.unlock();
+	film.fill(0);
+	return wait;
+}
+
+static MergeResult bench(MergeScheme scheme, int nthread)
+{
+	Camera camera{43, 35, Vec{0,-7,-0.5}, Vec{0,1,0}, IMAGE_WIDTH, IMAGE_HEIGHT};
+	camera.init_pixel_data();
+
+	std::atomic<bool> stop{false};
+	std::vector<MergeResult> results(nthread);
+	std::vector<std::thread> threads;
+
+	for (int tid = 0; tid < nthread; tid++) {
+		threads.emplace_back([&, tid]() {
+			MultiArray<float> film{camera.ny, camera.nx, FILM_NCHANNEL};
+			MultiArray<float> probes{0, NWAVELEN};
+			film.fill(0);
+			RandRng rng{(unsigned)tid + 1};
+			MergeResult &result = results[tid];
+
+			while (!stop.load(std::memory_order_relaxed)) {
+				for (unsigned long long s = 0; s < SAMPLES_PER_BROADCAST; s++) {
+					const int i = rng.next() * (camera.ny - 1);
+					const int j = rng.next() * (camera.nx - 1);
+					for (int k = 0; k < FILM_NCHANNEL; k++) {
+						film(i, j, k) += 1;
+					}
+				}
+				if (scheme == MERGE_GLOBAL) {
+					result.wait += global_merge(camera, film);
+				} else {
+					result.wait += camera.update_pixel_data(film, probes,
+						tid * FILM_NSTRIPE / nthread % FILM_NSTRIPE);
+				}
+				result.merges++;
+			}
+		});
+	}
+
+	// the broadcaster converts whenever there is new data
+	MergeResult broadcaster;
+	std::thread broadcast_thread{[&]() {
+		SRGBImgXYZConverter converter;
+		MultiArray<float> snapshot;
+		while (!stop.load(std::memory_order_relaxed)) {
+			if (!camera.pixel_data_updated.exchange(false)) {
+				std::this_thread::yield();
+				continue;
+			}
+			if (scheme == MERGE_GLOBAL) {
+				camera.mutex.lock();
+				converter.make_image(camera.raw);
+				camera.mutex.unlock();
+			} else {
+				camera.snapshot(snapshot);
+				converter.make_image(snapshot);
+			}
+			broadcaster.images++;
+		}
+	}};
+	if (scheme == MERGE_GLOBAL) {
+		// global_merge() does not signal
+		std::thread signal_thread{[&]() {
+			while (!stop.load(std::memory_order_relaxed)) {
+				camera.pixel_data_updated.store(true);
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}};
+		std::this_thread::sleep_for(std::chrono::duration<double>(BENCH_SECONDS));
+		stop.store(true);
+		signal_thread.join();
+	} else {
+		std::this_thread::sleep_for(std::chrono::duration<double>(BENCH_SECONDS));
+		stop.store(true);
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	broadcast_thread.join();
+
+	MergeResult total;
+	for (auto &result : results) {
+		total.merges += result.merges;
+		total.wait += result.wait;
+	}
+	total.images = broadcaster.images;
+	return total;
+}
+
+int main()
+{
+	Color::init();
+	printf("%dx%d film, %d channels, %d stripes, %llu splats per merge, %.1f s per run, %u cores\n",
+		IMAGE_WIDTH, IMAGE_HEIGHT, FILM_NCHANNEL, FILM_NSTRIPE, SAMPLES_PER_BROADCAST,
+		BENCH_SECONDS, std::thread::hardware_concurrency());
+
+	for (int nthread = 1; nthread <= BENCH_MAX_THREAD; nthread *= 2) {
+		for (MergeScheme scheme : {MERGE_GLOBAL, MERGE_STRIPE}) {
+			MergeResult result = bench(scheme, nthread);
+			printf("  %-6s %2d threads: %8.0f merges/s  wait %8.1f us/merge"
+				"  (%5.1f%% of thread time)  %5.0f images/s\n",
+				scheme == MERGE_GLOBAL ? "global" : "stripe", nthread,
+				result.merges / BENCH_SECONDS,
+				result.wait / std::max(result.merges, 1ULL) * 1e6,
+				100 * result.wait / (nthread * BENCH_SECONDS),
+				result.images / BENCH_SECONDS);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Benchmark of primary (camera) ray throughput: camera ray generation
+ * one at a time against Camera::get_init_dirs(), and closest hits one ray at
+ * a time against packets (AccelStruct::first_ray_face_intersect_packet()).
+ *
+ * usage: bench/primary_bench [OBJ_FILE MTL_FILE]...
+ * With no arguments, uses the scenes in ../scenes and a synthetic mesh filling
+ * the view.
+ *
+ * Rays are jittered in their pixels and ordered as packets either of 8x8
+ * pixels with one sample each or of the TILE_SPP samples of 4 neighbouring
+ * pixels, the order of the wavefront path tracer.
+ */
+
+#include <ctime>
+#include "color.h"
+#include "obj_reader.h"
+#include "scene.h"
+
+#define BENCH_RES 512
+#define BENCH_REPEAT 4
+#define SYNTHETIC_NSTEP 256
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Scene scene_from_files(const char *obj_fname, const char *mtl_fname)
+{
+	ObjReader obj_reader{obj_fname, mtl_fname};
+	Camera camera{43, 35, Vec{0,-7,-0.5}, Vec{0,1,0}, BENCH_RES, BENCH_RES};
+	return Scene{std::move(obj_reader.all_faces), std::move(obj_reader.all_materials), camera};
+}
+
+/** bumpy sphere with 2 * SYNTHETIC_NSTEP^2 triangles, as in accel_bench */
+static Scene synthetic_scene()
+{
+	std::vector<std::unique_ptr<Material>> all_materials;
+	float white[3] = {0.8, 0.8, 0.8};
+	all_materials.push_back(std::make_unique<DiffuseMaterial>(white));
+
+	const int n = SYNTHETIC_NSTEP;
+	std::vector<Vec> grid;
+	for (int i = 0; i <= n; i++) {
+		float theta = PI_F * i / n;
+		for (int j = 0; j <= n; j++) {
+			float phi = 2 * PI_F * j / n;
+			float r = 1.0f + 0.05f * sinf(17 * theta) * cosf(23 * phi);
+			grid.emplace_back(r * sinf(theta) * cosf(phi), r * sinf(theta) * sinf(phi), r * cosf(theta));
+		}
+	}
+
+	std::vector<std::unique_ptr<Face>> all_faces;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			const Vec &a = grid[i*(n+1) + j];
+			const Vec &b = grid[i*(n+1) + j + 1];
+			const Vec &c = grid[(i+1)*(n+1) + j];
+			const Vec &d = grid[(i+1)*(n+1) + j + 1];
+			all_faces.push_back(std::make_unique<Face>(a, b, d));
+			all_faces.push_back(std::make_unique<Face>(a, d, c));
+			all_faces[all_faces.size() - 1]->material = all_materials[0].get();
+			all_faces[all_faces.size() - 2]->material = all_materials[0].get();
+		}
+	}
+
+	Camera camera{43, 35, Vec{0,-2.5,0}, Vec{0,1,0}, BENCH_RES, BENCH_RES};
+	return Scene{std::move(all_faces), std::move(all_materials), camera};
+}
+
+/** film points of rays, packet after packet */
+class FilmPoints {
+public:
+	std::vector<float> x;
+	std::vector<float> y;
+
+	void add(const Camera &camera, int i, int j, RandRng &rng)
+	{
+		float film_x, film_y;
+		camera.get_film_xy_in_pixel(&film_x, &film_y, i, j, rng.next(), rng.next());
+		x.push_back(film_x);
+		y.push_back(film_y);
+	}
+};
+
+/** packets of 8x8 pixels, one sample each */
+static FilmPoints pixel_packets(const Camera &camera)
+{
+	FilmPoints points;
+	RandRng rng{1};
+	for (int s = 0; s < TILE_SPP; s++) {
+		for (int i0 = 0; i0 < camera.ny; i0 += 8) {
+			for (int j0 = 0; j0 < camera.nx; j0 += 8) {
+				for (int i = i0; i < i0 + 8; i++) {
+					for (int j = j0; j < j0 + 8; j++) {
+						points.add(camera, i, j, rng);
+					}
+				}
+			}
+		}
+	}
+	return points;
+}
+
+/** packets of the TILE_SPP samples of neighbouring pixels of a row */
+static FilmPoints sample_packets(const Camera &camera)
+{
+	FilmPoints points;
+	RandRng rng{1};
+	for (int i = 0; i < camera.ny; i++) {
+		for (int j = 0; j < camera.nx; j++) {
+			for (int s = 0; s < TILE_SPP; s++) {
+				points.add(camera, i, j, rng);
+			}
+		}
+	}
+	return points;
+}
+
+static void bench_order(Scene &scene, const FilmPoints &points, const char *order_name)
+{
+	const Camera &camera = scene.camera;
+	const int n = points.x.size();
+	std::vector<float> dir_data[3];
+	std::vector<float> point_data[3];
+	for (int i = 0; i < 3; i++) {
+		dir_data[i].resize(n);
+		point_data[i].resize(n);
+	}
+	float *const dir[3] = {dir_data[0].data(), dir_data[1].data(), dir_data[2].data()};
+	float *const point[3] = {point_data[0].data(), point_data[1].data(), point_data[2].data()};
+	std::vector<Ray> rays(n);
+	std::vector<Face *> faces(n);
+
+	printf("  %s: %d rays\n", order_name, n);
+
+	double t0 = now();
+	for (int r = 0; r < BENCH_REPEAT; r++) {
+		for (int k = 0; k < n; k++) {
+			camera.get_init_ray(rays[k], points.x[k], points.y[k]);
+		}
+	}
+	double t_scalar = now() - t0;
+	t0 = now();
+	for (int r = 0; r < BENCH_REPEAT; r++) {
+		camera.get_init_dirs(dir, points.x.data(), points.y.data(), n);
+	}
+	double t_batch = now() - t0;
+	printf("    generate  one at a time %8.2f Mrays/s  batch %8.2f Mrays/s\n",
+		BENCH_REPEAT * n / t_scalar / 1e6, BENCH_REPEAT * n / t_batch / 1e6);
+
+	unsigned long nhit = 0;
+	t0 = now();
+	for (int r = 0; r < BENCH_REPEAT; r++) {
+		nhit = 0;
+		for (int k = 0; k < n; k++) {
+			Vec p;
+			nhit += scene.accel->first_ray_face_intersect(&p, &faces[k], rays[k]);
+		}
+	}
+	t_scalar = now() - t0;
+
+	std::vector<Face *> packet_faces(n);
+	std::vector<int> packet_materials(n);
+	t0 = now();
+	for (int r = 0; r < BENCH_REPEAT; r++) {
+		scene.accel->first_ray_face_intersect_packet(camera.position, dir, n, point,
+			packet_faces.data(), packet_materials.data());
+	}
+	t_batch = now() - t0;
+
+	/* same faces hit up to rays grazing an edge */
+	unsigned long npacket_hit = 0;
+	unsigned long nsame = 0;
+	for (int k = 0; k < n; k++) {
+		npacket_hit += packet_faces[k] != nullptr;
+		nsame += packet_faces[k] == faces[k];
+	}
+	printf("    trace     one at a time %8.2f Mrays/s  packets %6.2f Mrays/s"
+		"  (%lu, %lu hits, %.5f same)\n",
+		BENCH_REPEAT * n / t_scalar / 1e6, BENCH_REPEAT * n / t_batch / 1e6,
+		nhit, npacket_hit, (double)nsame / n);
+}
+
+static void bench_scene(Scene &scene, const char *name)
+{
+	scene.init();
+	printf("%s: %zu faces, %dx%d\n", name, scene.all_faces.size(),
+		scene.camera.nx, scene.camera.ny);
+	bench_order(scene, pixel_packets(scene.camera), "8x8 pixels");
+	bench_order(scene, sample_packets(scene.camera), "pixel samples");
+}
+
+int main(int argc, char **argv)
+{
+	Color::init();
+
+	if (argc >= 3) {
+		for (int i = 1; i + 1 < argc; i += 2) {
+			Scene scene = scene_from_files(argv[i], argv[i+1]);
+			bench_scene(scene, argv[i]);
+		}
+	} else {
+		Scene cornell_box = scene_from_files("../scenes/cornell_box.obj", "../scenes/cornell_box.mtl");
+		bench_scene(cornell_box, "cornell_box");
+		Scene prism = scene_from_files("../scenes/prism.obj", "../scenes/prism.mtl");
+		bench_scene(prism, "prism");
+		Scene synthetic = synthetic_scene();
+		bench_scene(synthetic, "synthetic");
+	}
+
+	return 0;
+}
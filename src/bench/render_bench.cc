@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Noise at equal time of the integrators against a reference image.
+ *
+ * usage: bench/render_bench [OBJ_FILE MTL_FILE]...
+ * With no arguments, uses the scenes in ../scenes.
+ *
+ * Images are compared after normalizing by their sum (the integrators differ
+ * in which paths they count) against an unbounded depth reference, so fixed
+ * depth caps show up as bias. Since error^2 ~ 1/time, error^2 * time is the
+ * figure of merit; it is reported as the error after 1 sec on one thread.
+ *
+ * Errors are of the CIE XYZ image, which is what is displayed: with hero
+ * wavelength sampling (HERO_NLANE) each path only carries a few wavelengths,
+ * noise in single wavelengths that averages out in color.
+ *
+ * Rare bright paths (e.g. lights seen through glass) dominate the L2 error of
+ * scenes like prism, including that of the reference, so the error is also
+ * reported after tonemapping each pixel with x / (1 + x), which bounds them.
+ */
+
+#include <climits>
+#include <ctime>
+#include "color.h"
+#include "obj_reader.h"
+#include "bdpt.h"
+#include "mlt.h"
+
+#define BENCH_RES 64
+#define BENCH_SPP 64
+#define REFERENCE_SPP 2048
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum IntegratorType {
+	INTEGRATOR_PT,
+	INTEGRATOR_BDPT,
+	INTEGRATOR_MLT
+};
+
+/** integrator and settings if a PathTracer */
+class Integrator {
+public:
+	const char *name;
+	IntegratorType type;
+	bool nee;
+	int rr_min_depth;
+	int max_depth;
+};
+
+/** old fixed depth cap: same paths as the naive integrator (and bdpt, mlt) */
+static const Integrator integrators[] = {
+	{"naive", INTEGRATOR_PT, false, INT_MAX, MAX_BOUNCES_PER_PATH + 1},
+	{"nee cap", INTEGRATOR_PT, true, INT_MAX, MAX_BOUNCES_PER_PATH + 1},
+	{"nee rr", INTEGRATOR_PT, true, RR_MIN_DEPTH, 0},
+	{"bdpt", INTEGRATOR_BDPT, false, INT_MAX, MAX_BOUNCES_PER_PATH + 1},
+	{"mlt", INTEGRATOR_MLT, false, INT_MAX, MAX_BOUNCES_PER_PATH + 1},
+};
+
+/**
+ * render on the calling thread, storing the elapsed time in seconds and
+ * the work done in stats
+ */
+static MultiArray<float> render(Scene &scene, int tid, const Integrator &integrator,
+	unsigned long long nsamples, double *seconds, RenderStats *stats)
+{
+	if (integrator.type == INTEGRATOR_BDPT) {
+		BidirectionalPathTracer bdpt{tid, scene, ULONG_MAX};
+		bdpt.max_samples = nsamples;
+
+		double t0 = now();
+		bdpt.render();
+		*seconds = now() - t0;
+		*stats = bdpt.stats;
+		return bdpt.film_buffer;
+	}
+	if (integrator.type == INTEGRATOR_MLT) {
+		MetropolisTracer mlt{tid, scene, ULONG_MAX};
+		mlt.max_samples = nsamples;
+
+		double t0 = now();
+		mlt.render();
+		*seconds = now() - t0;
+		*stats = mlt.stats;
+		printf("    mlt: b %.3g, acceptance %.2f\n", mlt.b, (double)mlt.accepted / nsamples);
+		return mlt.film_buffer;
+	}
+
+	PathTracer path_tracer{tid, scene, ULONG_MAX};
+	path_tracer.nee = integrator.nee;
+	path_tracer.rr_min_depth = integrator.rr_min_depth;
+	path_tracer.max_depth = integrator.max_depth;
+	path_tracer.max_samples = nsamples;
+
+	double t0 = now();
+	path_tracer.render();
+	*seconds = now() - t0;
+	*stats = path_tracer.stats;
+	return path_tracer.film_buffer;
+}
+
+/** store the CIE XYZ image of the film in xyz */
+static void to_xyz(MultiArray<float> &xyz, const MultiArray<float> &film)
+{
+	if (FILM_XYZ) {
+		xyz = film;
+		return;
+	}
+	xyz = MultiArray<float>{film.n[0], film.n[1], 3};
+	for (int i = 0; i < film.n[0]; i++) {
+		for (int j = 0; j < film.n[1]; j++) {
+			ColorXYZ color = Color::physical_to_XYZ(&film.data[(i*film.n[1] + j)*NWAVELEN]);
+			for (int k = 0; k < 3; k++) {
+				xyz(i, j, k) = color.XYZ[k];
+			}
+		}
+	}
+}
+
+/**
+ * @return relative squared L2 error of the XYZ image of img against that of
+ * ref, both normalized to a mean of 1 and, if tonemap, mapped by x / (1 + x)
+ */
+static double rel_sqr_err(const MultiArray<float> &img_film, const MultiArray<float> &ref_film,
+	bool tonemap = false)
+{
+	MultiArray<float> img, ref;
+	to_xyz(img, img_film);
+	to_xyz(ref, ref_film);
+
+	double img_sum = 0, ref_sum = 0;
+	for (int i = 0; i < ref.len; i++) {
+		img_sum += img(i);
+		ref_sum += ref(i);
+	}
+
+	double err = 0, norm = 0;
+	for (int i = 0; i < ref.len; i++) {
+		double x = img(i) * ref.len / img_sum;
+		double y = ref(i) * ref.len / ref_sum;
+		if (tonemap) {
+			x /= 1 + x;
+			y /= 1 + y;
+		}
+		err += SQR(x - y);
+		norm += SQR(y);
+	}
+	return err / norm;
+}
+
+static void bench_scene(const char *obj_fname, const char *mtl_fname)
+{
+	ObjReader obj_reader{obj_fname, mtl_fname};
+	Camera camera{43, 35, Vec{0,-7,-0.5}, Vec{0,1,0}, BENCH_RES, BENCH_RES};
+	Scene scene{std::move(obj_reader.all_faces), std::move(obj_reader.all_materials), camera};
+	scene.init();
+	printf("%s: %zu faces, %zu emitting\n", obj_fname, scene.all_faces.size(),
+		scene.emitters.faces.size());
+
+	const unsigned long long npix = BENCH_RES * BENCH_RES;
+	double seconds;
+	RenderStats stats;
+	MultiArray<float> ref = render(scene, 0, integrators[2], REFERENCE_SPP * npix, &seconds, &stats);
+	printf("  reference: %s %d spp in %.1f s\n", integrators[2].name, REFERENCE_SPP, seconds);
+
+	for (auto &integrator : integrators) {
+		MultiArray<float> img = render(scene, 1, integrator, BENCH_SPP * npix, &seconds, &stats);
+		double err2 = rel_sqr_err(img, ref);
+		double tonemapped_err2 = rel_sqr_err(img, ref, true);
+		printf("  %-8s %d spp in %6.2f s  rel err %.4f  rel err at 1 s %.4f"
+			"  tonemapped at 1 s %.4f\n",
+			integrator.name, BENCH_SPP, seconds, sqrt(err2), sqrt(err2 * seconds),
+			sqrt(tonemapped_err2 * seconds));
+		printf("    ");
+		stats.print(integrator.name, seconds);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	Color::init();
+
+	if (argc >= 3) {
+		for (int i = 1; i + 1 < argc; i += 2) {
+			bench_scene(argv[i], argv[i+1]);
+		}
+	} else {
+		bench_scene("../scenes/cornell_box.obj", "../scenes/cornell_box.mtl");
+		bench_scene("../scenes/prism.obj", "../scenes/prism.mtl");
+	}
+
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Speed and convergence of the samplers against the old rngs.
+ *
+ * usage: bench/sampler_bench [OBJ_FILE MTL_FILE]
+ * With no arguments, renders ../scenes/cornell_box.
+ *
+ * Speed is numbers per ns on one thread, drawing the dimensions of a path
+ * tracer sample in order one at a time and with get4(); the old rngs are called through Rng as the path
+ * tracer did. Convergence is the rms error over BENCH_PIXELS pixels of the
+ * estimates of integrals with known values, each in the dimensions a path
+ * tracer would use for them, at doubling samples per pixel: "old" is the
+ * previous setup of rand_r() for the film and halton sequences, shared by
+ * the pixels of a thread, for the bounces. Last the path tracer renders the
+ * scene at equal samples with each sampler against a reference.
+ */
+
+#include <climits>
+#include <ctime>
+#include <cmath>
+#include "color.h"
+#include "obj_reader.h"
+#include "render.h"
+
+#define BENCH_PIXELS 1024
+#define BENCH_MAX_SPP 256
+#define BENCH_RES 64
+#define BENCH_SPP 16
+#define REFERENCE_SPP 1024
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * the old rngs behind the sampler interface: film dimensions from one
+ * rand_r() and others from a halton sequence of their own prime base, each
+ * drawn in turn whatever the pixel
+ */
+class OldSampler {
+public:
+	RandRng rand_r_rng{1};
+	std::vector<HaltonRng> halton;
+
+	OldSampler(uint32_t ndim)
+	{
+		std::vector<unsigned long> primes = get_primes(ndim);
+		for (uint32_t dim = 0; dim < ndim; dim++) {
+			halton.emplace_back(primes[dim]);
+		}
+	}
+
+	void start(uint32_t stream, uint32_t pixel, uint64_t sample)
+	{
+		(void)stream;
+		(void)pixel;
+		(void)sample;
+	}
+
+	float get(uint32_t dim)
+	{
+		Rng &rng = dim < 2 ? (Rng &)rand_r_rng : (Rng &)halton[dim];
+		return rng.next();
+	}
+};
+
+/** an integrand over [0, 1)^2 taking dimensions dim, dim + 1 */
+class Integrand {
+public:
+	const char *name;
+	uint32_t dim;
+	double (*f)(double x, double y);
+	double value;
+};
+
+/** film edge: a disk */
+static double disk(double x, double y)
+{
+	return x*x + y*y < 1;
+}
+
+/** smooth, like a cosine lobe */
+static double smooth(double x, double y)
+{
+	return exp(-x - y);
+}
+
+/** light seen past an edge */
+static double corner(double x, double y)
+{
+	return x < 0.3 && y < 0.6 ? 4 * x : 0;
+}
+
+static const Integrand integrands[] = {
+	{"film disk", SAMPLE_FILM_X, disk, M_PI / 4},
+	{"bounce 1 smooth", sample_bounce_dim(1) + BOUNCE_MATERIAL, smooth, SQR(1 - exp(-1))},
+	{"bounce 1 light", sample_bounce_dim(1) + BOUNCE_LIGHT_POINT, corner, 0.6 * 2 * 0.09},
+	{"bounce 3 disk", sample_bounce_dim(3) + BOUNCE_MATERIAL, disk, M_PI / 4},
+};
+
+/**
+ * @return rms error over pixels of integrand estimated with nsamples
+ * samples, drawing all the dimensions of each as the path tracer would
+ */
+template<typename Sampler>
+static double rms_err(Sampler &sampler, const Integrand &integrand, int nsamples)
+{
+	const uint32_t ndim = sample_bounce_dim(4);
+	double err2 = 0;
+
+	for (uint32_t pixel = 0; pixel < BENCH_PIXELS; pixel++) {
+		double sum = 0;
+		for (int s = 0; s < nsamples; s++) {
+			sampler.start(0, pixel, s);
+			float u[ndim];
+			for (uint32_t dim = 0; dim < ndim; dim++) {
+				u[dim] = sampler.get(dim);
+			}
+			sum += integrand.f(u[integrand.dim], u[integrand.dim + 1]);
+		}
+		err2 += SQR(sum / nsamples - integrand.value);
+	}
+	return sqrt(err2 / BENCH_PIXELS);
+}
+
+template<typename Sampler>
+static void bench_convergence(const char *name, Sampler sampler)
+{
+	printf("  %-6s", name);
+	for (int spp = 1; spp <= BENCH_MAX_SPP; spp *= 4) {
+		printf("  %4d spp:", spp);
+		for (auto &integrand : integrands) {
+			printf(" %.2e", rms_err(sampler, integrand, spp));
+		}
+	}
+	printf("\n");
+}
+
+/** @return numbers per ns drawing the dimensions of path tracer samples */
+template<typename Sampler>
+static double bench_speed(Sampler &sampler)
+{
+	const uint32_t ndim = sample_bounce_dim(3);
+	const int nsamples = 1 << 20;
+	volatile float sink;
+	float sum = 0;
+
+	double t0 = now();
+	for (int s = 0; s < nsamples; s++) {
+		sampler.start(0, s & 0xfff, s >> 12);
+		for (uint32_t dim = 0; dim < ndim; dim++) {
+			sum += sampler.get(dim);
+		}
+	}
+	double seconds = now() - t0;
+	sink = sum;
+	(void)sink;
+	return (double)nsamples * ndim / seconds / 1e9;
+}
+
+/** as bench_speed(), drawing the dimensions a group of 4 at a time */
+template<typename Sampler>
+static double bench_speed4(Sampler &sampler)
+{
+	const uint32_t ndim = sample_bounce_dim(3);
+	const int nsamples = 1 << 20;
+	volatile float sink;
+	float sum = 0;
+
+	double t0 = now();
+	for (int s = 0; s < nsamples; s++) {
+		sampler.start(0, s & 0xfff, s >> 12);
+		for (uint32_t dim = 0; dim < ndim; dim += 4) {
+			float u[4];
+			sampler.get4(dim, u);
+			sum += u[0] + u[1] + u[2] + u[3];
+		}
+	}
+	double seconds = now() - t0;
+	sink = sum;
+	(void)sink;
+	return (double)nsamples * ndim / seconds / 1e9;
+}
+
+/** store the luminance per sample of the film of spp samples per pixel in y */
+static void to_luminance(std::vector<double> &y, const MultiArray<float> &film, int spp)
+{
+	y.resize(film.n[0] * film.n[1]);
+	for (int i = 0; i < film.n[0]; i++) {
+		for (int j = 0; j < film.n[1]; j++) {
+			if (FILM_XYZ) {
+				y[i*film.n[1] + j] = film(i, j, 1) / spp;
+			} else {
+				ColorXYZ color = Color::physical_to_XYZ(&film.data[(i*film.n[1] + j)*NWAVELEN]);
+				y[i*film.n[1] + j] = color.XYZ[1] / spp;
+			}
+		}
+	}
+}
+
+/** render spp samples per pixel in tiles on the calling thread */
+static MultiArray<float> render(Scene &scene, SamplerType sampler_type, int spp)
+{
+	Camera &camera = scene.camera;
+	camera.init_sample_counts();
+	camera.raw.fill(0);
+	TileScheduler tiles{camera.ny, camera.nx, (unsigned long long)spp / TILE_SPP, 1};
+
+	PathTracer path_tracer{0, scene, ULONG_MAX, 1};
+	path_tracer.sampler_type = sampler_type;
+	path_tracer.tiles = &tiles;
+	path_tracer.render();
+	path_tracer.update_pixel_data();
+	return camera.raw;
+}
+
+static void bench_render(const char *obj_fname, const char *mtl_fname)
+{
+	ObjReader obj_reader{obj_fname, mtl_fname};
+	Camera camera{43, 35, Vec{0,-7,-0.5}, Vec{0,1,0}, BENCH_RES, BENCH_RES};
+	Scene scene{std::move(obj_reader.all_faces), std::move(obj_reader.all_materials), camera};
+	scene.init();
+
+	std::vector<double> ref, img;
+	to_luminance(ref, render(scene, SAMPLER_PCG, REFERENCE_SPP), REFERENCE_SPP);
+
+	const struct {
+		const char *name;
+		SamplerType type;
+	} samplers[] = {{"pcg", SAMPLER_PCG}, {"sobol", SAMPLER_SOBOL}, {"owen", SAMPLER_OWEN_SOBOL}};
+	printf("%s at %d spp, luminance against pcg at %d spp:\n", obj_fname, BENCH_SPP, REFERENCE_SPP);
+	for (auto &sampler : samplers) {
+		double t0 = now();
+		to_luminance(img, render(scene, sampler.type, BENCH_SPP), BENCH_SPP);
+		double seconds = now() - t0;
+
+		double err2 = 0, norm = 0;
+		for (size_t i = 0; i < ref.size(); i++) {
+			err2 += SQR(img[i] - ref[i]);
+			norm += SQR(ref[i]);
+		}
+		printf("  %-6s rel err %.4f in %.2f s\n", sampler.name, sqrt(err2 / norm), seconds);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	Color::init();
+
+	PCGSampler pcg;
+	SobolSampler sobol;
+	OwenSobolSampler owen;
+	OldSampler old{sample_bounce_dim(4)};
+	RandRng rand_r_rng{1};
+	HaltonRng halton{3};
+	printf("numbers per ns:\n");
+	printf("  pcg %.3f  sobol %.3f  owen %.3f", bench_speed(pcg), bench_speed(sobol),
+		bench_speed(owen));
+	printf("\n  get4: pcg %.3f  sobol %.3f  owen %.3f\n", bench_speed4(pcg),
+		bench_speed4(sobol), bench_speed4(owen));
+	printf("  old %.3f", bench_speed(old));
+	{
+		Rng *rngs[] = {&rand_r_rng, &halton};
+		const char *names[] = {"rand_r", "halton"};
+		for (int k = 0; k < 2; k++) {
+			const int n = 1 << 24;
+			volatile float sink;
+			float sum = 0;
+			double t0 = now();
+			for (int i = 0; i < n; i++) {
+				sum += rngs[k]->next();
+			}
+			double seconds = now() - t0;
+			sink = sum;
+			(void)sink;
+			printf("  %s %.3f", names[k], n / seconds / 1e9);
+		}
+	}
+	printf("\n");
+
+	printf("rms error over %d pixels of", BENCH_PIXELS);
+	for (auto &integrand : integrands) {
+		printf(" %s,", integrand.name);
+	}
+	printf("\n");
+	bench_convergence("pcg", pcg);
+	bench_convergence("sobol", sobol);
+	bench_convergence("owen", owen);
+	bench_convergence("old", OldSampler{sample_bounce_dim(4)});
+
+	if (argc >= 3) {
+		bench_render(argv[1], argv[2]);
+	} else {
+		bench_render("../scenes/cornell_box.obj", "../scenes/cornell_box.mtl");
+	}
+
+	return 0;
+}
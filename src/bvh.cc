@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Flattened bounding volume hierarchy built with the surface area
+ * heuristic for ray-triangle intersection.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include "bvh.h"
+#include "parallel.h"
+
+/* see scene.cc */
+extern float global_characteristic_length_scale;
+
+/** per face data only needed while building */
+class BVHBuildRef {
+public:
+	Box box;
+	Vec centroid;
+	Face *face;
+};
+
+/** subtree whose build is deferred so that subtrees can run in parallel */
+class BVHBuildTask {
+public:
+	uint32_t node_ind;
+	size_t begin;
+	size_t end;
+	int depth;
+};
+
+typedef std::vector<BVHNode, CacheAlignedAllocator<BVHNode>> BVHNodeVector;
+
+static Box empty_box()
+{
+	return Box{FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX};
+}
+
+static void box_grow(Box &b, const Box &other)
+{
+	for (int i = 0; i < 3; i++) {
+		b.corners[0][i] = fminf(b.corners[0][i], other.corners[0][i]);
+		b.corners[1][i] = fmaxf(b.corners[1][i], other.corners[1][i]);
+	}
+}
+
+static void box_grow(Box &b, const Vec &v)
+{
+	for (int i = 0; i < 3; i++) {
+		b.corners[0][i] = fminf(b.corners[0][i], v.x[i]);
+		b.corners[1][i] = fmaxf(b.corners[1][i], v.x[i]);
+	}
+}
+
+/**
+ * Recursively builds the subtree for refs[begin...end-1] into
+ * nodes[node_ind]. Uses binned SAH along the axis of largest centroid
+ * extent: cost = traversal + (A_left N_left + A_right N_right) / A_parent.
+ * A leaf is made if it is cheaper (and small enough) or the split cannot
+ * separate the faces. refs are partitioned in place, so the only allocation
+ * is growth of nodes.
+ *
+ * @param tasks if not nullptr, subtrees of at most task_size faces are not
+ * built but appended here
+ */
+static void build_recursive(BVHNodeVector &nodes, std::vector<BVHBuildRef> &refs,
+	uint32_t node_ind, size_t begin, size_t end, size_t max_faces_per_leaf,
+	int depth, std::vector<BVHBuildTask> *tasks, size_t task_size)
+{
+	const size_t n = end - begin;
+	if (tasks != nullptr && n <= task_size) {
+		tasks->push_back(BVHBuildTask{node_ind, begin, end, depth});
+		return;
+	}
+
+	Box bounds = empty_box();
+	Box centroid_bounds = empty_box();
+	for (size_t i = begin; i < end; i++) {
+		box_grow(bounds, refs[i].box);
+		box_grow(centroid_bounds, refs[i].centroid);
+	}
+
+	/* pad to be robust against flat boxes of axis aligned faces */
+	const float pad = GEOMETRY_EPSILON * global_characteristic_length_scale;
+	for (int i = 0; i < 3; i++) {
+		bounds.corners[0][i] -= pad;
+		bounds.corners[1][i] += pad;
+	}
+	nodes[node_ind].box = bounds;
+
+	/* split axis is that of largest centroid extent */
+	int axis = 0;
+	float extent = -1;
+	for (int i = 0; i < 3; i++) {
+		float e = centroid_bounds.corners[1][i] - centroid_bounds.corners[0][i];
+		if (e > extent) {
+			extent = e;
+			axis = i;
+		}
+	}
+
+	if (n <= 1 || depth >= BVH_STACK_SIZE - 1 || extent <= 0) {
+		nodes[node_ind].offset = begin;
+		nodes[node_ind].nfaces = n;
+		return;
+	}
+
+	/* bin faces by centroid */
+	const float cmin = centroid_bounds.corners[0][axis];
+	const float bin_scale = BVH_SAH_NBIN / extent;
+	size_t bin_count[BVH_SAH_NBIN] = {0};
+	Box bin_box[BVH_SAH_NBIN];
+	for (int b = 0; b < BVH_SAH_NBIN; b++) {
+		bin_box[b] = empty_box();
+	}
+	auto bin_of = [&](const BVHBuildRef &ref) {
+		int b = (int)(bin_scale * (ref.centroid.x[axis] - cmin));
+		return std::min(BVH_SAH_NBIN - 1, std::max(0, b));
+	};
+	for (size_t i = begin; i < end; i++) {
+		int b = bin_of(refs[i]);
+		bin_count[b]++;
+		box_grow(bin_box[b], refs[i].box);
+	}
+
+	/* sweep from right to get area and count right of each split */
+	float right_area[BVH_SAH_NBIN];
+	size_t right_count[BVH_SAH_NBIN];
+	Box acc = empty_box();
+	size_t count = 0;
+	for (int b = BVH_SAH_NBIN - 1; b > 0; b--) {
+		box_grow(acc, bin_box[b]);
+		count += bin_count[b];
+		right_area[b] = box_half_area(acc);
+		right_count[b] = count;
+	}
+
+	/* sweep from left: split s puts bins [0, s) left */
+	const float inv_parent_area = 1.0f / box_half_area(bounds);
+	float best_cost = FLT_MAX;
+	int best_split = -1;
+	acc = empty_box();
+	count = 0;
+	for (int s = 1; s < BVH_SAH_NBIN; s++) {
+		box_grow(acc, bin_box[s-1]);
+		count += bin_count[s-1];
+		float cost = BVH_SAH_TRAVERSAL_COST + inv_parent_area
+			* (box_half_area(acc) * tri_block_count(count)
+			+ right_area[s] * tri_block_count(right_count[s]));
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_split = s;
+		}
+	}
+
+	if (n <= max_faces_per_leaf && (float)tri_block_count(n) <= best_cost) {
+		nodes[node_ind].offset = begin;
+		nodes[node_ind].nfaces = n;
+		return;
+	}
+
+	auto mid_it = std::partition(refs.begin() + begin, refs.begin() + end,
+		[&](const BVHBuildRef &ref) { return bin_of(ref) < best_split; });
+	size_t mid = mid_it - refs.begin();
+	if (mid == begin || mid == end) {
+		/* fallback to median split */
+		mid = begin + n / 2;
+		std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+			[&](const BVHBuildRef &a, const BVHBuildRef &b) {
+				return a.centroid.x[axis] < b.centroid.x[axis];
+			});
+	}
+
+	/* siblings are allocated together; do not hold references across this */
+	const uint32_t left = nodes.size();
+	nodes.resize(nodes.size() + 2);
+	nodes[node_ind].offset = left;
+	nodes[node_ind].nfaces = 0;
+
+	build_recursive(nodes, refs, left, begin, mid, max_faces_per_leaf,
+		depth + 1, tasks, task_size);
+	build_recursive(nodes, refs, left + 1, mid, end, max_faces_per_leaf,
+		depth + 1, tasks, task_size);
+}
+
+/**
+ * @param all_faces face list
+ * @param max_faces_per_leaf leaves are never made larger than this unless
+ * the faces cannot be split further
+ * @param nthread number of threads to build with; the tree does not depend
+ * on it
+ */
+BVH::BVH(const std::vector<Face*> &all_faces, size_t max_faces_per_leaf, int nthread)
+{
+	const size_t nfaces = all_faces.size();
+	std::vector<BVHBuildRef> refs{nfaces};
+	parallel_for(nfaces, 4096, nthread, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			refs[i].face = all_faces[i];
+			refs[i].box = face_bounding_box(*all_faces[i]);
+			refs[i].centroid = (1.0f / 3.0f) * (all_faces[i]->v[0] + all_faces[i]->v[1] + all_faces[i]->v[2]);
+		}
+	});
+
+	/* top of tree on this thread: stop at subtrees small enough to give each
+	thread several */
+	std::vector<BVHBuildTask> tasks;
+	const size_t task_size = std::max((size_t)1,
+		nfaces / (ACCEL_BUILD_TASKS_PER_THREAD * std::max(nthread, 1)));
+
+	/* root and padding so that sibling pairs start at even indices */
+	nodes.reserve(2 * nfaces + 2);
+	nodes.resize(2);
+	nodes[1].offset = 0;
+	nodes[1].nfaces = 0;
+	build_recursive(nodes, refs, 0, 0, nfaces, max_faces_per_leaf, 0,
+		nthread > 1 ? &tasks : nullptr, task_size);
+
+	/* subtrees in parallel, each into its own node array: the task ranges of
+	refs are disjoint */
+	std::vector<BVHNodeVector> subtrees(tasks.size());
+	parallel_for(tasks.size(), 1, nthread, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const BVHBuildTask &task = tasks[i];
+			subtrees[i].reserve(2 * (task.end - task.begin) + 2);
+			subtrees[i].resize(2);
+			subtrees[i][1] = nodes[1];
+			build_recursive(subtrees[i], refs, 0, task.begin, task.end,
+				max_faces_per_leaf, task.depth, nullptr, 0);
+		}
+	});
+
+	/* splice subtrees in: their root replaces the task node, the rest
+	(after their padding) is appended, keeping sibling pairs even */
+	for (size_t i = 0; i < tasks.size(); i++) {
+		const BVHNodeVector &subtree = subtrees[i];
+		const uint32_t base = nodes.size();
+		auto relocate = [&](BVHNode node) {
+			if (node.nfaces == 0) {
+				node.offset = base + node.offset - 2;
+			}
+			return node;
+		};
+		nodes[tasks[i].node_ind] = relocate(subtree[0]);
+		for (size_t j = 2; j < subtree.size(); j++) {
+			nodes.push_back(relocate(subtree[j]));
+		}
+	}
+	nodes.shrink_to_fit();
+
+	/* leaves now index refs: convert to blocks of SoA faces */
+	std::vector<Face*> faces(nfaces);
+	for (size_t i = 0; i < nfaces; i++) {
+		faces[i] = refs[i].face;
+	}
+	std::vector<uint32_t> leaf_first_face;
+	std::vector<uint32_t> leaf_node;
+	uint32_t nblocks = 0;
+	for (uint32_t i = 0; i < nodes.size(); i++) {
+		BVHNode &node = nodes[i];
+		if (node.nfaces > 0) {
+			leaf_node.push_back(i);
+			leaf_first_face.push_back(node.offset);
+			node.offset = nblocks;
+			nblocks += tri_block_count(node.nfaces);
+		}
+	}
+	blocks.resize(nblocks);
+	parallel_for(leaf_node.size(), 1024, nthread, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const BVHNode &node = nodes[leaf_node[i]];
+			write_tri_blocks(&blocks[node.offset], &faces[leaf_first_face[i]], node.nfaces);
+		}
+	});
+}
+
+/**
+ * slab test with precomputed reciprocal ray direction
+ *
+ * @return ray parameter t where ray enters box (0 if origin inside), or
+ * negative if box is missed or entered at or after tmax
+ */
+static inline float ray_box_slab(const Box &b, const Ray &r, const float *inv_dir, float tmax)
+{
+	float t0, t1;
+	if (ray_box_interval(&t0, &t1, r, b, inv_dir, tmax) && t0 < tmax) {
+		return t0;
+	} else {
+		return -1;
+	}
+}
+
+/**
+ * iterative front to back traversal: the nearer child is visited first and
+ * the farther one is pushed along with its entry time so it can be culled
+ * once a closer face hit is known
+ *
+ * @param point stores the point intersected here
+ * @param face stores the face intersected here
+ * @param material_index stores its Face::material_index here
+ * @param r the ray with which to intersect
+ */
+bool BVH::first_ray_material_intersect(Vec *point, Face **face, int *material_index,
+	const Ray &r)
+{
+	float inv_dir[3];
+	ray_inv_dir(inv_dir, r);
+
+	float tmin = FLT_MAX;
+	Face *hit_face = nullptr;
+	int hit_material = -1;
+
+	uint32_t stack_node[BVH_STACK_SIZE];
+	float stack_t[BVH_STACK_SIZE];
+	int sp = 0;
+
+	if (ray_box_slab(nodes[0].box, r, inv_dir, tmin) < 0) {
+		return false;
+	}
+
+	uint32_t ind = 0;
+	for (;;) {
+		const BVHNode &node = nodes[ind];
+		if (node.nfaces > 0) {
+			/* leaf */
+			tri_blocks_intersect(&blocks[node.offset], tri_block_count(node.nfaces),
+				r, 0, &tmin, &hit_face, &hit_material);
+		} else {
+			float t[2];
+			t[0] = ray_box_slab(nodes[node.offset].box, r, inv_dir, tmin);
+			t[1] = ray_box_slab(nodes[node.offset + 1].box, r, inv_dir, tmin);
+
+			if (t[0] >= 0 && t[1] >= 0) {
+				int near = t[1] < t[0];
+				stack_node[sp] = node.offset + !near;
+				stack_t[sp] = t[!near];
+				sp++;
+				ind = node.offset + near;
+				continue;
+			} else if (t[0] >= 0) {
+				ind = node.offset;
+				continue;
+			} else if (t[1] >= 0) {
+				ind = node.offset + 1;
+				continue;
+			}
+		}
+
+		/* pop, skipping nodes that are farther than the current hit */
+		do {
+			if (sp == 0) {
+				goto done;
+			}
+			sp--;
+		} while (stack_t[sp] >= tmin);
+		ind = stack_node[sp];
+	}
+
+done:
+	if (hit_face != nullptr) {
+		*point = r.orig + tmin * r.dir;
+		*face = hit_face;
+		*material_index = hit_material;
+		return true;
+	}
+	return false;
+}
+
+bool BVH::first_ray_face_intersect(Vec *point, Face **face, const Ray &r)
+{
+	int material_index;
+	return first_ray_material_intersect(point, face, &material_index, r);
+}
+
+/**
+ * any-hit query: both children of a node are visited if hit, in storage
+ * order, and the search stops at the first face hit before tmax
+ *
+ * @param r the ray with which to intersect
+ * @param tmax only hits closer than this count
+ */
+bool BVH::occluded(const Ray &r, float tmax)
+{
+	float inv_dir[3];
+	ray_inv_dir(inv_dir, r);
+
+	uint32_t stack_node[BVH_STACK_SIZE];
+	int sp = 0;
+
+	if (ray_box_slab(nodes[0].box, r, inv_dir, tmax) < 0) {
+		return false;
+	}
+
+	uint32_t ind = 0;
+	for (;;) {
+		const BVHNode &node = nodes[ind];
+		if (node.nfaces > 0) {
+			/* leaf */
+			float t = tmax;
+			Face *hit_face;
+			int hit_material;
+			if (tri_blocks_occluded(&blocks[node.offset], tri_block_count(node.nfaces),
+				r, 0, &t, &hit_face, &hit_material)) {
+				return true;
+			}
+		} else {
+			bool hit0 = ray_box_slab(nodes[node.offset].box, r, inv_dir, tmax) >= 0;
+			bool hit1 = ray_box_slab(nodes[node.offset + 1].box, r, inv_dir, tmax) >= 0;
+
+			if (hit0 && hit1) {
+				stack_node[sp++] = node.offset + 1;
+				ind = node.offset;
+				continue;
+			} else if (hit0) {
+				ind = node.offset;
+				continue;
+			} else if (hit1) {
+				ind = node.offset + 1;
+				continue;
+			}
+		}
+
+		if (sp == 0) {
+			return false;
+		}
+		ind = stack_node[--sp];
+	}
+}
+
+/** @return approximate memory used */
+size_t BVH::bytes() const
+{
+	return sizeof(*this) + nodes.capacity() * sizeof(nodes[0])
+		+ blocks.capacity() * sizeof(blocks[0]);
+}
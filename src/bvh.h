@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include <cstdint>
+#include <new>
+#include "macro_def.h"
+#include "accel.h"
+#include "tri_block.h"
+
+/** allocator so that std::vector storage begins on a cache line */
+template<typename T> class CacheAlignedAllocator {
+public:
+	typedef T value_type;
+
+	CacheAlignedAllocator() {}
+	template<typename U> CacheAlignedAllocator(const CacheAlignedAllocator<U> &other) { (void)other; }
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(CACHE_LINE_SIZE)));
+	}
+	void deallocate(T *p, size_t n)
+	{
+		(void)n;
+		::operator delete(p, std::align_val_t(CACHE_LINE_SIZE));
+	}
+
+	template<typename U> bool operator==(const CacheAlignedAllocator<U> &other) const { (void)other; return true; }
+	template<typename U> bool operator!=(const CacheAlignedAllocator<U> &other) const { (void)other; return false; }
+};
+
+/**
+ * flattened bvh node: 32 bytes so that two siblings share a cache line
+ */
+class alignas(32) BVHNode {
+public:
+	Box box;
+	/** inner node: index of left child (right child is next);
+	 * leaf: index of first block in BVH::blocks */
+	uint32_t offset;
+	/** number of faces if leaf, 0 if inner node */
+	uint32_t nfaces;
+};
+
+/**
+ * bounding volume hierarchy built with the surface area heuristic (SAH). Nodes
+ * are stored depth first in one flat array: root is nodes[0], nodes[1] is
+ * padding, and siblings are allocated in pairs at even indices.
+ */
+class BVH : public AccelStruct {
+public:
+	std::vector<BVHNode, CacheAlignedAllocator<BVHNode>> nodes;
+	/** leaves hold ranges into this; faces point into Scene::all_faces */
+	std::vector<TriBlock> blocks;
+
+	BVH() {};
+	BVH(const std::vector<Face*> &all_faces, size_t max_faces_per_leaf,
+		int nthread = NTHREAD);
+
+	bool first_ray_face_intersect(Vec *point, Face **face, const Ray &r);
+	bool first_ray_material_intersect(Vec *point, Face **face, int *material_index,
+		const Ray &r);
+	bool occluded(const Ray &r, float tmax);
+	size_t bytes() const;
+};
+
+#endif /* BVH_H */
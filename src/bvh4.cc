@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief 4-wide bounding volume hierarchy with SIMD child box tests.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include "bvh4.h"
+
+#if defined(__SSE2__)
+#define BVH4_SSE 1
+#include <immintrin.h>
+#else
+#define BVH4_SSE 0
+#endif
+
+static void set_child_box(BVH4Node &node, int k, const Box &box)
+{
+	for (int i = 0; i < 3; i++) {
+		node.bounds[0][i][k] = box.corners[0][i];
+		node.bounds[1][i][k] = box.corners[1][i];
+	}
+}
+
+static void set_child_empty(BVH4Node &node, int k)
+{
+	set_child_box(node, k, Box{FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX});
+	node.child[k] = 0;
+	node.nfaces[k] = 0;
+}
+
+/**
+ * @param all_faces face list
+ * @param max_faces_per_leaf see BVH::BVH()
+ * @param nthread number of threads to build the binary bvh with
+ */
+BVH4::BVH4(const std::vector<Face*> &all_faces, size_t max_faces_per_leaf, int nthread)
+{
+	BVH bvh{all_faces, max_faces_per_leaf, nthread};
+	blocks = std::move(bvh.blocks);
+
+	const BVHNode &root = bvh.nodes[0];
+	if (root.nfaces > 0 || all_faces.empty()) {
+		/* root is a leaf: single node with one child */
+		BVH4Node &node = nodes.emplace_back();
+		for (int k = 0; k < 4; k++) {
+			set_child_empty(node, k);
+		}
+		if (root.nfaces > 0) {
+			set_child_box(node, 0, root.box);
+			node.child[0] = root.offset;
+			node.nfaces[0] = root.nfaces;
+		}
+	} else {
+		nodes.reserve(bvh.nodes.size() / 3 + 1);
+		_collapse(bvh, 0);
+	}
+	nodes.shrink_to_fit();
+}
+
+/**
+ * Recursively make 4-wide node from inner node bvh.nodes[bvh_node_ind]:
+ * start with its 2 children and repeatedly replace the inner child of
+ * largest surface area (most likely to be hit) with its own 2 children.
+ *
+ * @return index of new node in nodes
+ */
+uint32_t BVH4::_collapse(const BVH &bvh, uint32_t bvh_node_ind)
+{
+	const uint32_t first = bvh.nodes[bvh_node_ind].offset;
+	uint32_t kids[4] = {first, first + 1, 0, 0};
+	int nkids = 2;
+	while (nkids < 4) {
+		int best = -1;
+		float best_area = -1;
+		for (int k = 0; k < nkids; k++) {
+			const BVHNode &kid = bvh.nodes[kids[k]];
+			float area = box_half_area(kid.box);
+			if (kid.nfaces == 0 && area > best_area) {
+				best = k;
+				best_area = area;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+
+		const uint32_t offset = bvh.nodes[kids[best]].offset;
+		kids[best] = offset;
+		kids[nkids++] = offset + 1;
+	}
+
+	const uint32_t node_ind = nodes.size();
+	nodes.emplace_back();
+	for (int k = 0; k < 4; k++) {
+		if (k >= nkids) {
+			set_child_empty(nodes[node_ind], k);
+			continue;
+		}
+
+		const BVHNode &kid = bvh.nodes[kids[k]];
+		/* recursion may reallocate nodes: index again afterwards */
+		uint32_t child = kid.nfaces > 0 ? kid.offset : _collapse(bvh, kids[k]);
+		BVH4Node &node = nodes[node_ind];
+		set_child_box(node, k, kid.box);
+		node.child[k] = child;
+		node.nfaces[k] = kid.nfaces;
+	}
+	return node_ind;
+}
+
+/**
+ * Slab test of ray against all 4 child boxes of node. The near plane of each
+ * axis is known from the sign of the ray direction so no min/max per axis is
+ * needed.
+ *
+ * @param tenter set to ray parameter where each child box is entered
+ * @return bit mask of children hit before tmax
+ */
+static inline int slab_test4(const BVH4Node &node, const float *orig,
+	const float *inv_dir, const int *near, float tmax, float *tenter)
+{
+#if BVH4_SSE
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(tmax);
+	for (int i = 0; i < 3; i++) {
+		const __m128 o = _mm_set1_ps(orig[i]);
+		const __m128 inv = _mm_set1_ps(inv_dir[i]);
+		__m128 tnear = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[near[i]][i]), o), inv);
+		__m128 tfar = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[!near[i]][i]), o), inv);
+		t0 = _mm_max_ps(t0, tnear);
+		t1 = _mm_min_ps(t1, tfar);
+	}
+	_mm_storeu_ps(tenter, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+	int mask = 0;
+	for (int k = 0; k < 4; k++) {
+		float t0 = 0;
+		float t1 = tmax;
+		for (int i = 0; i < 3; i++) {
+			t0 = fmaxf(t0, (node.bounds[near[i]][i][k] - orig[i]) * inv_dir[i]);
+			t1 = fminf(t1, (node.bounds[!near[i]][i][k] - orig[i]) * inv_dir[i]);
+		}
+		tenter[k] = t0;
+		mask |= (t0 <= t1) << k;
+	}
+	return mask;
+#endif
+}
+
+/**
+ * iterative traversal: hit children of a node are sorted by entry time and
+ * pushed far to near so the nearest is popped first; stacked entries are
+ * culled once a closer face hit is known
+ *
+ * @param point stores the point intersected here
+ * @param face stores the face intersected here
+ * @param material_index stores its Face::material_index here
+ * @param r the ray with which to intersect
+ */
+bool BVH4::first_ray_material_intersect(Vec *point, Face **face, int *material_index,
+	const Ray &r)
+{
+	float inv_dir[3];
+	int near[3];
+	ray_inv_dir(inv_dir, r);
+	for (int i = 0; i < 3; i++) {
+		near[i] = inv_dir[i] < 0;
+	}
+
+	float tmin = FLT_MAX;
+	Face *hit_face = nullptr;
+	int hit_material = -1;
+
+	/* stack entries are children: node index or leaf block range */
+	uint32_t stack_child[BVH4_STACK_SIZE];
+	uint32_t stack_nfaces[BVH4_STACK_SIZE];
+	float stack_t[BVH4_STACK_SIZE];
+	int sp = 0;
+
+	uint32_t child = 0;
+	uint32_t nfaces = 0;
+	for (;;) {
+		if (nfaces > 0) {
+			/* leaf */
+			tri_blocks_intersect(&blocks[child], tri_block_count(nfaces),
+				r, 0, &tmin, &hit_face, &hit_material);
+		} else {
+			const BVH4Node &node = nodes[child];
+			float tenter[4];
+			int mask = slab_test4(node, r.orig.x, inv_dir, near, tmin, tenter);
+
+			/* compact hit children then insertion sort by entry time */
+			int order[4];
+			int nhit = 0;
+			for (; mask; mask &= mask - 1) {
+				int k = __builtin_ctz(mask);
+				int j = nhit++;
+				for (; j > 0 && tenter[order[j-1]] > tenter[k]; j--) {
+					order[j] = order[j-1];
+				}
+				order[j] = k;
+			}
+
+			/* push far to near */
+			for (int j = nhit - 1; j >= 0; j--) {
+				int k = order[j];
+				stack_child[sp] = node.child[k];
+				stack_nfaces[sp] = node.nfaces[k];
+				stack_t[sp] = tenter[k];
+				sp++;
+			}
+		}
+
+		/* pop, skipping children that are farther than the current hit */
+		do {
+			if (sp == 0) {
+				goto done;
+			}
+			sp--;
+		} while (stack_t[sp] >= tmin);
+		child = stack_child[sp];
+		nfaces = stack_nfaces[sp];
+	}
+
+done:
+	if (hit_face != nullptr) {
+		*point = r.orig + tmin * r.dir;
+		*face = hit_face;
+		*material_index = hit_material;
+		return true;
+	}
+	return false;
+}
+
+bool BVH4::first_ray_face_intersect(Vec *point, Face **face, const Ray &r)
+{
+	int material_index;
+	return first_ray_material_intersect(point, face, &material_index, r);
+}
+
+/**
+ * Interval arithmetic slab test (Boulos et al. 2006) of a packet of rays from
+ * orig against all 4 child boxes of node: with the reciprocal directions of
+ * the rays in [inv_lo, inv_hi] per axis, all of one sign, the interval of the
+ * entry and exit times of the rays bounds those of every ray.
+ *
+ * @param tenter set to a lower bound of where the rays enter each child box
+ * @return bit mask of children that some ray may hit before tmax
+ */
+static inline int frustum_test4(const BVH4Node &node, const float *orig,
+	const float *inv_lo, const float *inv_hi, const int *near, float tmax,
+	float *tenter)
+{
+#if BVH4_SSE
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(tmax);
+	for (int i = 0; i < 3; i++) {
+		const __m128 o = _mm_set1_ps(orig[i]);
+		const __m128 lo = _mm_set1_ps(inv_lo[i]);
+		const __m128 hi = _mm_set1_ps(inv_hi[i]);
+		__m128 d0 = _mm_sub_ps(_mm_load_ps(node.bounds[near[i]][i]), o);
+		__m128 d1 = _mm_sub_ps(_mm_load_ps(node.bounds[!near[i]][i]), o);
+		t0 = _mm_max_ps(t0, _mm_min_ps(_mm_mul_ps(d0, lo), _mm_mul_ps(d0, hi)));
+		t1 = _mm_min_ps(t1, _mm_max_ps(_mm_mul_ps(d1, lo), _mm_mul_ps(d1, hi)));
+	}
+	_mm_storeu_ps(tenter, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+	int mask = 0;
+	for (int k = 0; k < 4; k++) {
+		float t0 = 0;
+		float t1 = tmax;
+		for (int i = 0; i < 3; i++) {
+			const float d0 = node.bounds[near[i]][i][k] - orig[i];
+			const float d1 = node.bounds[!near[i]][i][k] - orig[i];
+			t0 = fmaxf(t0, fminf(d0 * inv_lo[i], d0 * inv_hi[i]));
+			t1 = fminf(t1, fmaxf(d1 * inv_lo[i], d1 * inv_hi[i]));
+		}
+		tenter[k] = t0;
+		mask |= (t0 <= t1) << k;
+	}
+	return mask;
+#endif
+}
+
+/**
+ * Closest hits of a packet of up to RAY_PACKET_SIZE rays from orig: each
+ * stack entry carries the bit mask of the rays that hit its box. A node is
+ * first culled for the whole packet by frustum_test4(), then each of its
+ * rays is tested by slab_test4() against the children that survive, so node
+ * data is loaded once for the packet and leaves intersect only the rays that
+ * reach them. Entries are ordered and culled by the packet's entry bound
+ * against the farthest closest hit of its rays. Rays whose directions differ
+ * in sign on some axis have no interval bound and are traced one at a time.
+ */
+void BVH4::_intersect_packet(const Vec &orig, const float *const dir[3], int n,
+	float *const point[3], Face **face, int *material_index)
+{
+	Ray rays[RAY_PACKET_SIZE];
+	float inv_dir[RAY_PACKET_SIZE][3];
+	float tmin[RAY_PACKET_SIZE];
+	Face *hit_face[RAY_PACKET_SIZE];
+
+	float inv_lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+	float inv_hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (int k = 0; k < n; k++) {
+		rays[k].orig = orig;
+		rays[k].dir = Vec{dir[0][k], dir[1][k], dir[2][k]};
+		ray_inv_dir(inv_dir[k], rays[k]);
+		for (int i = 0; i < 3; i++) {
+			inv_lo[i] = fminf(inv_lo[i], inv_dir[k][i]);
+			inv_hi[i] = fmaxf(inv_hi[i], inv_dir[k][i]);
+		}
+		tmin[k] = FLT_MAX;
+		hit_face[k] = nullptr;
+	}
+
+	int near[3];
+	for (int i = 0; i < 3; i++) {
+		near[i] = inv_hi[i] < 0;
+		if (near[i] != (inv_lo[i] < 0)) {
+			for (int k = 0; k < n; k++) {
+				Vec p;
+				if (!first_ray_material_intersect(&p, &face[k], &material_index[k],
+					rays[k])) {
+					face[k] = nullptr;
+					continue;
+				}
+				for (int d = 0; d < 3; d++) {
+					point[d][k] = p.x[d];
+				}
+			}
+			return;
+		}
+	}
+
+	uint32_t stack_child[BVH4_STACK_SIZE];
+	uint32_t stack_nfaces[BVH4_STACK_SIZE];
+	uint64_t stack_mask[BVH4_STACK_SIZE];
+	float stack_t[BVH4_STACK_SIZE];
+	int sp = 0;
+
+	/* farthest closest hit of the rays so far */
+	float packet_tmax = FLT_MAX;
+
+	uint32_t child = 0;
+	uint32_t nfaces = 0;
+	uint64_t mask = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+	for (;;) {
+		if (nfaces > 0) {
+			/* leaf */
+			for (uint64_t m = mask; m; m &= m - 1) {
+				const int k = __builtin_ctzll(m);
+				tri_blocks_intersect(&blocks[child], tri_block_count(nfaces),
+					rays[k], 0, &tmin[k], &hit_face[k], &material_index[k]);
+			}
+			packet_tmax = 0;
+			for (int k = 0; k < n; k++) {
+				packet_tmax = fmaxf(packet_tmax, tmin[k]);
+			}
+		} else {
+			const BVH4Node &node = nodes[child];
+			float tenter[4];
+			const int may_hit = frustum_test4(node, orig.x, inv_lo, inv_hi, near,
+				packet_tmax, tenter);
+
+			uint64_t child_mask[4] = {0, 0, 0, 0};
+			if (may_hit) {
+				for (uint64_t m = mask; m; m &= m - 1) {
+					const int k = __builtin_ctzll(m);
+					float t[4];
+					int hit = may_hit & slab_test4(node, orig.x, inv_dir[k],
+						near, tmin[k], t);
+					for (; hit; hit &= hit - 1) {
+						child_mask[__builtin_ctz(hit)] |= (uint64_t)1 << k;
+					}
+				}
+			}
+
+			/* as first_ray_face_intersect() by the packet's entry bound */
+			int order[4];
+			int nhit = 0;
+			for (int k = 0; k < 4; k++) {
+				if (child_mask[k] == 0) {
+					continue;
+				}
+				int j = nhit++;
+				for (; j > 0 && tenter[order[j-1]] > tenter[k]; j--) {
+					order[j] = order[j-1];
+				}
+				order[j] = k;
+			}
+			for (int j = nhit - 1; j >= 0; j--) {
+				int k = order[j];
+				stack_child[sp] = node.child[k];
+				stack_nfaces[sp] = node.nfaces[k];
+				stack_mask[sp] = child_mask[k];
+				stack_t[sp] = tenter[k];
+				sp++;
+			}
+		}
+
+		do {
+			if (sp == 0) {
+				goto done;
+			}
+			sp--;
+		} while (stack_t[sp] >= packet_tmax);
+		child = stack_child[sp];
+		nfaces = stack_nfaces[sp];
+		mask = stack_mask[sp];
+	}
+
+done:
+	for (int k = 0; k < n; k++) {
+		face[k] = hit_face[k];
+		if (hit_face[k] != nullptr) {
+			for (int d = 0; d < 3; d++) {
+				point[d][k] = orig.x[d] + tmin[k] * dir[d][k];
+			}
+		}
+	}
+}
+
+/**
+ * closest hits of n rays from orig, traced in packets of RAY_PACKET_SIZE
+ * (see _intersect_packet()): coherent rays, such as the camera rays of
+ * neighbouring pixels, share most of their traversal
+ */
+void BVH4::first_ray_face_intersect_packet(const Vec &orig, const float *const dir[3],
+	int n, float *const point[3], Face **face, int *material_index)
+{
+	for (int first = 0; first < n; first += RAY_PACKET_SIZE) {
+		const int m = std::min(RAY_PACKET_SIZE, n - first);
+		const float *const packet_dir[3] = {dir[0] + first, dir[1] + first, dir[2] + first};
+		float *const packet_point[3] = {point[0] + first, point[1] + first, point[2] + first};
+		_intersect_packet(orig, packet_dir, m, packet_point, &face[first],
+			&material_index[first]);
+	}
+}
+
+/**
+ * any-hit query: all hit children are pushed unsorted and the search stops
+ * at the first face hit before tmax
+ *
+ * @param r the ray with which to intersect
+ * @param tmax only hits closer than this count
+ */
+bool BVH4::occluded(const Ray &r, float tmax)
+{
+	float inv_dir[3];
+	int near[3];
+	ray_inv_dir(inv_dir, r);
+	for (int i = 0; i < 3; i++) {
+		near[i] = inv_dir[i] < 0;
+	}
+
+	uint32_t stack_child[BVH4_STACK_SIZE];
+	uint32_t stack_nfaces[BVH4_STACK_SIZE];
+	int sp = 0;
+
+	uint32_t child = 0;
+	uint32_t nfaces = 0;
+	for (;;) {
+		if (nfaces > 0) {
+			/* leaf */
+			float t = tmax;
+			Face *hit_face;
+			int hit_material;
+			if (tri_blocks_occluded(&blocks[child], tri_block_count(nfaces),
+				r, 0, &t, &hit_face, &hit_material)) {
+				return true;
+			}
+		} else {
+			const BVH4Node &node = nodes[child];
+			float tenter[4];
+			int mask = slab_test4(node, r.orig.x, inv_dir, near, tmax, tenter);
+			for (; mask; mask &= mask - 1) {
+				int k = __builtin_ctz(mask);
+				stack_child[sp] = node.child[k];
+				stack_nfaces[sp] = node.nfaces[k];
+				sp++;
+			}
+		}
+
+		if (sp == 0) {
+			return false;
+		}
+		sp--;
+		child = stack_child[sp];
+		nfaces = stack_nfaces[sp];
+	}
+}
+
+/** @return approximate memory used */
+size_t BVH4::bytes() const
+{
+	return sizeof(*this) + nodes.capacity() * sizeof(nodes[0])
+		+ blocks.capacity() * sizeof(blocks[0]);
+}
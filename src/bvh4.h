@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "bvh.h"
+
+/**
+ * 4-wide bvh node: child bounds in SoA so one ray is tested against all 4
+ * child boxes at once; 128 bytes = 2 cache lines
+ */
+class alignas(CACHE_LINE_SIZE) BVH4Node {
+public:
+	/** child boxes: bounds[min/max][xyz][child]; empty slots are inverted
+	 * boxes that are never hit */
+	float bounds[2][3][4];
+	/** inner child: index into BVH4::nodes; leaf child: first block in
+	 * BVH4::blocks */
+	uint32_t child[4];
+	/** number of faces if child is leaf, 0 if inner or empty */
+	uint32_t nfaces[4];
+};
+
+/**
+ * 4-wide bvh collapsed from the binary SAH BVH: each node absorbs the
+ * children of its largest children until it has 4
+ */
+class BVH4 : public AccelStruct {
+public:
+	std::vector<BVH4Node> nodes;
+	/** leaves hold ranges into this; faces point into Scene::all_faces */
+	std::vector<TriBlock> blocks;
+
+	BVH4() {};
+	BVH4(const std::vector<Face*> &all_faces, size_t max_faces_per_leaf,
+		int nthread = NTHREAD);
+
+	uint32_t _collapse(const BVH &bvh, uint32_t bvh_node_ind);
+	bool first_ray_face_intersect(Vec *point, Face **face, const Ray &r);
+	bool first_ray_material_intersect(Vec *point, Face **face, int *material_index,
+		const Ray &r);
+	void _intersect_packet(const Vec &orig, const float *const dir[3], int n,
+		float *const point[3], Face **face, int *material_index);
+	void first_ray_face_intersect_packet(const Vec &orig, const float *const dir[3],
+		int n, float *const point[3], Face **face, int *material_index);
+	bool occluded(const Ray &r, float tmax);
+	size_t bytes() const;
+};
+
+#endif /* BVH4_H */
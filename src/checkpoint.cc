@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Checkpoints of the render in a memory mapped file.
+ *
+ * Slot layout after its SlotHeader: rng states (nthread * rng_state_len
+ * words), then floats: raw, spp, raw_half, probe_raw.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "RRCKPT1"
+#define CHECKPOINT_PAGE 4096
+
+static size_t round_up_page(size_t bytes)
+{
+	return (bytes + CHECKPOINT_PAGE - 1) / CHECKPOINT_PAGE * CHECKPOINT_PAGE;
+}
+
+/** bytes of the rng states of a slot */
+static size_t rng_bytes(const Checkpoint::Header &header)
+{
+	return (size_t)header.nthread * header.rng_state_len * sizeof(uint64_t);
+}
+
+/**
+ * map fname, creating it for camera and nthread threads with rng_state_len
+ * words of rng state each, or if resume, checking that it was made for them
+ *
+ * @return false (after printing why) on failure
+ */
+bool Checkpoint::open(const char *fname, const Camera &camera, int nthread,
+	int rng_state_len, bool resume)
+{
+	close();
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.ny = camera.ny;
+	header.nx = camera.nx;
+	header.nchannel = camera.raw.n[2];
+	header.nwavelen = NWAVELEN;
+	header.nprobe = camera.probe_raw.n[0];
+	header.nthread = nthread;
+	header.rng_state_len = rng_state_len;
+	const size_t npix = (size_t)camera.ny * camera.nx;
+	header.slot_bytes = round_up_page(sizeof(SlotHeader) + rng_bytes(header)
+		+ sizeof(float) * (npix * (header.nchannel + 2)
+		+ (size_t)header.nprobe * NWAVELEN));
+	map_bytes = CHECKPOINT_PAGE + 2 * header.slot_bytes;
+
+	fd = ::open(fname, resume ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Checkpoint: %s: %s\n", fname, strerror(errno));
+		return false;
+	}
+	if (resume) {
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t)st.st_size != map_bytes) {
+			fprintf(stderr, "Checkpoint: %s: not a checkpoint of this render"
+				" (image size, probes, threads or build differ)\n", fname);
+			close();
+			return false;
+		}
+	} else if (ftruncate(fd, map_bytes) != 0) {
+		fprintf(stderr, "Checkpoint: %s: %s\n", fname, strerror(errno));
+		close();
+		return false;
+	}
+
+	void *addr = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Checkpoint: %s: %s\n", fname, strerror(errno));
+		map = nullptr;
+		close();
+		return false;
+	}
+	map = (char *)addr;
+
+	if (resume) {
+		if (memcmp(map, &header, sizeof(header)) != 0) {
+			fprintf(stderr, "Checkpoint: %s: not a checkpoint of this render"
+				" (image size, probes, threads or build differ)\n", fname);
+			close();
+			return false;
+		}
+	} else {
+		memcpy(map, &header, sizeof(header));
+		msync(map, CHECKPOINT_PAGE, MS_SYNC);
+	}
+	return true;
+}
+
+char *Checkpoint::slot(int k) const
+{
+	return map + CHECKPOINT_PAGE + k * header.slot_bytes;
+}
+
+/** FNV-1a of the slot contents after its header, and its sequence number */
+uint64_t Checkpoint::checksum(const char *slot) const
+{
+	const SlotHeader &slot_header = *(const SlotHeader *)slot;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = sizeof(SlotHeader); i < header.slot_bytes; i++) {
+		hash = (hash ^ (uint8_t)slot[i]) * 0x100000001b3ULL;
+	}
+	return hash ^ slot_header.seq;
+}
+
+/**
+ * load the newest valid slot into camera (whose sample counts must be
+ * initialized) and the rng states of threads; before the threads start
+ *
+ * @return false if neither slot is valid
+ */
+bool Checkpoint::load(Camera &camera, std::vector<std::unique_ptr<RenderThread>> &threads)
+{
+	int newest = -1;
+	for (int k = 0; k < 2; k++) {
+		const SlotHeader &slot_header = *(const SlotHeader *)slot(k);
+		if (slot_header.seq == 0 || slot_header.checksum != checksum(slot(k))) {
+			continue;
+		}
+		if (newest < 0 || slot_header.seq > ((const SlotHeader *)slot(newest))->seq) {
+			newest = k;
+		}
+	}
+	if (newest < 0) {
+		return false;
+	}
+
+	const char *data = slot(newest);
+	const SlotHeader &slot_header = *(const SlotHeader *)data;
+	seq = slot_header.seq;
+	seconds = slot_header.seconds;
+
+	const uint64_t *rng_state = (const uint64_t *)(data + sizeof(SlotHeader));
+	for (int tid = 0; tid < header.nthread; tid++) {
+		threads[tid]->load_rngs((const unsigned long long *)&rng_state[tid * header.rng_state_len]);
+	}
+
+	const float *floats = (const float *)(data + sizeof(SlotHeader) + rng_bytes(header));
+	memcpy(camera.raw.data, floats, camera.raw.len * sizeof(float));
+	floats += camera.raw.len;
+	memcpy(camera.spp.data, floats, camera.spp.len * sizeof(float));
+	floats += camera.spp.len;
+	memcpy(camera.raw_half.data, floats, camera.raw_half.len * sizeof(float));
+	floats += camera.raw_half.len;
+	memcpy(camera.probe_raw.data, floats, camera.probe_raw.len * sizeof(float));
+	camera.pixel_data_updated.store(true);
+	return true;
+}
+
+/**
+ * Write a checkpoint to the older slot: invalidate it, copy the pixel data,
+ * then the rng states (published before their samples were merged, so never
+ * behind the pixel data), sync, and only then validate it. Only the stripe
+ * and probe locks are taken, each for a copy, so render threads hardly wait.
+ */
+void Checkpoint::write(Camera &camera, std::vector<std::unique_ptr<RenderThread>> &threads,
+	double seconds)
+{
+	char *data = slot((seq + 1) % 2);
+	SlotHeader &slot_header = *(SlotHeader *)data;
+	slot_header.seq = 0;
+	msync(data, CHECKPOINT_PAGE, MS_SYNC);
+
+	uint64_t *rng_state = (uint64_t *)(data + sizeof(SlotHeader));
+	float *floats = (float *)(data + sizeof(SlotHeader) + rng_bytes(header));
+	const size_t npix = (size_t)camera.ny * camera.nx;
+	camera.copy_counted(floats, floats + camera.raw.len, floats + camera.raw.len + npix,
+		floats + camera.raw.len + 2 * npix);
+
+	for (int tid = 0; tid < header.nthread; tid++) {
+		RenderThread &thread = *threads[tid];
+		std::lock_guard<std::mutex> lock{thread.rng_state_mutex};
+		memcpy(&rng_state[tid * header.rng_state_len], thread.rng_state.data(),
+			header.rng_state_len * sizeof(uint64_t));
+	}
+
+	slot_header.seconds = seconds;
+	slot_header.padding = 0;
+	slot_header.seq = seq + 1;
+	slot_header.checksum = checksum(data);
+	msync(data, header.slot_bytes, MS_SYNC);
+	seq++;
+	this->seconds = seconds;
+}
+
+void Checkpoint::close()
+{
+	if (map != nullptr) {
+		munmap(map, map_bytes);
+		map = nullptr;
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
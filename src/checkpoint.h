@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include "render.h"
+
+/**
+ * Crash consistent checkpoints of a tiled path tracer render in a memory
+ * mapped file: a header page, then two slots written alternately. A slot
+ * holds the camera pixel data with sample counts (see
+ * Camera::init_sample_counts()) and the rng state of every render thread.
+ * Its sequence number and checksum are written and synced last, so a
+ * checkpoint cut short by a crash fails its checksum and the other slot,
+ * holding the one before, is used.
+ */
+class Checkpoint {
+public:
+	class Header {
+	public:
+		char magic[8];
+		int32_t ny;
+		int32_t nx;
+		int32_t nchannel;
+		int32_t nwavelen;
+		int32_t nprobe;
+		int32_t nthread;
+		int32_t rng_state_len;
+		int32_t padding;
+		uint64_t slot_bytes;
+	};
+	class SlotHeader {
+	public:
+		uint64_t seq;
+		uint64_t checksum;
+		/** render seconds, over all resumes */
+		double seconds;
+		uint64_t padding;
+	};
+
+	int fd = -1;
+	char *map = nullptr;
+	size_t map_bytes = 0;
+	Header header;
+	/** of the last slot written or loaded, 0 for none */
+	uint64_t seq = 0;
+	double seconds = 0;
+
+	Checkpoint() {}
+	Checkpoint(const Checkpoint &) = delete;
+	Checkpoint &operator=(const Checkpoint &) = delete;
+	~Checkpoint()
+	{
+		close();
+	}
+
+	bool open(const char *fname, const Camera &camera, int nthread, int rng_state_len,
+		bool resume);
+	bool load(Camera &camera, std::vector<std::unique_ptr<RenderThread>> &threads);
+	void write(Camera &camera, std::vector<std::unique_ptr<RenderThread>> &threads,
+		double seconds);
+	void close();
+
+	char *slot(int k) const;
+	uint64_t checksum(const char *slot) const;
+};
+
+/** separate thread writing a checkpoint every interval until stopped */
+class CheckpointThread {
+public:
+	std::unique_ptr<std::thread> thread;
+	Checkpoint &checkpoint;
+	Camera &camera;
+	std::vector<std::unique_ptr<RenderThread>> &threads;
+	double interval;
+	/** render seconds of the checkpoint before this run */
+	double seconds_before;
+	std::chrono::steady_clock::time_point start_time;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool should_terminate = false;
+
+	CheckpointThread(Checkpoint &checkpoint, Camera &camera,
+		std::vector<std::unique_ptr<RenderThread>> &threads, double interval)
+	: checkpoint{checkpoint}, camera{camera}, threads{threads}, interval{interval},
+	seconds_before{checkpoint.seconds}, start_time{std::chrono::steady_clock::now()}
+	{
+		thread = std::make_unique<std::thread>(&CheckpointThread::thread_main, this);
+	}
+	~CheckpointThread()
+	{
+		join();
+	}
+
+	/** render seconds over all runs */
+	double seconds() const
+	{
+		return seconds_before + std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start_time).count();
+	}
+
+	void thread_main()
+	{
+		std::unique_lock<std::mutex> lock{mutex};
+		for (;;) {
+			cond.wait_for(lock, std::chrono::duration<double>(interval));
+			if (should_terminate) {
+				return;
+			}
+			checkpoint.write(camera, threads, seconds());
+		}
+	}
+
+	/** stop; call after the render threads are joined for a last checkpoint */
+	void join()
+	{
+		if (thread) {
+			{
+				std::lock_guard<std::mutex> lock{mutex};
+				should_terminate = true;
+			}
+			cond.notify_all();
+			thread->join();
+			thread.reset();
+		}
+	}
+};
+
+#endif /* CHECKPOINT_H */
@@ -20,6 +20,7 @@
 float Color::wavelengths[NWAVELEN];
 float Color::frequencies[NWAVELEN];
 float Color::xyzbar[NWAVELEN][3];
+float Color::xyz_matrix[3][NWAVELEN];
 float Color::r_table[NWAVELEN];
 float Color::g_table[NWAVELEN];
 float Color::b_table[NWAVELEN];
@@ -84,6 +85,21 @@ void Color::init()
 		color_xyzbar(wavelengths[k], xyzbar[k]);
 	}
 
+	/* trapezoid integral: each wavelength gets half of the intervals on its
+	sides */
+	for (int k = 0; k < NWAVELEN; k++) {
+		float dl = 0;
+		if (k > 0) {
+			dl += (wavelengths[k] - wavelengths[k-1]) / 2;
+		}
+		if (k < NWAVELEN - 1) {
+			dl += (wavelengths[k+1] - wavelengths[k]) / 2;
+		}
+		for (int j = 0; j < 3; j++) {
+			xyz_matrix[j][k] = dl * xyzbar[k][j];
+		}
+	}
+
 	make_rgb_table(wavelengths, r_table, g_table, b_table);
 }
 
@@ -96,18 +112,25 @@ static float gamma_correct(float rgb_lin)
 	}
 }
 
-ColorRGB Color::XYZ_to_RGB(const ColorXYZ &in)
+/** sRGB primaries before gamma correction, clipped to non-negative */
+ColorRGB Color::XYZ_to_linear_RGB(const ColorXYZ &in)
 {
-	float lin[3];
-	lin[0] = 3.2406f * in.XYZ[0] - 1.5372f * in.XYZ[1] - 0.4986f * in.XYZ[2];
-	lin[1] = -0.9689f * in.XYZ[0] + 1.8758f * in.XYZ[1] + 0.0415f * in.XYZ[2];
-	lin[2] = 0.0557f * in.XYZ[0] - 0.2040f * in.XYZ[1] + 1.0570f * in.XYZ[2];
-
 	ColorRGB out;
+	out.rgb[0] = 3.2406f * in.XYZ[0] - 1.5372f * in.XYZ[1] - 0.4986f * in.XYZ[2];
+	out.rgb[1] = -0.9689f * in.XYZ[0] + 1.8758f * in.XYZ[1] + 0.0415f * in.XYZ[2];
+	out.rgb[2] = 0.0557f * in.XYZ[0] - 0.2040f * in.XYZ[1] + 1.0570f * in.XYZ[2];
+
 	for (int i = 0; i < 3; i++) {
-		// clip to non-negative
-		lin[i] = fmaxf(0, lin[i]);
-		out.rgb[i] = gamma_correct(lin[i]);
+		out.rgb[i] = fmaxf(0, out.rgb[i]);
+	}
+	return out;
+}
+
+ColorRGB Color::XYZ_to_RGB(const ColorXYZ &in)
+{
+	ColorRGB out = XYZ_to_linear_RGB(in);
+	for (int i = 0; i < 3; i++) {
+		out.rgb[i] = gamma_correct(out.rgb[i]);
 	}
 	return out;
 }
@@ -124,17 +147,12 @@ ColorRGB8 Color::RGB_to_RGB8(const ColorRGB &in)
 ColorXYZ Color::physical_to_XYZ(const float *I)
 {
 	ColorXYZ out;
-	float dl;
 
+	/* trapezoid integral of (radiance * xyzbar) * dwavelen */
 	for (int j = 0; j < 3; j++) {
 		out.XYZ[j] = 0;
-	}
-
-	/* trapezoid integral of (radiance * xyzbar) * dwavelen */
-	for (int k = 0; k < NWAVELEN - 1; k++) {
-		dl = wavelengths[k+1] - wavelengths[k];
-		for (int j = 0; j < 3; j++) {
-			out.XYZ[j] += dl/2 * (I[k]*xyzbar[k][j] + I[k+1]*xyzbar[k+1][j]);
+		for (int k = 0; k < NWAVELEN; k++) {
+			out.XYZ[j] += xyz_matrix[j][k] * I[k];
 		}
 	}
 
@@ -48,11 +48,15 @@ public:
 	static float wavelengths[NWAVELEN];
 	static float frequencies[NWAVELEN];
 	static float xyzbar[NWAVELEN][3];
+	/** xyzbar with the trapezoid weights of physical_to_XYZ(): XYZ[j] is
+	 * sum over k of xyz_matrix[j][k] I[k] */
+	static float xyz_matrix[3][NWAVELEN];
 	static float r_table[NWAVELEN];
 	static float g_table[NWAVELEN];
 	static float b_table[NWAVELEN];
 
 	static void init();
+	static ColorRGB XYZ_to_linear_RGB(const ColorXYZ &in);
 	static ColorRGB XYZ_to_RGB(const ColorXYZ &in);
 	static ColorRGB8 RGB_to_RGB8(const ColorRGB &in);
 	static ColorXYZ physical_to_XYZ(const float *I);
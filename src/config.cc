@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Render settings from config files and options.
+ */
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "config.h"
+
+static_assert(AVG_SAMPLE_PER_PIX % TILE_SPP == 0, "spp must be a multiple of TILE_SPP");
+
+/**
+ * parse all of str as an integer in min... max into out
+ *
+ * @return false (with a message) if it is not one
+ */
+template<typename T>
+static bool parse_int(const char *key, const char *str, long long min, long long max, T *out)
+{
+	char *end;
+	errno = 0;
+	const long long x = strtoll(str, &end, 10);
+	if (end == str || *end != '\0' || errno != 0 || x < min || x > max) {
+		fprintf(stderr, "Config: %s must be an integer from %lld to %lld: %s\n",
+			key, min, max, str);
+		return false;
+	}
+	*out = x;
+	return true;
+}
+
+/** @return false (with a message) if key is unknown or value invalid */
+bool RenderConfig::set(const char *key, const char *value)
+{
+	if (strcmp(key, "width") == 0) {
+		return parse_int(key, value, 1, 1 << 16, &width);
+	} else if (strcmp(key, "height") == 0) {
+		return parse_int(key, value, 1, 1 << 16, &height);
+	} else if (strcmp(key, "threads") == 0) {
+		return parse_int(key, value, 0, 1 << 12, &threads);
+	} else if (strcmp(key, "spp") == 0) {
+		// tiles are rendered TILE_SPP samples per pixel at a time
+		unsigned long long x;
+		if (!parse_int(key, value, 1, 1LL << 40, &x)) {
+			return false;
+		}
+		if (x % TILE_SPP != 0) {
+			fprintf(stderr, "Config: spp must be a multiple of %d: %s\n", TILE_SPP, value);
+			return false;
+		}
+		spp = x;
+		return true;
+	} else if (strcmp(key, "max_bounces") == 0) {
+		return parse_int(key, value, 0, MAX_BOUNCES_LIMIT, &max_bounces);
+	} else if (strcmp(key, "max_depth") == 0) {
+		return parse_int(key, value, 0, 1 << 20, &max_depth);
+	} else if (strcmp(key, "nwavelen") == 0) {
+		return parse_int(key, value, 1, 1 << 10, &nwavelen);
+	} else if (strcmp(key, "octree_max_face_per_box") == 0) {
+		return parse_int(key, value, 1, 1 << 20, &octree_max_face_per_box);
+	} else if (strcmp(key, "octree_max_subdiv") == 0) {
+		return parse_int(key, value, 0, 20, &octree_max_subdiv);
+	} else if (strcmp(key, "workers") == 0) {
+		return parse_int(key, value, 0, 1 << 20, &workers);
+	}
+	fprintf(stderr, "Config: unknown setting %s\n", key);
+	return false;
+}
+
+/** set from "KEY=VALUE" */
+bool RenderConfig::set(const char *assignment)
+{
+	const char *eq = strchr(assignment, '=');
+	if (eq == NULL) {
+		fprintf(stderr, "Config: setting must be KEY=VALUE: %s\n", assignment);
+		return false;
+	}
+	return set(std::string(assignment, eq - assignment).c_str(), eq + 1);
+}
+
+/** strip leading and trailing whitespace of [begin, end) */
+static std::string strip(const char *begin, const char *end)
+{
+	while (begin < end && isspace((unsigned char)*begin)) {
+		begin++;
+	}
+	while (end > begin && isspace((unsigned char)end[-1])) {
+		end--;
+	}
+	return std::string(begin, end - begin);
+}
+
+/**
+ * set from the KEY = VALUE lines of fname; blank lines and text after # are
+ * ignored
+ *
+ * @return false (with a message naming the line) on the first bad line
+ */
+bool RenderConfig::read_file(const char *fname)
+{
+	FILE *file = fopen(fname, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Config: could not open %s: %s\n", fname, strerror(errno));
+		return false;
+	}
+
+	char line[1024];
+	bool ok = true;
+	for (int lineno = 1; ok && fgets(line, sizeof(line), file) != NULL; lineno++) {
+		char *end = strchr(line, '#');
+		if (end == NULL) {
+			end = line + strlen(line);
+		}
+		const std::string text = strip(line, end);
+		if (text.empty()) {
+			continue;
+		}
+		const size_t eq = text.find('=');
+		if (eq == std::string::npos) {
+			fprintf(stderr, "Config: %s:%d: expected KEY = VALUE\n", fname, lineno);
+			ok = false;
+			break;
+		}
+		const std::string key = strip(text.c_str(), text.c_str() + eq);
+		const std::string value = strip(text.c_str() + eq + 1, text.c_str() + text.size());
+		if (!set(key.c_str(), value.c_str())) {
+			fprintf(stderr, "Config: in %s:%d\n", fname, lineno);
+			ok = false;
+		}
+	}
+	fclose(file);
+	return ok;
+}
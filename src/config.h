@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "macro_def.h"
+
+/**
+ * Render settings that used to be fixed by macro_def.h, whose values are now
+ * only the defaults: set from a config file of KEY = VALUE lines (# starts a
+ * comment) or single KEY=VALUE options, later settings winning.
+ *
+ * Those the inner loops depend on stay compile time: paths are stored for up
+ * to MAX_BOUNCES_LIMIT bounces and max_bounces picks a kernel compiled for
+ * that cap (see with_bounce_cap()), and nwavelen picks a build of the
+ * renderer (NWAVELEN is 3 in EXEC-rgb).
+ */
+class RenderConfig {
+public:
+	int width = IMAGE_WIDTH;
+	int height = IMAGE_HEIGHT;
+	/** render threads, 0 for the number of cpus */
+	int threads = 0;
+	/** samples per pixel, unless a time budget or adaptive sampling stops
+	 * sooner */
+	unsigned long long spp = AVG_SAMPLE_PER_PIX;
+	/** see PathTracer::max_bounces, BidirectionalPathTracer::max_bounces */
+	int max_bounces = MAX_BOUNCES_PER_PATH;
+	/** see PathTracer::max_depth */
+	int max_depth = 0;
+	int nwavelen = NWAVELEN;
+	int octree_max_face_per_box = OCTREE_MAX_FACE_PER_BOX;
+	int octree_max_subdiv = OCTREE_MAX_SUBDIV;
+	/** for the coordinator (-M): distinct workers to wait for, 0 to merge
+	 * until the time budget is up */
+	int workers = 0;
+
+	bool set(const char *key, const char *value);
+	bool set(const char *assignment);
+	bool read_file(const char *fname);
+};
+
+#endif /* CONFIG_H */
@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Merging the films of render processes (workers) in a coordinator.
+ */
+
+#include <dirent.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include "film_merge.h"
+
+#define FILM_MAGIC "RRFILM2"
+/** a worker retries connecting every 100 ms this many times */
+#define FILM_CONNECT_TRIES 50
+/** ms between checks for termination while waiting on sockets */
+#define FILM_POLL_MS 200
+
+bool FilmEndpoint::parse(const char *endpoint)
+{
+	if (strncmp(endpoint, "unix:", 5) == 0) {
+		type = ENDPOINT_UNIX;
+		path = endpoint + 5;
+	} else if (strncmp(endpoint, "tcp:", 4) == 0) {
+		type = ENDPOINT_TCP;
+		const char *colon = strrchr(endpoint + 4, ':');
+		if (colon == NULL) {
+			path = "";
+			port = endpoint + 4;
+		} else {
+			path = std::string(endpoint + 4, colon);
+			port = colon + 1;
+		}
+		return !port.empty();
+	} else if (strncmp(endpoint, "file:", 5) == 0) {
+		type = ENDPOINT_FILE;
+		path = endpoint + 5;
+	} else {
+		return false;
+	}
+	return !path.empty();
+}
+
+/**
+ * socket connected to endpoint, or if listening, bound to it
+ *
+ * @return file descriptor, or -1 (errno is set)
+ */
+static int open_socket(const FilmEndpoint &endpoint, bool listening)
+{
+	if (endpoint.type == FilmEndpoint::ENDPOINT_UNIX) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (endpoint.path.size() >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(addr.sun_path, endpoint.path.c_str());
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			return -1;
+		}
+		if (listening) {
+			unlink(addr.sun_path);
+			if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 64) == 0) {
+				return fd;
+			}
+		} else if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			return fd;
+		}
+		const int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	struct addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	const char *host = endpoint.path.empty() ? NULL : endpoint.path.c_str();
+	if (getaddrinfo(host, endpoint.port.c_str(), &hints, &result) != 0) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (listening) {
+			const int yes = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) {
+				break;
+			}
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		const int err = errno;
+		close(fd);
+		fd = -1;
+		errno = err;
+	}
+	freeaddrinfo(result);
+	return fd;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		const ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/** read len bytes, waiting at most FILM_POLL_MS at a time so stop is seen */
+static bool read_full(int fd, void *buf, size_t len, const std::atomic<bool> &stop)
+{
+	char *p = (char *)buf;
+	while (len > 0) {
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (::poll(&pfd, 1, FILM_POLL_MS) <= 0) {
+			if (stop.load()) {
+				return false;
+			}
+			continue;
+		}
+		const ssize_t n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+FilmSendThread::FilmSendThread(Camera &camera, const FilmEndpoint &endpoint, int worker,
+	double interval)
+: camera{camera}, endpoint{endpoint}, worker{worker}, interval{interval}
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FILM_MAGIC, sizeof(header.magic));
+	header.worker = worker;
+	header.ny = camera.ny;
+	header.nx = camera.nx;
+	header.nchannel = camera.raw.n[2];
+	std::random_device random;
+	header.run = ((uint64_t)random() << 32 | random())
+		^ std::chrono::steady_clock::now().time_since_epoch().count();
+	payload.resize(header.payload_floats() + camera.spp.len + camera.probe_raw.len);
+
+	thread = std::make_unique<std::thread>(&FilmSendThread::thread_main, this);
+}
+
+FilmSendThread::~FilmSendThread()
+{
+	if (thread) {
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			should_terminate = true;
+		}
+		cond.notify_all();
+		thread->join();
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+/**
+ * connect to the coordinator, which may still be starting; once a send has
+ * failed (or when finishing), try just once so a gone coordinator does not
+ * hold up the render
+ */
+bool FilmSendThread::connect()
+{
+	const int tries = failed || should_terminate.load() ? 1 : FILM_CONNECT_TRIES;
+	for (int i = 0; i < tries; i++) {
+		fd = open_socket(endpoint, false);
+		if (fd >= 0) {
+			return true;
+		}
+		if (i + 1 == tries || should_terminate.load()) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	return false;
+}
+
+/**
+ * send the film so far
+ *
+ * @return false if it could not be sent
+ */
+bool FilmSendThread::send(bool done)
+{
+	const int npix = camera.ny * camera.nx;
+	float *raw = payload.data();
+	float *spp = raw + camera.raw.len;
+	camera.copy_counted(raw, spp, spp + npix, spp + 2 * npix);
+	header.seq++;
+	header.done = done;
+	const size_t bytes = header.payload_floats() * sizeof(float);
+
+	bool ok;
+	const char *what;
+	if (endpoint.type == FilmEndpoint::ENDPOINT_FILE) {
+		/* write then rename, so the coordinator never reads half a film */
+		char fname[64];
+		snprintf(fname, sizeof(fname), "/worker-%d.film", worker);
+		const std::string final_fname = endpoint.path + fname;
+		const std::string tmp_fname = final_fname + ".tmp";
+		what = "write";
+
+		FILE *file = fopen(tmp_fname.c_str(), "wb");
+		ok = file != NULL;
+		if (ok) {
+			ok = fwrite(&header, sizeof(header), 1, file) == 1
+				&& fwrite(raw, 1, bytes, file) == bytes;
+			ok = fclose(file) == 0 && ok;
+		}
+		ok = ok && rename(tmp_fname.c_str(), final_fname.c_str()) == 0;
+	} else {
+		what = "connect";
+		ok = fd >= 0 || connect();
+		if (ok) {
+			what = "send";
+			ok = write_full(fd, &header, sizeof(header)) && write_full(fd, raw, bytes);
+			if (!ok) {
+				close(fd);
+				fd = -1;
+			}
+		}
+	}
+
+	if (!ok && !failed) {
+		fprintf(stderr, "FilmSendThread: could not %s the film (%s), rendering on: %s\n",
+			what, endpoint.path.c_str(), strerror(errno));
+		failed = true;
+	}
+	return ok;
+}
+
+void FilmSendThread::thread_main()
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	for (;;) {
+		cond.wait_for(lock, std::chrono::duration<double>(interval),
+			[this] { return should_terminate.load(); });
+		if (should_terminate.load()) {
+			return;
+		}
+		lock.unlock();
+		send(false);
+		lock.lock();
+	}
+}
+
+/** stop sending every interval and send the last film; after rendering */
+void FilmSendThread::finish()
+{
+	if (thread) {
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			should_terminate = true;
+		}
+		cond.notify_all();
+		thread->join();
+		thread.reset();
+	}
+	send(true);
+}
+
+FilmMergeServer::~FilmMergeServer()
+{
+	stop();
+}
+
+/**
+ * listen for workers
+ *
+ * @return false (after printing why) on failure
+ */
+bool FilmMergeServer::start()
+{
+	if (endpoint.type == FilmEndpoint::ENDPOINT_FILE) {
+		DIR *dir = opendir(endpoint.path.c_str());
+		if (dir == NULL) {
+			fprintf(stderr, "FilmMergeServer: %s: %s\n", endpoint.path.c_str(), strerror(errno));
+			return false;
+		}
+		closedir(dir);
+		return true;
+	}
+
+	listen_fd = open_socket(endpoint, true);
+	if (listen_fd < 0) {
+		fprintf(stderr, "FilmMergeServer: cannot listen on %s:%s: %s\n",
+			endpoint.path.c_str(), endpoint.port.c_str(), strerror(errno));
+		return false;
+	}
+	accept_thread = std::make_unique<std::thread>(&FilmMergeServer::accept_main, this);
+	return true;
+}
+
+void FilmMergeServer::accept_main()
+{
+	while (!should_terminate.load()) {
+		struct pollfd pfd = {listen_fd, POLLIN, 0};
+		if (::poll(&pfd, 1, FILM_POLL_MS) <= 0) {
+			continue;
+		}
+		const int fd = accept(listen_fd, NULL, NULL);
+		if (fd >= 0) {
+			client_threads.emplace_back(&FilmMergeServer::client_main, this, fd);
+		}
+	}
+}
+
+/** merge the films of one worker connection until it closes */
+void FilmMergeServer::client_main(int fd)
+{
+	std::vector<float> payload;
+	FilmHeader header;
+
+	while (read_full(fd, &header, sizeof(header), should_terminate)) {
+		if (memcmp(header.magic, FILM_MAGIC, sizeof(header.magic)) != 0
+			|| header.ny != camera.ny || header.nx != camera.nx
+			|| header.nchannel != camera.raw.n[2]) {
+			fprintf(stderr, "FilmMergeServer: dropping a worker whose film is not of this image\n");
+			break;
+		}
+		payload.resize(header.payload_floats());
+		if (!read_full(fd, payload.data(), payload.size() * sizeof(float), should_terminate)) {
+			break;
+		}
+		bytes += sizeof(header) + payload.size() * sizeof(float);
+		merge(header, payload.data());
+	}
+	close(fd);
+}
+
+/** merge the worker-ID.film files that are new since the last poll */
+void FilmMergeServer::poll_files()
+{
+	DIR *dir = opendir(endpoint.path.c_str());
+	if (dir == NULL) {
+		return;
+	}
+
+	std::vector<float> payload;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		int worker;
+		char suffix[8];
+		if (sscanf(entry->d_name, "worker-%d.%7s", &worker, suffix) != 2
+			|| strcmp(suffix, "film") != 0) {
+			continue;
+		}
+
+		const std::string fname = endpoint.path + "/" + entry->d_name;
+		FILE *file = fopen(fname.c_str(), "rb");
+		if (file == NULL) {
+			continue;
+		}
+		FilmHeader header;
+		bool ok = fread(&header, sizeof(header), 1, file) == 1
+			&& memcmp(header.magic, FILM_MAGIC, sizeof(header.magic)) == 0
+			&& header.ny == camera.ny && header.nx == camera.nx
+			&& header.nchannel == camera.raw.n[2];
+		if (ok) {
+			std::lock_guard<std::mutex> lock{mutex};
+			auto it = workers.find(header.worker);
+			ok = it == workers.end() || it->second.replaced_by(header);
+		}
+		if (ok) {
+			payload.resize(header.payload_floats());
+			ok = fread(payload.data(), sizeof(float), payload.size(), file) == payload.size();
+		}
+		fclose(file);
+		if (ok) {
+			bytes += sizeof(header) + payload.size() * sizeof(float);
+			merge(header, payload.data());
+		}
+	}
+	closedir(dir);
+}
+
+/** check for new films where they are not pushed */
+void FilmMergeServer::poll()
+{
+	if (endpoint.type == FilmEndpoint::ENDPOINT_FILE) {
+		poll_files();
+	}
+}
+
+/**
+ * replace the film of header.worker with payload in the sum
+ *
+ * @return false if it is not newer than the one merged already
+ */
+bool FilmMergeServer::merge(const FilmHeader &header, const float *payload)
+{
+	const auto t0 = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock{mutex};
+	WorkerFilm &film = workers[header.worker];
+	if (film.raw.len == 0) {
+		film.raw = MultiArray<float>{camera.ny, camera.nx, camera.raw.n[2]};
+		film.raw.fill(0);
+		film.spp = MultiArray<float>{camera.ny, camera.nx};
+		film.spp.fill(0);
+	}
+	if (!film.replaced_by(header)) {
+		return false;
+	}
+
+	const float *raw = payload;
+	const float *spp = payload + camera.raw.len;
+	const int row_len = camera.nx * camera.raw.n[2];
+	for (int stripe = 0; stripe < FILM_NSTRIPE; stripe++) {
+		const int begin = camera.stripe_begin(stripe);
+		const int end = camera.stripe_begin(stripe + 1);
+
+		camera.stripe_mutex[stripe].lock();
+		for (int i = begin * row_len; i < end * row_len; i++) {
+			camera.raw(i) += raw[i] - film.raw(i);
+			film.raw(i) = raw[i];
+		}
+		for (int i = begin * camera.nx; i < end * camera.nx; i++) {
+			camera.spp(i) += spp[i] - film.spp(i);
+			film.spp(i) = spp[i];
+		}
+		camera.stripe_mutex[stripe].unlock();
+	}
+	film.seq = header.seq;
+	film.run = header.run;
+	film.done = header.done;
+
+	messages++;
+	merge_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	camera.pixel_data_updated.store(true);
+	camera.cond.notify_all();
+	return true;
+}
+
+/** if nworker distinct workers have sent their last film (a worker heard
+ * from before it is done, or not yet heard from, may still send more) */
+bool FilmMergeServer::all_done(int nworker)
+{
+	std::lock_guard<std::mutex> lock{mutex};
+	int ndone = 0;
+	for (auto &worker : workers) {
+		ndone += worker.second.done;
+	}
+	return ndone >= nworker;
+}
+
+void FilmMergeServer::stop()
+{
+	should_terminate.store(true);
+	if (accept_thread) {
+		accept_thread->join();
+		accept_thread.reset();
+	}
+	for (auto &thread : client_threads) {
+		thread.join();
+	}
+	client_threads.clear();
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		if (endpoint.type == FilmEndpoint::ENDPOINT_UNIX) {
+			unlink(endpoint.path.c_str());
+		}
+	}
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef FILM_MERGE_H
+#define FILM_MERGE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <thread>
+#include "scene.h"
+
+/**
+ * Where worker processes send their films and the coordinator gets them:
+ * "unix:PATH" (unix socket), "tcp:HOST:PORT" (the coordinator may give just
+ * "tcp:PORT" to listen on every interface) or "file:DIR" (each worker
+ * replaces DIR/worker-ID.film, which the coordinator polls).
+ */
+class FilmEndpoint {
+public:
+	enum Type {
+		ENDPOINT_UNIX,
+		ENDPOINT_TCP,
+		ENDPOINT_FILE
+	};
+
+	Type type;
+	/** socket path, host or directory */
+	std::string path;
+	std::string port;
+
+	bool parse(const char *endpoint);
+};
+
+/**
+ * A worker's whole film so far (not since the last message), so messages
+ * can be lost or repeated: raw (Camera::raw) then spp (Camera::spp) follow.
+ */
+class FilmHeader {
+public:
+	char magic[8];
+	int32_t worker;
+	int32_t ny;
+	int32_t nx;
+	int32_t nchannel;
+	/** counts the messages of a run of the worker from 1 */
+	uint64_t seq;
+	/** random id of the run of the worker process: a worker restarted under
+	 * the same id (e.g. with --resume) counts seq from 1 again */
+	uint64_t run;
+	/** last message of the worker */
+	uint32_t done;
+	uint32_t padding;
+
+	size_t payload_floats() const
+	{
+		return (size_t)ny * nx * (nchannel + 1);
+	}
+};
+
+/**
+ * Worker side: every interval (and once more when done) sends the film of
+ * camera (with sample counts) to the coordinator at endpoint. Failed sends
+ * are reported once and the render goes on.
+ */
+class FilmSendThread {
+public:
+	std::unique_ptr<std::thread> thread;
+	Camera &camera;
+	FilmEndpoint endpoint;
+	int worker;
+	double interval;
+	int fd = -1;
+	bool failed = false;
+	FilmHeader header;
+	/** raw, spp, then scratch for raw_half and probes */
+	std::vector<float> payload;
+	std::mutex mutex;
+	std::condition_variable cond;
+	/** also seen by connect() retries, outside mutex */
+	std::atomic<bool> should_terminate{false};
+
+	FilmSendThread(Camera &camera, const FilmEndpoint &endpoint, int worker, double interval);
+	~FilmSendThread();
+
+	bool connect();
+	bool send(bool done);
+	void thread_main();
+	void finish();
+};
+
+/** film last received from a worker */
+class WorkerFilm {
+public:
+	MultiArray<float> raw;
+	MultiArray<float> spp;
+	uint64_t seq = 0;
+	uint64_t run = 0;
+	bool done = false;
+
+	/** if header is a later film of the worker: of a new run, or a later
+	 * message of this one */
+	bool replaced_by(const FilmHeader &header) const
+	{
+		return header.run != run || header.seq > seq;
+	}
+};
+
+/**
+ * Coordinator side: receives worker films at endpoint and keeps their sum
+ * (Camera::raw and Camera::spp of camera, with sample counts) up to date, so
+ * that Camera::snapshot() is the image weighted by the samples of each
+ * pixel from each worker. A new film from a worker replaces its last one by
+ * adding the difference, a stripe at a time like merging render threads.
+ */
+class FilmMergeServer {
+public:
+	Camera &camera;
+	FilmEndpoint endpoint;
+	int listen_fd = -1;
+	std::unique_ptr<std::thread> accept_thread;
+	std::vector<std::thread> client_threads;
+	std::atomic<bool> should_terminate{false};
+
+	/** locks workers */
+	std::mutex mutex;
+	std::map<int, WorkerFilm> workers;
+	std::atomic<unsigned long long> messages{0};
+	std::atomic<unsigned long long> bytes{0};
+	/** seconds spent merging messages */
+	double merge_seconds = 0;
+
+	FilmMergeServer(Camera &camera, const FilmEndpoint &endpoint)
+	: camera{camera}, endpoint{endpoint} {}
+	~FilmMergeServer();
+
+	bool start();
+	void poll();
+	bool all_done(int nworker);
+	void stop();
+
+	bool merge(const FilmHeader &header, const float *payload);
+	void accept_main();
+	void client_main(int fd);
+	void poll_files();
+};
+
+#endif /* FILM_MERGE_H */
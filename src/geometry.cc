@@ -269,6 +269,19 @@ bool box_touch_box(const Box &a, const Box &b)
 	return retval;
 }
 
+/** @return half the surface area of box, or 0 if box is empty */
+float box_half_area(const Box &b)
+{
+	float d[3];
+	for (int i = 0; i < 3; i++) {
+		d[i] = b.corners[1][i] - b.corners[0][i];
+		if (d[i] < 0) {
+			return 0;
+		}
+	}
+	return d[0]*d[1] + d[1]*d[2] + d[2]*d[0];
+}
+
 /**
  * In the event of ray being parallel to one of the xyz planes, we just skip
  * that plane. It can be parallel to at most 2 of 3, so we guarantee at least
@@ -315,6 +328,51 @@ float ray_box_intersect(const Ray &r, const Box &b)
 	}
 }
 
+/**
+ * Reciprocal ray direction for slab tests. Components parallel to a plane are
+ * clamped to GEOMETRY_EPSILON to stay finite since -Ofast assumes finite math.
+ */
+void ray_inv_dir(float *inv_dir, const Ray &r)
+{
+	for (int i = 0; i < 3; i++) {
+		float d = r.dir.x[i];
+		if (unlikely(fabsf(d) < GEOMETRY_EPSILON)) {
+			d = copysignf(GEOMETRY_EPSILON, d);
+		}
+		inv_dir[i] = 1.0f / d;
+	}
+}
+
+/**
+ * Slab test: clip ray parameter interval [0, tmax] against the 3 pairs of
+ * box planes using precomputed reciprocal direction from ray_inv_dir().
+ *
+ * @param t0 set to ray parameter t where ray enters box (0 if origin inside)
+ * @param t1 set to ray parameter t where ray leaves box (clipped to tmax)
+ *
+ * @return true if ray overlaps box for some t in [0, tmax]
+ */
+bool ray_box_interval(float *t0, float *t1, const Ray &r, const Box &b,
+	const float *inv_dir, float tmax)
+{
+	float tenter = 0;
+	float texit = tmax;
+	for (int i = 0; i < 3; i++) {
+		float tnear = (b.corners[0][i] - r.orig.x[i]) * inv_dir[i];
+		float tfar = (b.corners[1][i] - r.orig.x[i]) * inv_dir[i];
+		if (tnear > tfar) {
+			float tmp = tnear;
+			tnear = tfar;
+			tfar = tmp;
+		}
+		tenter = fmaxf(tenter, tnear);
+		texit = fminf(texit, tfar);
+	}
+	*t0 = tenter;
+	*t1 = texit;
+	return tenter <= texit;
+}
+
 /**
  * Performs a rotation operation on any vector that would take the z-axis to the
  * specified normal vector
@@ -356,8 +414,7 @@ void z_to_normal_rotation(const Vec &normal, Vec &v, int sgn)
 /** given a random float, give a random int from [0, list_len-1] */
 int sample_ind(float random_float, int list_len)
 {
-	const float max_ind_float = list_len - 1 + 0.001f;
-	int ind = (int)(max_ind_float * random_float);
+	int ind = (int)(list_len * random_float);
 
 	// ensure clip ind to [0, list_len - 1]
 	if (unlikely(ind > list_len - 1)) {
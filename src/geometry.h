@@ -47,6 +47,9 @@ public:
 	Vec n;
 	/** material for face */
 	Material *material;
+	/** of material in Scene::all_materials and Scene::materials, set by
+	 * Scene::init() */
+	int material_index = -1;
 
 	Face() {};
 	Face(const Vec &v0, const Vec &v1, const Vec &v2);
@@ -88,7 +91,11 @@ float ray_face_intersect(Vec &result, const Ray &r, const Face &f);
 Box face_bounding_box(const Face &f);
 bool vec_in_box(const Vec &v, const Box &b);
 bool box_touch_box(const Box &a, const Box &b);
+float box_half_area(const Box &b);
 float ray_box_intersect(const Ray &r, const Box &b);
+void ray_inv_dir(float *inv_dir, const Ray &r);
+bool ray_box_interval(float *t0, float *t1, const Ray &r, const Box &b,
+	const float *inv_dir, float tmax);
 void z_to_normal_rotation(const Vec &normal, Vec &v, int sgn);
 int sample_ind(float random_float, int list_len);
 
@@ -12,11 +12,20 @@
 #include <atomic>
 #include <thread>
 #include <chrono>
+#include <cstring>
+#include <vector>
 #include "scene.h"
 #include "srgb_img.h"
 #include "ws_ctube.h"
 
-/** separate thread to convert data into sRGB image and use websocket_ctube to broadcast */
+/** bytes before the pixels of a broadcast: width, height (little endian) */
+#define IMG_BROADCAST_HEADER 8
+
+/**
+ * separate thread to convert data into sRGB image and use websocket_ctube to
+ * broadcast; each message is the image size (IMG_BROADCAST_HEADER) then rgb
+ * bytes, so the viewer needs no settings of the renderer
+ */
 class ImgBroadcastThread {
 public:
 	std::unique_ptr<std::thread> thread;
@@ -77,14 +86,23 @@ public:
 		stop_ctube();
 	}
 
+	/** pixel data copied out of the camera, converted without locks */
+	MultiArray<float> snapshot;
+	std::vector<uint8_t> message;
+
 	void broadcast()
 	{
-		camera.mutex.lock();
-		img_converter->make_image(camera.raw);
-		camera.mutex.unlock();
+		camera.snapshot(snapshot);
+		img_converter->make_image(snapshot);
 
-		ws_ctube_broadcast(ctube, img_converter->img_data.data,
-			img_converter->img_data.bytes());
+		MultiArray<uint8_t> &img = img_converter->img_data;
+		message.resize(IMG_BROADCAST_HEADER + img.bytes());
+		const uint32_t size[2] = {(uint32_t)img.n[1], (uint32_t)img.n[0]};
+		for (int k = 0; k < IMG_BROADCAST_HEADER; k++) {
+			message[k] = size[k / 4] >> (8 * (k % 4));
+		}
+		memcpy(&message[IMG_BROADCAST_HEADER], img.data, img.bytes());
+		ws_ctube_broadcast(ctube, message.data(), message.size());
 	}
 
 	void thread_main()
@@ -92,7 +110,7 @@ public:
 		for (;;) {
 			{ /* lock camera mutex */
 				std::unique_lock<std::mutex> mutex{camera.mutex};
-				while (!camera.pixel_data_updated) {
+				while (!camera.pixel_data_updated.exchange(false)) {
 					using namespace std::chrono_literals;
 					camera.cond.wait_for(mutex, 200ms);
 
@@ -101,12 +119,9 @@ public:
 						return;
 					}
 				}
-				camera.pixel_data_updated = false;
-				img_converter->make_image(camera.raw);
 			} /* unlock camera mutex */
 
-			ws_ctube_broadcast(ctube, img_converter->img_data.data,
-				img_converter->img_data.bytes());
+			broadcast();
 		}
 	}
 };
@@ -9,8 +9,26 @@
 
 #define BENCHMARKING 0
 #define SAMPLES_PER_BROADCAST ((unsigned long long)(1 << 13))
+/** default bounces of paths without next event estimation (naive path
+ * tracer, metropolis) and of bidirectional paths */
 #define MAX_BOUNCES_PER_PATH 6
-
+/** most bounces that can be configured: the size of stored paths */
+#define MAX_BOUNCES_LIMIT 32
+/** depth (vertices) after which russian roulette may end a path */
+#define RR_MIN_DEPTH 3
+/** cap on survival probability so that paths through glass (throughput ~1)
+ * still end */
+#define RR_MAX_SURVIVAL 0.95f
+
+/* metropolis: bootstrap paths per thread, chains per thread, small step
+width in primary sample space and probability of large steps */
+#define MLT_BOOTSTRAP_SAMPLES 65536
+#define MLT_CHAINS_PER_THREAD 64
+#define MLT_SIGMA 0.03f
+#define MLT_LARGE_STEP_PROB 0.3f
+
+/* NTHREAD: default number of threads where none is given (the renderer
+uses the number of cpus, or -t) */
 #ifndef DEBUG
 /* nondebug */
 
@@ -36,8 +54,48 @@
 #endif /* DEBUG */
 
 #define SPEED_OF_LIGHT 299792458.0f
-/** This should be 3 for direct srgb color any other for physical wavelengths */
-#define NWAVELEN 28
+/** This should be 3 for direct srgb color any other for physical wavelengths;
+ * the Makefile builds EXEC with NWAVELEN_SPECTRAL and EXEC-rgb with
+ * NWAVELEN_RGB, and each runs the other when configured with its nwavelen
+ * (see RenderConfig) */
+#define NWAVELEN_RGB 3
+#define NWAVELEN_SPECTRAL 28
+#ifndef NWAVELEN
+#define NWAVELEN NWAVELEN_SPECTRAL
+#endif
+
+/** wavelengths carried per path (hero wavelength sampling, see
+ * SpecificIntensity), 0 to carry all NWAVELEN; must divide NWAVELEN */
+#ifndef HERO_NLANE
+#define HERO_NLANE 0
+#endif
+
+/** film stores CIE XYZ per pixel, projected from the spectrum at splat time,
+ * instead of NWAVELEN bins (see Camera::add_probe() for full spectra of
+ * single pixels) */
+#define FILM_XYZ (NWAVELEN != 3)
+/** floats per film pixel */
+#define FILM_NCHANNEL (FILM_XYZ ? 3 : NWAVELEN)
+/** bands of rows of the film, each with its own lock for merging */
+#define FILM_NSTRIPE 64
+/** path tracer: width of square tiles of pixels scheduled to threads and
+ * samples per pixel of one tile task */
+#define TILE_SIZE 16
+#define TILE_SPP 16
+/** wavefront path tracer (--wavefront): paths advanced together, a tile
+ * being taken in runs of this many samples so the queues stay in cache */
+#define WAVEFRONT_SIZE 1024
+/** seconds between checkpoints of the render (-c) */
+#define CHECKPOINT_INTERVAL 60.0
+/** seconds between films sent by a worker process to its coordinator (-w) */
+#define FILM_SEND_INTERVAL 2.0
+/** samples between checks of the time budget by untiled render threads */
+#define DEADLINE_CHECK_SAMPLES ((unsigned long long)(1 << 10))
+/** adaptive sampling: samples per pixel of every tile before errors are
+ * estimated, and pixels darker than this fraction of the mean luminance have
+ * their error relative to it instead (so black areas are not sampled forever) */
+#define ADAPTIVE_MIN_SPP 64
+#define ADAPTIVE_DARK_FLOOR 0.1f
 
 /** pi as float, not double for speed */
 #define PI_F ((float)M_PI)
@@ -58,10 +116,28 @@
  * See also global_characteristic_length_scale defined in scene.c */
 #define GEOMETRY_EPSILON ((float)1e-5f)
 
+/** acceleration structure used unless another is chosen at startup */
+#define DEFAULT_ACCEL ACCEL_BVH4
+/** subtrees built per thread, more balances uneven subtrees better */
+#define ACCEL_BUILD_TASKS_PER_THREAD 8
+
 /* octree */
 #define OCTREE_MAX_FACE_PER_BOX 128
 #define OCTREE_MAX_SUBDIV 6
 
+/* bvh */
+#define BVH_MAX_FACE_PER_LEAF 8
+#define BVH_SAH_NBIN 16
+/** cost of traversing a node relative to intersecting one block of faces */
+#define BVH_SAH_TRAVERSAL_COST 1.0f
+/** bvh depth is capped so that traversal stack cannot overflow */
+#define BVH_STACK_SIZE 64
+/** each 4-wide node visited pushes at most 3 more entries than it pops */
+#define BVH4_STACK_SIZE (3 * BVH_STACK_SIZE + 1)
+/** rays of a packet traced together by BVH4 (at most 64: one bit each) */
+#define RAY_PACKET_SIZE 64
+#define CACHE_LINE_SIZE 64
+
 #define SQR(x) ((x)*(x))
 #define CUBE(x) ((x)*(x)*(x))
 
@@ -15,10 +15,31 @@
 #include <fenv.h>
 #endif
 
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <getopt.h>
+#include <unistd.h>
+#include "config.h"
 #include "render.h"
+#include "wavefront.h"
+#include "bdpt.h"
+#include "mlt.h"
 #include "color.h"
 #include "obj_reader.h"
 #include "img_broadcast.h"
+#include "checkpoint.h"
+#include "film_merge.h"
+
+/**
+ * the camera of scenes read from files, with the image size of config; also
+ * the film of the coordinator (-M), which must match those of its workers
+ */
+static Camera make_camera(const RenderConfig &config)
+{
+	return Camera{43, 35, Vec{0,-7,-0.5}, Vec{0,1,0}, config.width, config.height};
+}
 
 Scene scene_from_files(const char *obj_fname, const char *mtl_fname, Camera &camera)
 {
@@ -26,27 +47,395 @@ Scene scene_from_files(const char *obj_fname, const char *mtl_fname, Camera &cam
 	return Scene{std::move(obj_reader.all_faces), std::move(obj_reader.all_materials), camera};
 }
 
-int main(int argc, const char **argv)
+/** converter of the film to the displayed image */
+static std::unique_ptr<SRGBImgConverter> make_img_converter()
+{
+#if NWAVELEN == 3
+	return std::make_unique<SRGBImgDirectConverter>();
+#elif FILM_XYZ
+	return std::make_unique<SRGBImgXYZConverter>();
+#else /* NWAVELEN */
+	return std::make_unique<SRGBImgPhysicalConverter>();
+#endif /* NWAVELEN */
+}
+
+/**
+ * write film (per sample) to fname: fname.pfm as is, else a ppm of the
+ * displayed image
+ */
+static bool write_image(const char *fname, MultiArray<float> &film)
 {
-	// for quasi Monte Carlo Halton rng
-	auto primes = get_primes(NTHREAD * 2 * (MAX_BOUNCES_PER_PATH + 2));
+	const size_t len = strlen(fname);
+	if (len >= 4 && strcmp(fname + len - 4, ".pfm") == 0) {
+		return write_pfm(fname, film);
+	}
+	std::unique_ptr<SRGBImgConverter> converter = make_img_converter();
+	converter->make_image(film);
+	return write_ppm(fname, converter->img_data);
+}
+
+/**
+ * run the build of the renderer for nwavelen wavelengths, beside this one
+ * (EXEC for NWAVELEN_SPECTRAL, EXEC-rgb for NWAVELEN_RGB), with the same
+ * arguments
+ *
+ * @return only on failure
+ */
+static int exec_nwavelen(int nwavelen, char **argv)
+{
+	if (nwavelen != NWAVELEN_RGB && nwavelen != NWAVELEN_SPECTRAL) {
+		fprintf(stderr, "rendererer: nwavelen must be %d or %d\n", NWAVELEN_RGB,
+			NWAVELEN_SPECTRAL);
+		return EXIT_FAILURE;
+	}
+	char self[PATH_MAX];
+	const ssize_t len = readlink("/proc/self/exe", self, sizeof(self));
+	if (len <= 0 || len == sizeof(self)) {
+		fprintf(stderr, "rendererer: could not find the executable for nwavelen %d\n",
+			nwavelen);
+		return EXIT_FAILURE;
+	}
+	std::string path{self, (size_t)len};
+	const std::string rgb_suffix = "-rgb";
+	if (NWAVELEN == NWAVELEN_RGB && path.size() > rgb_suffix.size()
+		&& path.compare(path.size() - rgb_suffix.size(), rgb_suffix.size(), rgb_suffix) == 0) {
+		path.resize(path.size() - rgb_suffix.size());
+	}
+	if (nwavelen == NWAVELEN_RGB) {
+		path += rgb_suffix;
+	}
+	execv(path.c_str(), argv);
+	fprintf(stderr, "rendererer: could not run %s for nwavelen %d: %s\n", path.c_str(),
+		nwavelen, strerror(errno));
+	return EXIT_FAILURE;
+}
+
+/**
+ * coordinator: merge the films of worker processes until config.workers of
+ * them are done or time_budget (if > 0) is up, then write out_fname (if not
+ * NULL)
+ */
+static int coordinate(const RenderConfig &config, const FilmEndpoint &endpoint,
+	double time_budget, const char *out_fname)
+{
+	if (config.workers == 0 && time_budget <= 0) {
+		fprintf(stderr, "rendererer: -M needs the number of workers (-C workers=N)"
+			" or a time budget (-T)\n");
+		return EXIT_FAILURE;
+	}
+
+	Camera camera = make_camera(config);
+	camera.init_pixel_data();
+	camera.init_sample_counts();
+
+	FilmMergeServer server{camera, endpoint};
+	if (!server.start()) {
+		return EXIT_FAILURE;
+	}
+	printf("coordinating workers at %s%s%s\n", endpoint.path.c_str(),
+		endpoint.port.empty() ? "" : ":", endpoint.port.c_str());
+	fflush(stdout);
+
+#if BENCHMARKING == 0
+	ImgBroadcastThread img_bcast_thread{make_img_converter(), camera, 9743, 3, 0, 10};
+#endif /* BENCHMARKING */
+
+	const auto start_time = std::chrono::steady_clock::now();
+	std::unique_ptr<RenderDeadline> deadline;
+	if (time_budget > 0) {
+		deadline = std::make_unique<RenderDeadline>(time_budget);
+	}
+	while (!(config.workers > 0 && server.all_done(config.workers))
+		&& !(deadline && deadline->passed())) {
+		server.poll();
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	server.stop();
+	const double duration = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start_time).count();
+
+	double spp = 0;
+	for (int i = 0; i < camera.spp.len; i++) {
+		spp += camera.spp(i);
+	}
+	printf("merged %llu films (%.1f MB) of %zu workers in %.3g sec, %.3g ms merging each,"
+		" %.1f samples per pixel\n", server.messages.load(), server.bytes.load() / 1e6,
+		server.workers.size(), duration,
+		server.merge_seconds * 1e3 / std::max(server.messages.load(), 1ULL),
+		spp / camera.spp.len);
+
+	if (out_fname != NULL) {
+		MultiArray<float> film;
+		camera.snapshot(film);
+		if (!write_image(out_fname, film)) {
+			fprintf(stderr, "rendererer: could not write %s\n", out_fname);
+			return EXIT_FAILURE;
+		}
+	}
+#if BENCHMARKING == 0
+	img_bcast_thread.broadcast();
+#endif
+	return 0;
+}
+
+static void usage()
+{
+	printf("usage: rendererer [-a octree|bvh|bvh4] [-b | -m] [-c FILE [--resume]] [-C KEY=VALUE]... [-e ERROR] [-f CONFIG_FILE] [-n] [-o IMAGE] [-r MIN_DEPTH] [-s X,Y]... [-S pcg|sobol|owen] [-t NTHREAD] [-T SECONDS] [-w ENDPOINT -i ID] [--wavefront] OBJ_FILE MTL_FILE\n");
+	printf("       rendererer -M ENDPOINT -C workers=N [-C KEY=VALUE]... [-f CONFIG_FILE] [-o IMAGE] [-T SECONDS]\n");
+	printf("  -a  acceleration structure\n");
+	printf("  -b  bidirectional path tracing (-c, -e, -n and -r do not apply)\n");
+	printf("  -c  checkpoint the render to FILE every %g sec and at the end\n", CHECKPOINT_INTERVAL);
+	printf("      --resume  continue the render checkpointed in FILE (same scene and options)\n");
+	printf("  -C  set KEY to VALUE, after any earlier -f or -C; KEY is one of\n"
+		"      width, height (default %d, %d), threads (as -t), spp (samples per\n"
+		"      pixel, a multiple of %d, default %llu), max_bounces (without next\n"
+		"      event estimation, default %d, at most %d), max_depth (with it,\n"
+		"      default 0: unbounded), nwavelen (%d: sRGB, or %d, default %d),\n"
+		"      octree_max_face_per_box, octree_max_subdiv (default %d, %d),\n"
+		"      workers (for -M: workers to wait for, default 0: until -T)\n", IMAGE_WIDTH, IMAGE_HEIGHT,
+		TILE_SPP, AVG_SAMPLE_PER_PIX, MAX_BOUNCES_PER_PATH, MAX_BOUNCES_LIMIT, NWAVELEN_RGB,
+		NWAVELEN_SPECTRAL, NWAVELEN_SPECTRAL, OCTREE_MAX_FACE_PER_BOX, OCTREE_MAX_SUBDIV);
+	printf("  -i  sample stream of this worker (-w): 0, 1, ... for each worker\n");
+	printf("  -e  adaptive sampling: sample tiles until their estimated relative error\n"
+		"      is below ERROR (e.g. 0.01) or they have spp samples per pixel\n");
+	printf("  -f  settings from CONFIG_FILE: KEY = VALUE lines as for -C\n");
+	printf("  -M  coordinator: merge the films of workers (-w) at ENDPOINT, weighted by\n"
+		"      their samples, serve and write (-o) the image when -C workers=N\n"
+		"      of them are done or -T is up; ENDPOINT is unix:PATH,\n"
+		"      tcp:[HOST:]PORT or file:DIR\n");
+	printf("  -m  primary sample space metropolis light transport (-c, -e, -n and -r do not apply)\n");
+	printf("  -n  no next event estimation: only count paths that hit lights\n");
+	printf("  -o  write the final image: IMAGE.pfm the film per sample (linear sRGB),\n"
+		"      else a binary ppm of the displayed image\n");
+	printf("  -r  depth from which russian roulette may end paths (default %d)\n", RR_MIN_DEPTH);
+	printf("  -s  print the spectrum of pixel X,Y (from the top left) at the end\n");
+	printf("  -S  path tracer sampler: pcg (independent), sobol or owen (Owen\n"
+		"      scrambled sobol, default)\n");
+	printf("  -t  number of render threads (default: number of cpus)\n");
+	printf("  -T  stop rendering after SECONDS (or before, when done)\n");
+	printf("  -w  worker: send the film every %g sec and at the end to the coordinator\n"
+		"      (-M) at ENDPOINT (path tracer only)\n", FILM_SEND_INTERVAL);
+	printf("  --wavefront  trace the paths of a tile together a bounce at a time (path\n"
+		"      tracer with next event estimation only; same image)\n");
+}
+
+int main(int argc, char **argv)
+{
+	// parse options
+	AccelType accel_type = DEFAULT_ACCEL;
+	bool bdpt = false;
+	bool mlt = false;
+	bool nee = true;
+	float target_error = 0;
+	double time_budget = 0;
+	const char *out_fname = NULL;
+	const char *checkpoint_fname = NULL;
+	bool resume = false;
+	bool wavefront = false;
+	const char *worker_endpoint = NULL;
+	const char *merge_endpoint = NULL;
+	int stream = 0;
+	SamplerType sampler_type = SAMPLER_OWEN_SOBOL;
+	int rr_min_depth = RR_MIN_DEPTH;
+	std::vector<std::pair<int, int>> probes;
+	RenderConfig config;
+	static const struct option long_options[] = {
+		{"resume", no_argument, NULL, 'R'},
+		{"wavefront", no_argument, NULL, 'V'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "a:bc:C:e:f:i:mM:no:r:s:S:t:T:w:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			if (strcmp(optarg, "octree") == 0) {
+				accel_type = ACCEL_OCTREE;
+			} else if (strcmp(optarg, "bvh") == 0) {
+				accel_type = ACCEL_BVH;
+			} else if (strcmp(optarg, "bvh4") == 0) {
+				accel_type = ACCEL_BVH4;
+			} else {
+				fprintf(stderr, "rendererer: unknown acceleration structure: %s\n", optarg);
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			bdpt = true;
+			break;
+		case 'c':
+			checkpoint_fname = optarg;
+			break;
+		case 'R':
+			resume = true;
+			break;
+		case 'V':
+			wavefront = true;
+			break;
+		case 'C':
+			if (!config.set(optarg)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'e':
+			target_error = atof(optarg);
+			if (!(target_error > 0)) {
+				fprintf(stderr, "rendererer: error must be > 0\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			if (!config.read_file(optarg)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			stream = atoi(optarg);
+			if (stream < 0) {
+				fprintf(stderr, "rendererer: worker id must be >= 0\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			mlt = true;
+			break;
+		case 'M':
+			merge_endpoint = optarg;
+			break;
+		case 'n':
+			nee = false;
+			break;
+		case 'o':
+			out_fname = optarg;
+			break;
+		case 'r':
+			rr_min_depth = atoi(optarg);
+			if (rr_min_depth < 1) {
+				fprintf(stderr, "rendererer: russian roulette depth must be >= 1\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's': {
+			int x, y;
+			if (sscanf(optarg, "%d,%d", &x, &y) != 2) {
+				fprintf(stderr, "rendererer: pixel must be X,Y: %s\n", optarg);
+				usage();
+				return EXIT_FAILURE;
+			}
+			probes.emplace_back(y, x);
+			break;
+		}
+		case 'S':
+			if (strcmp(optarg, "pcg") == 0) {
+				sampler_type = SAMPLER_PCG;
+			} else if (strcmp(optarg, "sobol") == 0) {
+				sampler_type = SAMPLER_SOBOL;
+			} else if (strcmp(optarg, "owen") == 0) {
+				sampler_type = SAMPLER_OWEN_SOBOL;
+			} else {
+				fprintf(stderr, "rendererer: unknown sampler: %s\n", optarg);
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			config.threads = atoi(optarg);
+			if (config.threads < 1) {
+				fprintf(stderr, "rendererer: number of threads must be >= 1\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			time_budget = atof(optarg);
+			if (!(time_budget > 0)) {
+				fprintf(stderr, "rendererer: time budget must be > 0\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'w':
+			worker_endpoint = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (bdpt && mlt) {
+		fprintf(stderr, "rendererer: -b and -m are exclusive\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+	if ((bdpt || mlt) && (target_error > 0 || checkpoint_fname != NULL)) {
+		fprintf(stderr, "rendererer: -c and -e are for the path tracer only\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+	if ((bdpt || mlt || !nee) && wavefront) {
+		fprintf(stderr, "rendererer: --wavefront is for the path tracer with next event"
+			" estimation only\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+	if ((bdpt || mlt) && worker_endpoint != NULL) {
+		fprintf(stderr, "rendererer: -w is for the path tracer only\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (config.nwavelen != NWAVELEN) {
+		return exec_nwavelen(config.nwavelen, argv);
+	}
+	int nthread = config.threads;
+	if (nthread < 1) {
+		nthread = std::thread::hardware_concurrency();
+	}
+	if (nthread < 1) {
+		nthread = NTHREAD;
+	}
+	FilmEndpoint endpoint;
+	const char *endpoint_str = merge_endpoint != NULL ? merge_endpoint : worker_endpoint;
+	if (endpoint_str != NULL && !endpoint.parse(endpoint_str)) {
+		fprintf(stderr, "rendererer: endpoint must be unix:PATH, tcp:[HOST:]PORT"
+			" or file:DIR: %s\n", endpoint_str);
+		return EXIT_FAILURE;
+	}
+	if (merge_endpoint != NULL) {
+		Color::init();
+		return coordinate(config, endpoint, time_budget, out_fname);
+	}
+	if (resume && checkpoint_fname == NULL) {
+		fprintf(stderr, "rendererer: --resume needs the checkpoint file -c FILE\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+	argc -= optind;
+	argv += optind;
 
 	// precalculate wavelengths/frequencies and color matching function table
 	Color::init();
 
 	// build scene
 	Scene scene;
-	if (argc >= 3) {
-		Camera camera{43, 35, Vec{0,-7,-0.5}, Vec{0,1,0}, IMAGE_WIDTH, IMAGE_HEIGHT};
-		scene = scene_from_files(argv[1], argv[2], camera);
+	if (argc >= 2) {
+		Camera camera = make_camera(config);
+		scene = scene_from_files(argv[0], argv[1], camera);
 	} else {
 		printf("rendererer: warning: input scene files not specified\n");
-		printf("usage: rendererer OBJ_FILE MTL_FILE\n");
+		usage();
 		printf("defaulting to built-in test-scene\n");
 		fflush(stdout);
-		scene = build_test_scene2();
+		scene = build_test_scene2(config.width, config.height);
+	}
+	scene.octree_max_face_per_box = config.octree_max_face_per_box;
+	scene.octree_max_subdiv = config.octree_max_subdiv;
+	scene.init(accel_type, nthread);
+	for (auto &probe : probes) {
+		if (!scene.camera.add_probe(probe.first, probe.second)) {
+			fprintf(stderr, "rendererer: pixel %d,%d is outside the image\n",
+				probe.second, probe.first);
+			return EXIT_FAILURE;
+		}
 	}
-	scene.init();
 
 	// time rendering for stats
 	struct timespec start_time_spec, end_time_spec;
@@ -57,45 +446,207 @@ int main(int argc, const char **argv)
 	feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW | FE_UNDERFLOW);
 #endif
 
-	// start rendering threads
+	// make rendering threads; path tracers share tiles, with samples keyed
+	// by pixel so the image does not depend on nthread; the others split the
+	// samples evenly. A time budget may stop tiles after unequal passes and
+	// checkpoints resume from them, so their samples are counted, as they
+	// are for merging by a coordinator.
+	std::unique_ptr<RenderDeadline> deadline;
+	if (time_budget > 0) {
+		deadline = std::make_unique<RenderDeadline>(time_budget);
+	}
+	if (!bdpt && !mlt && (time_budget > 0 || checkpoint_fname != NULL
+		|| worker_endpoint != NULL)) {
+		scene.camera.init_sample_counts();
+	}
+	const unsigned long long npass = config.spp / TILE_SPP;
+	const unsigned long long nsample = config.spp * scene.camera.nx * scene.camera.ny;
+	std::unique_ptr<TileScheduler> tiles;
+	if (target_error > 0) {
+		tiles = std::make_unique<AdaptiveTileScheduler>(scene.camera,
+			std::min((unsigned long long)ADAPTIVE_MIN_SPP / TILE_SPP, npass), npass, target_error, nthread);
+	} else {
+		tiles = std::make_unique<TileScheduler>(scene.camera.ny, scene.camera.nx,
+			npass, nthread);
+	}
 	std::vector<std::unique_ptr<RenderThread>> render_threads;
-	for (int tid = 0; tid < NTHREAD; tid++) {
-		render_threads.push_back(
-			std::make_unique<PathTracer>(tid, scene, SAMPLES_PER_BROADCAST, primes));
+	for (int tid = 0; tid < nthread; tid++) {
+		if (bdpt) {
+			auto bdpt_tracer = std::make_unique<BidirectionalPathTracer>(tid, scene,
+				SAMPLES_PER_BROADCAST, nthread);
+			bdpt_tracer->deadline = deadline.get();
+			bdpt_tracer->max_samples = nsample / nthread;
+			bdpt_tracer->max_bounces = config.max_bounces;
+			render_threads.push_back(std::move(bdpt_tracer));
+			continue;
+		}
+		if (mlt) {
+			auto mlt_tracer = std::make_unique<MetropolisTracer>(tid, scene,
+				SAMPLES_PER_BROADCAST, nthread);
+			mlt_tracer->deadline = deadline.get();
+			mlt_tracer->max_samples = nsample / nthread;
+			mlt_tracer->max_bounces = config.max_bounces;
+			render_threads.push_back(std::move(mlt_tracer));
+			continue;
+		}
+		auto path_tracer = wavefront
+			? std::make_unique<WavefrontPathTracer>(tid, scene, SAMPLES_PER_BROADCAST,
+				nthread, stream)
+			: std::make_unique<PathTracer>(tid, scene, SAMPLES_PER_BROADCAST, nthread,
+				stream);
+		path_tracer->tiles = tiles.get();
+		path_tracer->sampler_type = sampler_type;
+		path_tracer->deadline = deadline.get();
+		path_tracer->nee = nee;
+		path_tracer->rr_min_depth = rr_min_depth;
+		path_tracer->max_depth = config.max_depth;
+		path_tracer->max_bounces = config.max_bounces;
+		render_threads.push_back(std::move(path_tracer));
+	}
+
+	// continue from a checkpoint, then keep checkpointing
+	Checkpoint checkpoint;
+	if (checkpoint_fname != NULL) {
+		for (auto &thread : render_threads) {
+			thread->publish_rng_state();
+		}
+		if (!checkpoint.open(checkpoint_fname, scene.camera, nthread,
+			render_threads[0]->rng_state.size(), resume)) {
+			return EXIT_FAILURE;
+		}
+	}
+	if (resume) {
+		if (!checkpoint.load(scene.camera, render_threads)) {
+			fprintf(stderr, "rendererer: %s: no complete checkpoint to resume\n",
+				checkpoint_fname);
+			return EXIT_FAILURE;
+		}
+		tiles->resume(scene.camera);
+		for (auto &thread : render_threads) {
+			thread->publish_rng_state();
+		}
+
+		double spp = 0;
+		for (int i = 0; i < scene.camera.spp.len; i++) {
+			spp += scene.camera.spp(i);
+		}
+		printf("resumed checkpoint %llu of %s: %.1f samples per pixel in %.3g sec\n",
+			(unsigned long long)checkpoint.seq, checkpoint_fname,
+			spp / scene.camera.spp.len, checkpoint.seconds);
+	}
+
+	for (auto &thread : render_threads) {
+		thread->start();
+	}
+	std::unique_ptr<CheckpointThread> checkpoint_thread;
+	if (checkpoint_fname != NULL) {
+		checkpoint_thread = std::make_unique<CheckpointThread>(checkpoint, scene.camera,
+			render_threads, CHECKPOINT_INTERVAL);
+	}
+	std::unique_ptr<FilmSendThread> film_send_thread;
+	if (worker_endpoint != NULL) {
+		film_send_thread = std::make_unique<FilmSendThread>(scene.camera, endpoint, stream,
+			FILM_SEND_INTERVAL);
 	}
 
-	// for websocket_ctube broadcasting image to browser for realtime display
+	// for websocket_ctube broadcasting image to browser for realtime display;
+	// workers leave that (and the port) to their coordinator
 #if BENCHMARKING == 0
 	int port = 9743;
 	int max_client = 3;
 	int timeout_ms = 0;
 	float max_broadcast_fps = 10;
-#if NWAVELEN == 3
-	ImgBroadcastThread img_bcast_thread{
-		std::make_unique<SRGBImgDirectConverter>(), scene.camera,
-		port, max_client, timeout_ms, max_broadcast_fps};
-#else /* NWAVELEN */
-	ImgBroadcastThread img_bcast_thread{
-		std::make_unique<SRGBImgPhysicalConverter>(), scene.camera,
-		port, max_client, timeout_ms, max_broadcast_fps};
-#endif /* NWAVELEN */
+	std::unique_ptr<ImgBroadcastThread> img_bcast_thread;
+	if (worker_endpoint == NULL) {
+		img_bcast_thread = std::make_unique<ImgBroadcastThread>(make_img_converter(),
+			scene.camera, port, max_client, timeout_ms, max_broadcast_fps);
+	}
 #endif /* BENCHMARKING */
 
 	// finish rendering threads
-	for (int tid = 0; tid < NTHREAD; tid++) {
+	for (int tid = 0; tid < nthread; tid++) {
 		render_threads[tid]->join();
 	}
+	if (checkpoint_thread) {
+		checkpoint_thread->join();
+		checkpoint.write(scene.camera, render_threads, checkpoint_thread->seconds());
+	}
+	if (film_send_thread) {
+		film_send_thread->finish();
+	}
 
 	// output statistics
 	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time_spec);
 	float duration = (end_time_spec.tv_sec - start_time_spec.tv_sec)
 		+ (float)(end_time_spec.tv_nsec - start_time_spec.tv_nsec) / 1e9;
-	unsigned long npaths = (unsigned long)AVG_SAMPLE_PER_PIX * IMAGE_WIDTH * IMAGE_HEIGHT;
-	printf("Rendered %lu paths in %.3g sec (%.2f paths/sec)\n", npaths, duration, (float)npaths / duration);
+	RenderStats total_stats;
+	for (int tid = 0; tid < nthread; tid++) {
+		char name[16];
+		snprintf(name, sizeof(name), "t%d", tid);
+		render_threads[tid]->stats.print(name, duration);
+		total_stats += render_threads[tid]->stats;
+	}
+	total_stats.print("total", duration);
+	if (!bdpt && !mlt) {
+		printf("%llu tile tasks in %d rounds, %llu steals\n", tiles->ntask, tiles->rounds,
+			tiles->steals.load());
+	}
+	if (target_error > 0) {
+		const auto &adaptive = static_cast<const AdaptiveTileScheduler &>(*tiles);
+		float max_error = 0;
+		int nconverged = 0;
+		for (float error : adaptive.tile_error) {
+			max_error = fmaxf(max_error, error);
+			nconverged += error <= target_error;
+		}
+		printf("adaptive: %d of %d tiles below error %g (max %.3g), %.1f samples per pixel\n",
+			nconverged, adaptive.ntile, target_error, max_error,
+			(double)total_stats.paths / (scene.camera.nx * scene.camera.ny));
+	}
+	printf("Rendered %llu paths in %.3g sec (%.2f paths/sec)\n", total_stats.paths,
+		duration, total_stats.paths / duration);
+	const Camera &camera = scene.camera;
+	const unsigned long long npix = (unsigned long long)camera.nx * camera.ny;
+	if (deadline) {
+		printf("time budget %g sec %s, %.1f samples per pixel\n", time_budget,
+			deadline->stop.load() ? "used up" : "not used up",
+			(double)total_stats.samples / npix);
+	}
+
+	// the film per sample: pixels are counted, or all had the same share
+	if (out_fname != NULL) {
+		MultiArray<float> film;
+		scene.camera.snapshot(film);
+		if (camera.spp.len == 0) {
+			const float scale = (double)npix / std::max(total_stats.samples, 1ULL);
+			for (int i = 0; i < film.len; i++) {
+				film(i) *= scale;
+			}
+		}
+		if (!write_image(out_fname, film)) {
+			fprintf(stderr, "rendererer: could not write %s\n", out_fname);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// spectra of probe pixels, per sample of the pixel
+	for (size_t p = 0; p < camera.probes.size(); p++) {
+		printf("spectrum of pixel %d,%d (wavelength nm, specific intensity):\n",
+			camera.probes[p].second, camera.probes[p].first);
+		double scale = (double)npix / std::max(total_stats.samples, 1ULL);
+		if (camera.spp.len > 0) {
+			scale = 1 / fmax(camera.spp(camera.probes[p].first, camera.probes[p].second), 1.0f);
+		}
+		for (int k = 0; k < NWAVELEN; k++) {
+			printf("  %5.1f %g\n", Color::wavelengths[k], camera.probe_raw(p, k) * scale);
+		}
+	}
 
 	// send update before exiting
 #if BENCHMARKING == 0
-	img_bcast_thread.broadcast();
+	if (img_bcast_thread) {
+		img_bcast_thread->broadcast();
+	}
 #endif
 
 	return 0;
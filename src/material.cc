@@ -35,12 +35,12 @@ static inline void set_ray_prop(Ray &ray_out, float ior, float cos_out)
  * Sample ray uniformly in hemisphere
  */
 static inline float sample_ray_uniform(Ray &ray_out, const Ray &ray_in,
-	const Vec &normal, Rng &rng0, Rng &rng1)
+	const Vec &normal, const float *u)
 {
 	float r0, r1, phi, z, xy;
 
-	r0 = rng0.next();
-	r1 = rng1.next();
+	r0 = u[0];
+	r1 = u[1];
 
 	phi = r1 * (2 * PI_F);
 	z = (1.0f - GEOMETRY_EPSILON) * r0 + GEOMETRY_EPSILON;
@@ -59,12 +59,12 @@ static inline float sample_ray_uniform(Ray &ray_out, const Ray &ray_in,
  * Sample ray according to p(z) ~ z for measure dz dphi
  */
 static inline float sample_ray_cosine(Ray &ray_out, const Ray &ray_in,
-	const Vec &normal, Rng &rng0, Rng &rng1)
+	const Vec &normal, const float *u)
 {
 	float r0, r1, phi, z;
 
-	r0 = rng0.next();
-	r1 = rng1.next();
+	r0 = u[0];
+	r1 = u[1];
 
 	/* z is sampled as a trapezoid from GEOMETRY_EPSILON to 1 */
 	phi = r1 * (2 * PI_F);
@@ -86,12 +86,12 @@ static inline float sample_ray_cosine(Ray &ray_out, const Ray &ray_in,
 /*
 static inline float target_sample_ray(const Vec &target,
 	Ray &ray_out, const Ray &ray_in,
-	const Vec &normal, Rng &rng0, Rng &rng1)
+	const Vec &normal, const float *u)
 {
 	float r0, r1, z, phi, zmin, xy;
 
-	r0 = rng0.next();
-	r1 = rng1.next();
+	r0 = u[0];
+	r1 = u[1];
 
 	// sample in a circle centered around z-axis
 	// width in z is PHOTON_CACHE_SAMPLE_WIDTH
@@ -114,23 +114,30 @@ static inline float target_sample_ray(const Vec &target,
 
 EmitterMaterial::EmitterMaterial(const float *rgb_emission)
 {
+	type = MATERIAL_EMITTER;
 	is_light = true;
 	for (int i = 0; i < 3; i++) {
 		this->rgb_emission[i] = rgb_emission[i];
 	}
 	Color::rgbarray_to_physicalarray(this->rgb_emission, this->emission);
+
+	mean_emission = 0;
+	for (int k = 0; k < NWAVELEN; k++) {
+		mean_emission += emission[k];
+	}
+	mean_emission /= NWAVELEN;
 }
 
-void EmitterMaterial::sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const
+void EmitterParams::sample_ray(Path &path, int pind, const float *u) const
 {
 	Ray &ray_out = path.rays[pind];
 	const Ray &ray_in = path.rays[pind - 1];
 	const Vec &normal = path.normals[pind];
 
-	path.prob_dens[pind] = sample_ray_uniform(ray_out, ray_in, normal, rng0, rng1);
+	path.prob_dens[pind] = sample_ray_uniform(ray_out, ray_in, normal, u);
 }
 
-void EmitterMaterial::transfer(Path &path, int pind) const
+void EmitterParams::transfer(Path &path, int pind) const
 {
 	SpecificIntensity &I = path.I;
 	(void)pind;
@@ -140,22 +147,24 @@ void EmitterMaterial::transfer(Path &path, int pind) const
 
 DiffuseMaterial::DiffuseMaterial(const float *rgb_color)
 {
+	type = MATERIAL_DIFFUSE;
+	Material::can_connect = DiffuseParams::can_connect;
 	for (int i = 0; i < 3; i++) {
 		this->rgb_color[i] = rgb_color[i];
 	}
 	Color::rgbarray_to_physicalarray(this->rgb_color, this->color);
 }
 
-void DiffuseMaterial::sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const
+void DiffuseParams::sample_ray(Path &path, int pind, const float *u) const
 {
 	Ray &ray_out = path.rays[pind];
 	const Ray &ray_in = path.rays[pind - 1];
 	const Vec &normal = path.normals[pind];
 
-	path.prob_dens[pind] = sample_ray_uniform(ray_out, ray_in, normal, rng0, rng1);
+	path.prob_dens[pind] = sample_ray_uniform(ray_out, ray_in, normal, u);
 }
 
-void DiffuseMaterial::transfer(Path &path, int pind) const
+void DiffuseParams::transfer(Path &path, int pind) const
 {
 	SpecificIntensity &I = path.I;
 	const Ray &ray_out = path.rays[pind];
@@ -164,6 +173,24 @@ void DiffuseMaterial::transfer(Path &path, int pind) const
 	I *= INV_2PI_F * ray_out.cosines[0];
 }
 
+float DiffuseParams::connect_transfer(SpecificIntensity &I, const Path &path,
+	int pind, const Vec &dir) const
+{
+	const float cos_out = path.normals[pind] * dir;
+	if (cos_out <= 0) {
+		return 0;
+	}
+
+	I *= color;
+	I *= INV_2PI_F * cos_out;
+	return INV_2PI_F;
+}
+
+float DiffuseParams::connect_pdf(const Path &path, int pind, const Vec &dir) const
+{
+	return path.normals[pind] * dir > 0 ? INV_2PI_F : 0;
+}
+
 /**
  * Get cosine of the angle in glass given air side cosine
  */
@@ -207,7 +234,8 @@ static float glass_reflection(float ior, float cosair, float cosglass)
 	return 0.5f * (R1 + R2);
 }
 
-static void glass_sample_ray(float ior, Path &path, int pind)
+/** u chooses reflection or transmission */
+static void glass_sample_ray(float ior, Path &path, int pind, float u)
 {
 	Ray &ray_out = path.rays[pind];
 	const Ray &ray_in = path.rays[pind - 1];
@@ -233,8 +261,7 @@ static void glass_sample_ray(float ior, Path &path, int pind)
 
 	R = glass_reflection(ior, cosair, cosglass);
 
-	float r0 = path.rng.next();
-	if (r0 <= R && likely(r0 > 0)) {
+	if (u <= R && likely(u > 0)) {
 		/* sample reflection */
 		ray_out.dir = 2*cosrefl*normal + ray_in.dir;
 
@@ -261,13 +288,9 @@ static void glass_sample_ray(float ior, Path &path, int pind)
 	}
 }
 
-static void glass_transfer(float ior, Path &path, int pind)
+/** @return reflectance for light physically incident along ray_out */
+static float glass_transfer_reflection(float ior, const Ray &ray_out)
 {
-	SpecificIntensity &I = path.I;
-	const Ray &ray_out = path.rays[pind];
-	const Ray &ray_in = path.rays[pind - 1];
-
-	float R;
 	float cosair, cosglass;
 
 	if (ray_out.ior != SPACE_INDEX_REFRACT) {
@@ -280,11 +303,23 @@ static void glass_transfer(float ior, Path &path, int pind)
 		cosglass = glass_cosglass(ior, cosair);
 	}
 
-	R = glass_reflection(ior, cosair, cosglass);
+	return glass_reflection(ior, cosair, cosglass);
+}
+
+static void glass_transfer(float ior, Path &path, int pind)
+{
+	SpecificIntensity &I = path.I;
+	const Ray &ray_out = path.rays[pind];
+	const Ray &ray_in = path.rays[pind - 1];
+
+	const float R = glass_transfer_reflection(ior, ray_out);
 
 	if (ray_in.ior == ray_out.ior) {
 		/* reflection */
 		I *= R;
+	} else if (path.adjoint) {
+		/* transmission of importance: no ior^2 radiance scaling */
+		I *= 1.0f - R;
 	} else {
 		/* transmission */
 		if (ray_in.ior == ior) {
@@ -297,16 +332,18 @@ static void glass_transfer(float ior, Path &path, int pind)
 	}
 }
 
-GlassMaterial::GlassMaterial(const float ior) : ior{ior} {}
+GlassMaterial::GlassMaterial(const float ior)
+{
+	this->ior = ior;
+	type = MATERIAL_GLASS;
+}
 
-void GlassMaterial::sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const
+void GlassParams::sample_ray(Path &path, int pind, const float *u) const
 {
-	(void)rng0;
-	(void)rng1;
-	glass_sample_ray(ior, path, pind);
+	glass_sample_ray(ior, path, pind, u[2]);
 }
 
-void GlassMaterial::transfer(Path &path, int pind) const
+void GlassParams::transfer(Path &path, int pind) const
 {
 	glass_transfer(ior, path, pind);
 }
@@ -314,16 +351,14 @@ void GlassMaterial::transfer(Path &path, int pind) const
 /** https://en.wikipedia.org/wiki/Cauchy%27s_equation */
 DispersiveGlassMaterial::DispersiveGlassMaterial(const CauchyCoeff &cauchy_coeff)
 {
+	type = MATERIAL_DISPERSIVE_GLASS;
 	for (int k = 0; k < NWAVELEN; k++) {
 		ior_table[k] = cauchy_coeff.A + cauchy_coeff.B / SQR(Color::wavelengths[k]);
 	}
 }
 
-void DispersiveGlassMaterial::sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const
+void DispersiveGlassParams::sample_ray(Path &path, int pind, const float *u) const
 {
-	(void)rng0;
-	(void)rng1;
-
 	bool set_monochromatic;
 	int cindex;
 
@@ -331,11 +366,11 @@ void DispersiveGlassMaterial::sample_ray(Path &path, int pind, Rng &rng0, Rng &r
 		cindex = path.I.cindex;
 		set_monochromatic = false;
 	} else {
-		cindex = path.I.make_monochromatic(path.rng.next());
+		cindex = path.I.make_monochromatic(u[3]);
 		set_monochromatic = true;
 	}
 
-	glass_sample_ray(ior_table[cindex], path, pind);
+	glass_sample_ray(ior_table[cindex], path, pind, u[2]);
 
 	// if sampled reflection, we can undo the monochromatic set from here
 	if (set_monochromatic && path.rays[pind].ior == path.rays[pind-1].ior) {
@@ -343,7 +378,46 @@ void DispersiveGlassMaterial::sample_ray(Path &path, int pind, Rng &rng0, Rng &r
 	}
 }
 
-void DispersiveGlassMaterial::transfer(Path &path, int pind) const
+void DispersiveGlassParams::transfer(Path &path, int pind) const
 {
+#if HERO_NLANE
+	/* only reflection keeps every lane: each has its own reflectance, and
+	would have been reflected with that prob had it been the hero */
+	SpecificIntensity &I = path.I;
+	if (!I.is_monochromatic) {
+		const Ray &ray_out = path.rays[pind];
+		const float R_hero = glass_transfer_reflection(ior_table[I.bin[0]], ray_out);
+		for (int l = 0; l < HERO_NLANE; l++) {
+			const float R = glass_transfer_reflection(ior_table[I.bin[l]], ray_out);
+			I.I[l] *= R;
+			I.pdf_ratio[l] *= R / R_hero;
+		}
+		return;
+	}
+#endif
 	glass_transfer(ior_table[path.I.cindex], path, pind);
 }
+
+void MaterialTable::init(const std::vector<std::unique_ptr<Material>> &all_materials)
+{
+	entries.resize(all_materials.size());
+	for (size_t i = 0; i < all_materials.size(); i++) {
+		const Material *material = all_materials[i].get();
+		Entry &entry = entries[i];
+		entry.type = material->type;
+		switch (material->type) {
+		case MATERIAL_EMITTER:
+			entry.emitter = *static_cast<const EmitterMaterial *>(material);
+			break;
+		case MATERIAL_DIFFUSE:
+			entry.diffuse = *static_cast<const DiffuseMaterial *>(material);
+			break;
+		case MATERIAL_GLASS:
+			entry.glass = *static_cast<const GlassMaterial *>(material);
+			break;
+		case MATERIAL_DISPERSIVE_GLASS:
+			entry.dispersive_glass = *static_cast<const DispersiveGlassMaterial *>(material);
+			break;
+		}
+	}
+}
@@ -9,8 +9,21 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <vector>
 #include "photon.h"
 
+/** uniform numbers for Material::sample_ray(): u[0], u[1] for a direction,
+ * u[2] to choose reflection or transmission, u[3] a wavelength */
+#define MATERIAL_NRAND 4
+
+/** the concrete material classes, see MaterialTable */
+enum MaterialType {
+	MATERIAL_EMITTER,
+	MATERIAL_DIFFUSE,
+	MATERIAL_GLASS,
+	MATERIAL_DISPERSIVE_GLASS
+};
+
 class CauchyCoeff {
 public:
 	float A;
@@ -20,66 +33,224 @@ public:
 /** base class for materials */
 class Material {
 public:
+	/** set by the constructor of each class */
+	MaterialType type;
 	bool is_light = false;
+	/** true if connect_transfer() is implemented (non-specular) */
+	bool can_connect = false;
+	/** in Scene::all_materials, set by Scene::init() */
+	int index = -1;
 
 	virtual ~Material() {};
 
-	/** returns the prob dens for sampling */
-	virtual void sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const
+	/**
+	 * sample rays[pind] from vertex pind with uniform numbers u[0]...
+	 * u[MATERIAL_NRAND-1], storing its prob dens in prob_dens[pind]
+	 */
+	virtual void sample_ray(Path &path, int pind, const float *u) const
 	{
 		(void)path;
 		(void)pind;
-		(void)rng0;
-		(void)rng1;
+		(void)u;
 	}
 	virtual void transfer(Path &path, int pind) const
 	{
 		(void)path;
 		(void)pind;
 	}
+	/**
+	 * For next event estimation: like transfer() but for the physically
+	 * incoming direction dir at vertex pind instead of the sampled ray.
+	 *
+	 * @return prob dens with which sample_ray() would have chosen dir
+	 */
+	virtual float connect_transfer(SpecificIntensity &I, const Path &path,
+		int pind, const Vec &dir) const
+	{
+		(void)I;
+		(void)path;
+		(void)pind;
+		(void)dir;
+		return 0;
+	}
+	/**
+	 * For bidirectional connections: the prob dens returned by
+	 * connect_transfer() without the transfer. Connectable materials may
+	 * depend on the side of the incoming ray but not on its direction, so
+	 * this is also the density of sampling the reverse direction.
+	 */
+	virtual float connect_pdf(const Path &path, int pind, const Vec &dir) const
+	{
+		(void)path;
+		(void)pind;
+		(void)dir;
+		return 0;
+	}
 };
 
-class EmitterMaterial : public Material {
+/**
+ * The parameters of each material class by value, with its shading: the
+ * Material classes below are these plus the virtual interface, and
+ * MaterialTable holds copies of them, so shading a batch does not go through
+ * the material's heap object. can_connect is as Material::can_connect.
+ */
+class EmitterParams {
 public:
-	float rgb_emission[3];
+	static constexpr bool can_connect = false;
 	float emission[NWAVELEN];
+	/** average over wavelengths of emission */
+	float mean_emission;
 
-	EmitterMaterial(const float *rgb_emission);
-
-	void sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const;
+	void sample_ray(Path &path, int pind, const float *u) const;
 	void transfer(Path &path, int pind) const;
 };
 
-class DiffuseMaterial : public Material {
+class DiffuseParams {
 public:
-	float rgb_color[3];
+	static constexpr bool can_connect = true;
 	float color[NWAVELEN];
 
-	DiffuseMaterial(const float *rgb_color);
-
-	void sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const;
+	void sample_ray(Path &path, int pind, const float *u) const;
 	void transfer(Path &path, int pind) const;
+	float connect_transfer(SpecificIntensity &I, const Path &path,
+		int pind, const Vec &dir) const;
+	float connect_pdf(const Path &path, int pind, const Vec &dir) const;
 };
 
-class GlassMaterial : public Material {
+class GlassParams {
 public:
+	static constexpr bool can_connect = false;
 	float ior;
 
-	GlassMaterial(const float ior);
-
-	void sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const;
+	void sample_ray(Path &path, int pind, const float *u) const;
 	void transfer(Path &path, int pind) const;
 };
 
-class DispersiveGlassMaterial : public Material {
+class DispersiveGlassParams {
 public:
+	static constexpr bool can_connect = false;
 	float ior_table[NWAVELEN];
+
+	void sample_ray(Path &path, int pind, const float *u) const;
+	void transfer(Path &path, int pind) const;
+};
+
+class EmitterMaterial final : public Material, public EmitterParams {
+public:
+	float rgb_emission[3];
+
+	EmitterMaterial(const float *rgb_emission);
+
+	void sample_ray(Path &path, int pind, const float *u) const
+	{
+		EmitterParams::sample_ray(path, pind, u);
+	}
+	void transfer(Path &path, int pind) const
+	{
+		EmitterParams::transfer(path, pind);
+	}
+};
+
+class DiffuseMaterial final : public Material, public DiffuseParams {
+public:
+	float rgb_color[3];
+
+	DiffuseMaterial(const float *rgb_color);
+
+	void sample_ray(Path &path, int pind, const float *u) const
+	{
+		DiffuseParams::sample_ray(path, pind, u);
+	}
+	void transfer(Path &path, int pind) const
+	{
+		DiffuseParams::transfer(path, pind);
+	}
+	float connect_transfer(SpecificIntensity &I, const Path &path,
+		int pind, const Vec &dir) const
+	{
+		return DiffuseParams::connect_transfer(I, path, pind, dir);
+	}
+	float connect_pdf(const Path &path, int pind, const Vec &dir) const
+	{
+		return DiffuseParams::connect_pdf(path, pind, dir);
+	}
+};
+
+class GlassMaterial final : public Material, public GlassParams {
+public:
+	GlassMaterial(const float ior);
+
+	void sample_ray(Path &path, int pind, const float *u) const
+	{
+		GlassParams::sample_ray(path, pind, u);
+	}
+	void transfer(Path &path, int pind) const
+	{
+		GlassParams::transfer(path, pind);
+	}
+};
+
+class DispersiveGlassMaterial final : public Material, public DispersiveGlassParams {
+public:
 	float dispersion;
 
 	DispersiveGlassMaterial(const CauchyCoeff &cauchy_coeff);
 
-	void sample_ray(Path &path, int pind, Rng &rng0, Rng &rng1) const;
-	void transfer(Path &path, int pind) const;
+	void sample_ray(Path &path, int pind, const float *u) const
+	{
+		DispersiveGlassParams::sample_ray(path, pind, u);
+	}
+	void transfer(Path &path, int pind) const
+	{
+		DispersiveGlassParams::transfer(path, pind);
+	}
+};
+
+/**
+ * Scene::all_materials as a table of tagged entries, indexed by
+ * Face::material_index: the type of each material and a copy of its
+ * parameters as that type. Shading a batch of paths on one material switches
+ * on the type once (dispatch()) and then calls the parameter class's
+ * functions directly on the entry, where they inline, instead of virtually
+ * per path through the material's heap object.
+ */
+class MaterialTable {
+public:
+	class Entry {
+	public:
+		MaterialType type;
+		union {
+			EmitterParams emitter;
+			DiffuseParams diffuse;
+			GlassParams glass;
+			DispersiveGlassParams dispersive_glass;
+		};
+	};
+
+	std::vector<Entry> entries;
+
+	void init(const std::vector<std::unique_ptr<Material>> &all_materials);
+
+	/** call f with the parameters of material index as their class */
+	template<typename F>
+	void dispatch(int index, F &&f) const
+	{
+		const Entry &entry = entries[index];
+		switch (entry.type) {
+		case MATERIAL_EMITTER:
+			f(entry.emitter);
+			break;
+		case MATERIAL_DIFFUSE:
+			f(entry.diffuse);
+			break;
+		case MATERIAL_GLASS:
+			f(entry.glass);
+			break;
+		case MATERIAL_DISPERSIVE_GLASS:
+			f(entry.dispersive_glass);
+			break;
+		}
+	}
 };
 
 #endif /* MATERIAL_H */
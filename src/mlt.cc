@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Primary sample space Metropolis light transport.
+ */
+
+#include <algorithm>
+#include <climits>
+#include "mlt.h"
+
+MetropolisTracer::MetropolisTracer(int tid, Scene &scene, unsigned long samples_before_update,
+	int nthread)
+: PathTracer(tid, scene, samples_before_update, nthread)
+{
+	nee = false;
+	pss = std::make_shared<PSSRng>(tid * (UINT_MAX / nthread), MLT_SIGMA, MLT_LARGE_STEP_PROB);
+}
+
+/**
+ * seed replaying bootstrap path k of this thread, hashed since rand_r()
+ * streams of consecutive seeds are correlated
+ */
+unsigned int MetropolisTracer::bootstrap_seed(int k) const
+{
+	unsigned int x = (unsigned)tid * (unsigned)nbootstrap + (unsigned)k + 1;
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+/**
+ * trace a path with the current primary samples, leaving its I in path.I
+ *
+ * @return f of the path (0 if it missed the lights)
+ */
+template<int MAX_BOUNCES>
+float MetropolisTracer::sample(int *i, int *j)
+{
+	int last_path;
+	stats.paths++;
+	if (!sample_new_path<MAX_BOUNCES>(*pss, &last_path)) {
+		return 0;
+	}
+	compute_I(last_path);
+	camera.get_ij(i, j, path.film_x, path.film_y);
+	return path.I.mean();
+}
+
+/** independent paths for the normalization and the starting states */
+template<int MAX_BOUNCES>
+void MetropolisTracer::bootstrap()
+{
+	int i, j;
+	double sum = 0;
+
+	bootstrap_cdf.resize(nbootstrap);
+	for (int k = 0; k < nbootstrap; k++) {
+		pss->reset(bootstrap_seed(k));
+		sum += sample<MAX_BOUNCES>(&i, &j);
+		bootstrap_cdf[k] = sum;
+	}
+	b = sum / nbootstrap;
+}
+
+/**
+ * one chain from a bootstrap path, splatting with expected values
+ *
+ * @return false if it was cut short by the deadline
+ */
+template<int MAX_BOUNCES>
+bool MetropolisTracer::run_chain(unsigned long long nmutations,
+	unsigned long long *since_update_samples)
+{
+	// pick the start in proportion to f and replay it
+	const float r = pss->rng.next() * bootstrap_cdf.back();
+	const int k = std::min((int)(std::upper_bound(bootstrap_cdf.begin(),
+		bootstrap_cdf.end(), r) - bootstrap_cdf.begin()), nbootstrap - 1);
+	const unsigned int mutation_seed = pss->rng.seed;
+	pss->reset(bootstrap_seed(k));
+
+	int cur_i, cur_j;
+	float cur_f = sample<MAX_BOUNCES>(&cur_i, &cur_j);
+	SpecificIntensity cur_I = path.I;
+	pss->rng.seed = mutation_seed;
+	if (cur_f <= 0) {
+		return true;
+	}
+
+	for (unsigned long long m = 0; m < nmutations; m++) {
+		if (unlikely(m % DEADLINE_CHECK_SAMPLES == 0) && past_deadline()) {
+			return false;
+		}
+		pss->start_iteration();
+		int i = 0, j = 0;
+		const float f = sample<MAX_BOUNCES>(&i, &j);
+		const float accept = std::min(1.0f, f / cur_f);
+
+		if (accept > 0) {
+			SpecificIntensity I = path.I;
+			I *= b * accept / f;
+			splat(i, j, I);
+		}
+		if (accept < 1) {
+			SpecificIntensity I = cur_I;
+			I *= b * (1 - accept) / cur_f;
+			splat(cur_i, cur_j, I);
+		}
+
+		if (pss->rng.next() < accept) {
+			pss->accept();
+			accepted++;
+			cur_f = f;
+			cur_i = i;
+			cur_j = j;
+			cur_I = path.I;
+		} else {
+			pss->reject();
+		}
+
+		stats.samples++;
+		(*since_update_samples)++;
+		if (!BENCHMARKING && unlikely(*since_update_samples >= samples_before_update)) {
+			*since_update_samples = 0;
+			update_pixel_data();
+		}
+	}
+	return true;
+}
+
+template<int MAX_BOUNCES>
+void MetropolisTracer::render_chains()
+{
+	bootstrap<MAX_BOUNCES>();
+	if (b <= 0) {
+		return;
+	}
+
+	// the bootstrap paths are extra: only mutations count as samples
+	unsigned long long since_update_samples = 0;
+	for (int c = 0; c < nchains; c++) {
+		const unsigned long long begin = max_samples * c / nchains;
+		const unsigned long long end = max_samples * (c + 1) / nchains;
+		if (!run_chain<MAX_BOUNCES>(end - begin, &since_update_samples)) {
+			break;
+		}
+	}
+}
+
+void MetropolisTracer::render()
+{
+	with_bounce_cap(max_bounces, [this](auto cap) {
+		render_chains<decltype(cap)::value>();
+	});
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MLT_H
+#define MLT_H
+
+#include "render.h"
+
+/**
+ * Primary sample space Metropolis light transport (Kelemen et al. 2002) over
+ * the paths of sample_new_path(), whose random numbers all come from one
+ * PSSRng. A bootstrap pass of independent paths estimates the normalization
+ * b = E[f] (f is the mean over wavelengths of I) and gives the starting
+ * states, chosen in proportion to f. The thread then runs nchains
+ * independent chains one after another, splatting both the current and the
+ * proposed path weighted by their acceptance probability. Each mutation
+ * counts as one sample (the bootstrap is extra), so the image has the scale
+ * of PathTracer's.
+ */
+class MetropolisTracer : public PathTracer {
+public:
+	std::shared_ptr<PSSRng> pss;
+	int nchains = MLT_CHAINS_PER_THREAD;
+	int nbootstrap = MLT_BOOTSTRAP_SAMPLES;
+	/** normalization: mean f of the bootstrap paths */
+	float b = 0;
+	/** f of each bootstrap path, replayed from its seed */
+	std::vector<float> bootstrap_cdf;
+	unsigned long long accepted = 0;
+
+	MetropolisTracer(int tid, Scene &scene, unsigned long samples_before_update,
+		int nthread = NTHREAD);
+
+	unsigned int bootstrap_seed(int k) const;
+	template<int MAX_BOUNCES> float sample(int *i, int *j);
+	template<int MAX_BOUNCES> void bootstrap();
+	template<int MAX_BOUNCES> bool run_chain(unsigned long long nmutations,
+		unsigned long long *since_update_samples);
+	template<int MAX_BOUNCES> void render_chains();
+	void render();
+};
+
+#endif /* MLT_H */
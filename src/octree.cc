@@ -14,11 +14,15 @@
 
 #include <cfloat>
 #include "octree.h"
+#include "macro_def.h"
+#include "parallel.h"
+
+/* see scene.cc */
+extern float global_characteristic_length_scale;
 
 /** divides parent box into 8 children boxes */
-static std::vector<Box> mk_sub_boxes(const Box &parent)
+static void mk_sub_boxes(Box *children, const Box &parent)
 {
-	std::vector<Box> children;
 	float tmp[2][3];
 	float children_corners[8][2][3];
 
@@ -47,83 +51,209 @@ static std::vector<Box> mk_sub_boxes(const Box &parent)
 	}
 
 	for (int i = 0; i < 8; i++) {
-		children.emplace_back(children_corners[i]);
+		children[i] = Box{children_corners[i]};
 	}
-
-	return children;
 }
 
+/** subtree whose build is deferred so that subtrees can run in parallel */
+class OctreeBuildTask {
+public:
+	uint32_t node_ind;
+	std::vector<uint32_t> inds;
+	size_t max_recursion_depth;
+};
+
+/**
+ * Builds (a subtree of) an octree into nodes and blocks. Face index lists of
+ * all levels live in one scratch array used as a stack, so once it has grown
+ * the recursion does not allocate.
+ */
+class OctreeBuilder {
+public:
+	std::vector<OctreeNode> &nodes;
+	std::vector<TriBlock> &blocks;
+	const std::vector<Face*> &all_faces;
+	const std::vector<Box> &faces_bounding_boxes;
+	const size_t max_faces_per_box;
+
+	/** face indices of the nodes on the current recursion path */
+	std::vector<uint32_t> scratch;
+	std::vector<Face*> leaf_faces;
+
+	/** if not nullptr, subtrees of at most task_size faces are not built
+	 * but appended here */
+	std::vector<OctreeBuildTask> *tasks = nullptr;
+	size_t task_size = 0;
+
+	OctreeBuilder(std::vector<OctreeNode> &nodes, std::vector<TriBlock> &blocks,
+		const std::vector<Face*> &all_faces,
+		const std::vector<Box> &faces_bounding_boxes, size_t max_faces_per_box)
+	: nodes{nodes}, blocks{blocks}, all_faces{all_faces},
+	faces_bounding_boxes{faces_bounding_boxes},
+	max_faces_per_box{max_faces_per_box} {}
+
+	void build(uint32_t node_ind, size_t begin, size_t end, size_t max_recursion_depth);
+};
+
 /**
  * Recursively puts faces into octree structure. If the number of faces exceeds
  * max_faces_per_box, subdivide the box into 8 sub-boxes and recurse down. Does
  * not put faces into the box unless we are at the finest level with nfaces <
  * max_faces_per_box or max_recursion_depth is exceeded.
  *
- * @param bounding_box bounding box for the octree box
- * @param all_faces face list
- * @param faces_bounding_boxes bounding boxes for the faces
- * @param max_faces_per_box if exceeded by nfaces, we subdivide the box into 8
- * and recurse, splitting faces into the boxes they belong in
+ * @param node_ind index of node to fill in; its box must already be set
+ * @param begin,end range of scratch holding indices of faces touching the
+ * node box
  * @param max_recursion_depth maximum additional number of times to
- * subdivide/refine octree, overruling max_faces_per_box, gets -- every
- * recursive call
+ * subdivide/refine octree, gets -- every recursive call
  */
-Octree::Octree(const Box &bounding_box, const std::vector<Face*> &all_faces,
-	const std::vector<std::shared_ptr<Box>> &faces_bounding_boxes,
-	size_t max_faces_per_box, size_t max_recursion_depth)
-: box{bounding_box}
+void OctreeBuilder::build(uint32_t node_ind, size_t begin, size_t end,
+	size_t max_recursion_depth)
 {
-	// base case: copy all faces into box
-	if (all_faces.size() <= max_faces_per_box || max_recursion_depth == 0) {
-		for (auto &f : all_faces) {
-			faces.push_back(*f);
+	const size_t n = end - begin;
+
+	// base case: append faces to shared buffer
+	if (n <= max_faces_per_box || max_recursion_depth == 0) {
+		leaf_faces.clear();
+		for (size_t i = begin; i < end; i++) {
+			leaf_faces.push_back(all_faces[scratch[i]]);
 		}
-		terminal = true;
+		nodes[node_ind].terminal = true;
+		nodes[node_ind].offset = blocks.size();
+		nodes[node_ind].nfaces = n;
+		append_tri_blocks(blocks, leaf_faces.data(), n);
+		return;
+	}
+
+	if (tasks != nullptr && n <= task_size) {
+		tasks->push_back(OctreeBuildTask{node_ind,
+			std::vector<uint32_t>(scratch.begin() + begin, scratch.begin() + end),
+			max_recursion_depth});
 		return;
 	}
 
-	// recursive case
-	terminal = false;
-	std::vector<Box> sub_boxes = mk_sub_boxes(bounding_box);
+	// recursive case: children are 8 consecutive nodes
+	const uint32_t first_child = nodes.size();
+	nodes[node_ind].terminal = false;
+	nodes[node_ind].offset = first_child;
+	nodes[node_ind].nfaces = 0;
+	Box sub_boxes[8];
+	mk_sub_boxes(sub_boxes, nodes[node_ind].box);
+	nodes.resize(nodes.size() + 8);
 
-	// assign faces to sub
-	std::vector<Face*> sub_all_faces[8];
-	std::vector<std::shared_ptr<Box>> sub_bounding_boxes[8];
-	for (size_t i = 0; i < all_faces.size(); i++) {
-		for (int j = 0; j < 8; j++) {
-			if (box_touch_box(*faces_bounding_boxes[i], sub_boxes[j])) {
-				sub_all_faces[j].push_back(all_faces[i]);
-				sub_bounding_boxes[j].push_back(faces_bounding_boxes[i]);
+	// assign faces to sub: lists are pushed onto scratch, which may
+	// reallocate, so only index it
+	size_t sub_begin[9];
+	for (int j = 0; j < 8; j++) {
+		sub_begin[j] = scratch.size();
+		for (size_t i = begin; i < end; i++) {
+			const uint32_t ind = scratch[i];
+			if (box_touch_box(faces_bounding_boxes[ind], sub_boxes[j])) {
+				scratch.push_back(ind);
 			}
 		}
 	}
+	sub_begin[8] = scratch.size();
 
 	// recurse into sub-boxes
-	for (int i = 0; i < 8; i++) {
-		sub[i] = std::make_unique<Octree>(sub_boxes[i], sub_all_faces[i],
-			sub_bounding_boxes[i], max_faces_per_box, max_recursion_depth - 1);
+	for (int j = 0; j < 8; j++) {
+		nodes[first_child + j].box = sub_boxes[j];
+		build(first_child + j, sub_begin[j], sub_begin[j+1],
+			max_recursion_depth - 1);
 	}
+	scratch.resize(sub_begin[0]);
 }
 
-/** base case for first_ray_face_intersect() */
-bool Octree::_base_intersect(Vec *point, Face **face, const Ray &r)
+/**
+ * @param bounding_box bounding box for the root octree box
+ * @param all_faces face list (Scene::all_faces)
+ * @param faces_bounding_boxes bounding boxes for the faces
+ * @param max_faces_per_box if exceeded by nfaces, we subdivide the box into 8
+ * and recurse, splitting faces into the boxes they belong in
+ * @param max_recursion_depth maximum number of times to subdivide/refine
+ * octree, overruling max_faces_per_box
+ * @param nthread number of threads to build with; the tree does not depend
+ * on it
+ */
+Octree::Octree(const Box &bounding_box, const std::vector<Face*> &all_faces,
+	const std::vector<Box> &faces_bounding_boxes,
+	size_t max_faces_per_box, size_t max_recursion_depth, int nthread)
 {
-	float tmin = FLT_MAX;
-	bool intersected = false;
-	Vec candidate_point;
-
-	// find first intersection with face by lowest t
-	for (auto &candidate_face : faces) {
-		float t = ray_face_intersect(candidate_point, r, candidate_face);
-		if (t > 0 && t < tmin && vec_in_box(candidate_point, box)) {
-			tmin = t;
-			intersected = true;
-			*point = candidate_point;
-			*face = &candidate_face;
+	const size_t nfaces = all_faces.size();
+	nodes.resize(1);
+	nodes[0].box = bounding_box;
+
+	/* top of tree on this thread: stop at subtrees small enough to give each
+	thread several */
+	std::vector<OctreeBuildTask> tasks;
+	OctreeBuilder top{nodes, blocks, all_faces, faces_bounding_boxes, max_faces_per_box};
+	if (nthread > 1) {
+		top.tasks = &tasks;
+		top.task_size = nfaces / (ACCEL_BUILD_TASKS_PER_THREAD * nthread);
+	}
+	top.scratch.resize(nfaces);
+	for (size_t i = 0; i < nfaces; i++) {
+		top.scratch[i] = i;
+	}
+	top.build(0, 0, nfaces, max_recursion_depth);
+
+	/* subtrees in parallel, each into its own node and block arrays */
+	std::vector<std::vector<OctreeNode>> sub_nodes(tasks.size());
+	std::vector<std::vector<TriBlock>> sub_blocks(tasks.size());
+	parallel_for(tasks.size(), 1, nthread, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			OctreeBuildTask &task = tasks[i];
+			sub_nodes[i].resize(1);
+			sub_nodes[i][0].box = nodes[task.node_ind].box;
+			OctreeBuilder builder{sub_nodes[i], sub_blocks[i], all_faces,
+				faces_bounding_boxes, max_faces_per_box};
+			builder.scratch = std::move(task.inds);
+			builder.build(0, 0, builder.scratch.size(), task.max_recursion_depth);
+		}
+	});
+
+	/* splice subtrees in: their root replaces the task node and the rest is
+	appended */
+	for (size_t i = 0; i < tasks.size(); i++) {
+		const uint32_t base = nodes.size();
+		const uint32_t block_base = blocks.size();
+		auto relocate = [&](OctreeNode node) {
+			node.offset += node.terminal ? block_base : base - 1;
+			return node;
+		};
+		nodes[tasks[i].node_ind] = relocate(sub_nodes[i][0]);
+		for (size_t j = 1; j < sub_nodes[i].size(); j++) {
+			nodes.push_back(relocate(sub_nodes[i][j]));
 		}
+		blocks.insert(blocks.end(), sub_blocks[i].begin(), sub_blocks[i].end());
 	}
+	nodes.shrink_to_fit();
+	blocks.shrink_to_fit();
+}
 
-	return intersected;
+/**
+ * base case for first_ray_face_intersect(): only hits inside the node box
+ * count, which is checked as the ray parameter lying within the box interval
+ * (padded by tolerance)
+ */
+bool Octree::_base_intersect(const OctreeNode &node, Vec *point, Face **face,
+	int *material_index, const Ray &r, const float *inv_dir)
+{
+	float t0, t1;
+	if (node.nfaces == 0 || !ray_box_interval(&t0, &t1, r, node.box, inv_dir, FLT_MAX)) {
+		return false;
+	}
+
+	const float pad = GEOMETRY_EPSILON * global_characteristic_length_scale;
+	float t = t1 + pad;
+	Face *hit_face;
+	if (tri_blocks_intersect(&blocks[node.offset], tri_block_count(node.nfaces),
+		r, t0 - pad, &t, &hit_face, material_index)) {
+		*point = r.orig + t * r.dir;
+		*face = hit_face;
+		return true;
+	}
+	return false;
 }
 
 /**
@@ -174,25 +304,47 @@ static void order_hit_boxes(int n, int *order, const float *box_hit_times)
  *
  * @param point stores the point intersected here
  * @param face stores the face intersected here
+ * @param material_index stores its Face::material_index here
  * @param r the ray with which to intersect
  */
+bool Octree::first_ray_material_intersect(Vec *point, Face **face, int *material_index,
+	const Ray &r)
+{
+	float inv_dir[3];
+	ray_inv_dir(inv_dir, r);
+	return _intersect(0, point, face, material_index, r, inv_dir);
+}
+
 bool Octree::first_ray_face_intersect(Vec *point, Face **face, const Ray &r)
 {
+	int material_index;
+	return first_ray_material_intersect(point, face, &material_index, r);
+}
+
+/** recursive case for first_ray_face_intersect() starting at nodes[node_ind] */
+bool Octree::_intersect(uint32_t node_ind, Vec *point, Face **face, int *material_index,
+	const Ray &r, const float *inv_dir)
+{
+	const OctreeNode &node = nodes[node_ind];
+
 	// base case
-	if (this->terminal) {
-		return _base_intersect(point, face, r);
+	if (node.terminal) {
+		return _base_intersect(node, point, face, material_index, r, inv_dir);
 	}
 
+	const OctreeNode *sub = &nodes[node.offset];
+
 	/* first check if ray origin inside box */
 	int origin_box = -1;
 	for (int i = 0; i < 8; i++) {
-		if (vec_in_box(r.orig, sub[i]->box)) {
+		if (vec_in_box(r.orig, sub[i].box)) {
 			origin_box = i;
 			break;
 		}
 	}
 	if (origin_box >= 0) {
-		auto result = sub[origin_box]->first_ray_face_intersect(point, face, r);
+		auto result = _intersect(node.offset + origin_box, point, face, material_index,
+			r, inv_dir);
 		if (result) {
 			return result;
 		}
@@ -202,7 +354,7 @@ bool Octree::first_ray_face_intersect(Vec *point, Face **face, const Ray &r)
 	float box_hit_times[8]; /* set to -1 if not hit */
 	int order[8];
 	for (int i = 0; i < 8; i++) {
-		box_hit_times[i] = ray_box_intersect(r, sub[i]->box);
+		box_hit_times[i] = ray_box_intersect(r, sub[i].box);
 	}
 
 	int i = 0;
@@ -218,10 +370,59 @@ bool Octree::first_ray_face_intersect(Vec *point, Face **face, const Ray &r)
 			return false;
 		}
 
-		auto result = sub[order[i]]->first_ray_face_intersect(point, face, r);
+		auto result = _intersect(node.offset + order[i], point, face, material_index,
+			r, inv_dir);
 		if (result) {
 			return result;
 		}
 	}
 	return false;
 }
+
+/**
+ * any-hit query: children are visited in storage order and the search stops
+ * at the first face hit before tmax
+ *
+ * @param r the ray with which to intersect
+ * @param tmax only hits closer than this count
+ */
+bool Octree::occluded(const Ray &r, float tmax)
+{
+	float inv_dir[3];
+	ray_inv_dir(inv_dir, r);
+	return _occluded(0, r, inv_dir, tmax);
+}
+
+/** recursive case for occluded() starting at nodes[node_ind] */
+bool Octree::_occluded(uint32_t node_ind, const Ray &r, const float *inv_dir,
+	float tmax)
+{
+	const OctreeNode &node = nodes[node_ind];
+	float t0, t1;
+	if (!ray_box_interval(&t0, &t1, r, node.box, inv_dir, tmax)) {
+		return false;
+	}
+
+	// base case
+	if (node.terminal) {
+		float t = tmax;
+		Face *hit_face;
+		int hit_material;
+		return node.nfaces > 0 && tri_blocks_occluded(&blocks[node.offset],
+			tri_block_count(node.nfaces), r, 0, &t, &hit_face, &hit_material);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		if (_occluded(node.offset + i, r, inv_dir, tmax)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/** @return approximate memory used */
+size_t Octree::bytes() const
+{
+	return sizeof(*this) + nodes.capacity() * sizeof(nodes[0])
+		+ blocks.capacity() * sizeof(blocks[0]);
+}
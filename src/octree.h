@@ -9,27 +9,54 @@
 #ifndef OCTREE_H
 #define OCTREE_H
 
-#include "geometry.h"
+#include <cstdint>
+#include "macro_def.h"
+#include "accel.h"
+#include "tri_block.h"
 
-/** octree used to optimize ray face intersection finding */
-class Octree {
+/** node of linearized octree */
+class OctreeNode {
 public:
-	/** octree children */
-	std::unique_ptr<Octree> sub[8];
-	/** bounding box for octree */
+	/** bounding box for octree node */
 	Box box;
-	/** faces that are in the box */
-	std::vector<Face> faces;
+	/** inner node: index of first of 8 consecutive children;
+	 * terminal node: index of first block in Octree::blocks */
+	uint32_t offset;
+	/** number of faces in terminal node */
+	uint32_t nfaces;
 	/** true if no more sub octrees */
 	bool terminal;
+};
+
+/**
+ * octree used to optimize ray face intersection finding, stored as one
+ * contiguous node array. Terminal nodes hold ranges into a shared buffer of
+ * SoA face blocks whose faces point back into Scene::all_faces.
+ */
+class Octree : public AccelStruct {
+public:
+	/** root is nodes[0] */
+	std::vector<OctreeNode> nodes;
+	/** terminal nodes hold ranges into this */
+	std::vector<TriBlock> blocks;
 
 	Octree() {};
 	Octree(const Box &bounding_box, const std::vector<Face*> &all_faces,
-		const std::vector<std::shared_ptr<Box>> &faces_bounding_boxes,
-		size_t max_faces_per_box, size_t max_recursion_depth);
+		const std::vector<Box> &faces_bounding_boxes,
+		size_t max_faces_per_box, size_t max_recursion_depth,
+		int nthread = NTHREAD);
 
-	bool _base_intersect(Vec *point, Face **face, const Ray &r);
+	bool _base_intersect(const OctreeNode &node, Vec *point, Face **face,
+		int *material_index, const Ray &r, const float *inv_dir);
+	bool _intersect(uint32_t node_ind, Vec *point, Face **face, int *material_index,
+		const Ray &r, const float *inv_dir);
+	bool _occluded(uint32_t node_ind, const Ray &r, const float *inv_dir,
+		float tmax);
 	bool first_ray_face_intersect(Vec *point, Face **face, const Ray &r);
+	bool first_ray_material_intersect(Vec *point, Face **face, int *material_index,
+		const Ray &r);
+	bool occluded(const Ray &r, float tmax);
+	size_t bytes() const;
 };
 
 #endif /* OCTREE_H */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * Calls f(begin, end) over consecutive chunks of [0, n) on nthread threads,
+ * the calling thread included. Chunks are handed out dynamically so that
+ * uneven work balances.
+ *
+ * @param chunk size of each chunk (last may be smaller)
+ */
+template<typename F> void parallel_for(size_t n, size_t chunk, int nthread, const F &f)
+{
+	std::atomic<size_t> next{0};
+	auto worker = [&]() {
+		for (;;) {
+			size_t begin = next.fetch_add(chunk, std::memory_order_relaxed);
+			if (begin >= n) {
+				return;
+			}
+			f(begin, std::min(begin + chunk, n));
+		}
+	};
+
+	const size_t nchunk = (n + chunk - 1) / chunk;
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < std::min((size_t)std::max(nthread, 1), nchunk); i++) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (auto &thread : threads) {
+		thread.join();
+	}
+}
+
+#endif /* PARALLEL_H */
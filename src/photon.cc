@@ -7,6 +7,9 @@
  */
 
 #include "photon.h"
+#include "color.h"
+
+#if !HERO_NLANE
 
 SpecificIntensity &SpecificIntensity::operator=(const float *rhs)
 {
@@ -128,6 +131,75 @@ SpecificIntensity &SpecificIntensity::operator/=(float rhs)
 	return *this;
 }
 
+SpecificIntensity &SpecificIntensity::operator*=(const SpecificIntensity &rhs)
+{
+	return *this *= rhs.I;
+}
+
+/** start a new path carrying every wavelength (u is for the hero) */
+void SpecificIntensity::start(float u)
+{
+	(void)u;
+	is_monochromatic = false;
+}
+
+/** @return largest component (only cindex if monochromatic) */
+float SpecificIntensity::max() const
+{
+	if (is_monochromatic) {
+		return I[cindex];
+	}
+	float result = I[0];
+	for (int k = 1; k < NWAVELEN; k++) {
+		result = fmaxf(result, I[k]);
+	}
+	return result;
+}
+
+/** @return average over wavelengths of what add_to() adds */
+float SpecificIntensity::mean() const
+{
+	if (is_monochromatic) {
+		return I[cindex];
+	}
+	float sum = 0;
+	for (int k = 0; k < NWAVELEN; k++) {
+		sum += I[k];
+	}
+	return sum / NWAVELEN;
+}
+
+/** add the estimate of the spectrum to pixel[NWAVELEN] */
+void SpecificIntensity::add_to(float *pixel) const
+{
+	if (is_monochromatic) {
+		pixel[cindex] += I[cindex] * NWAVELEN;
+	} else {
+		for (int k = 0; k < NWAVELEN; k++) {
+			pixel[k] += I[k];
+		}
+	}
+}
+
+/** add the CIE XYZ of what add_to() would add to pixel[3] */
+void SpecificIntensity::add_to_xyz(float *pixel) const
+{
+	if (is_monochromatic) {
+		const float value = I[cindex] * NWAVELEN;
+		for (int j = 0; j < 3; j++) {
+			pixel[j] += Color::xyz_matrix[j][cindex] * value;
+		}
+		return;
+	}
+	for (int j = 0; j < 3; j++) {
+		float sum = 0;
+		for (int k = 0; k < NWAVELEN; k++) {
+			sum += Color::xyz_matrix[j][k] * I[k];
+		}
+		pixel[j] += sum;
+	}
+}
+
 /**
  * randomly choose a wavelength and make monochromatic
  *
@@ -141,3 +213,196 @@ int SpecificIntensity::make_monochromatic(float random_float)
 	is_monochromatic = true;
 	return ind;
 }
+
+#else /* HERO_NLANE */
+
+static_assert(NWAVELEN % HERO_NLANE == 0, "HERO_NLANE must divide NWAVELEN");
+
+SpecificIntensity &SpecificIntensity::operator=(const float *rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] = rhs[bin[l]];
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator+=(const float *rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] += rhs[bin[l]];
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator-=(const float *rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] -= rhs[bin[l]];
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator*=(const float *rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] *= rhs[bin[l]];
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator/=(const float *rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] /= rhs[bin[l]];
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator=(float rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] = rhs;
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator+=(float rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] += rhs;
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator-=(float rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] -= rhs;
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator*=(float rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] *= rhs;
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator/=(float rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] /= rhs;
+	}
+	return *this;
+}
+
+SpecificIntensity &SpecificIntensity::operator*=(const SpecificIntensity &rhs)
+{
+	for (int l = 0; l < nlane(); l++) {
+		I[l] *= rhs.I[l];
+	}
+	return *this;
+}
+
+/**
+ * start a new path: choose the hero uniformly and space the other lanes
+ * NWAVELEN / HERO_NLANE apart from it, so that every wavelength is carried
+ * with prob HERO_NLANE / NWAVELEN; u is uniform
+ */
+void SpecificIntensity::start(float u)
+{
+	const int hero = sample_ind(u, NWAVELEN);
+	for (int l = 0; l < HERO_NLANE; l++) {
+		bin[l] = (hero + l * (NWAVELEN / HERO_NLANE)) % NWAVELEN;
+		pdf_ratio[l] = 1;
+	}
+	cindex = hero;
+	is_monochromatic = false;
+}
+
+/** @return largest live lane */
+float SpecificIntensity::max() const
+{
+	float result = I[0];
+	for (int l = 1; l < nlane(); l++) {
+		result = fmaxf(result, I[l]);
+	}
+	return result;
+}
+
+/** @return average over wavelengths of what add_to() adds */
+float SpecificIntensity::mean() const
+{
+	if (is_monochromatic) {
+		return I[0];
+	}
+	float sum = 0, ratio_sum = 0;
+	for (int l = 0; l < HERO_NLANE; l++) {
+		sum += I[l];
+		ratio_sum += pdf_ratio[l];
+	}
+	return sum / ratio_sum;
+}
+
+/**
+ * add the estimate of the spectrum to pixel[NWAVELEN]: lane l was sampled
+ * with prob 1/NWAVELEN for each of the HERO_NLANE heroes carrying it, so its
+ * balance heuristic estimate is NWAVELEN f / sum of the heroes' path prob
+ * densities, i.e. NWAVELEN I[l] / sum of pdf_ratio. A monochromatic path
+ * could only have been sampled by its hero (pdf_ratio of the others is 0).
+ */
+void SpecificIntensity::add_to(float *pixel) const
+{
+	if (is_monochromatic) {
+		pixel[bin[0]] += I[0] * NWAVELEN;
+		return;
+	}
+	float ratio_sum = 0;
+	for (int l = 0; l < HERO_NLANE; l++) {
+		ratio_sum += pdf_ratio[l];
+	}
+	const float scale = NWAVELEN / ratio_sum;
+	for (int l = 0; l < HERO_NLANE; l++) {
+		pixel[bin[l]] += I[l] * scale;
+	}
+}
+
+/** add the CIE XYZ of what add_to() would add to pixel[3] */
+void SpecificIntensity::add_to_xyz(float *pixel) const
+{
+	if (is_monochromatic) {
+		const float value = I[0] * NWAVELEN;
+		for (int j = 0; j < 3; j++) {
+			pixel[j] += Color::xyz_matrix[j][bin[0]] * value;
+		}
+		return;
+	}
+	float ratio_sum = 0;
+	for (int l = 0; l < HERO_NLANE; l++) {
+		ratio_sum += pdf_ratio[l];
+	}
+	const float scale = NWAVELEN / ratio_sum;
+	for (int l = 0; l < HERO_NLANE; l++) {
+		const float value = I[l] * scale;
+		for (int j = 0; j < 3; j++) {
+			pixel[j] += Color::xyz_matrix[j][bin[l]] * value;
+		}
+	}
+}
+
+/**
+ * keep only the hero wavelength, which was already chosen in start()
+ *
+ * @param random_float unused
+ * @return the wavelength index cindex
+ */
+int SpecificIntensity::make_monochromatic(float random_float)
+{
+	(void)random_float;
+	is_monochromatic = true;
+	return cindex;
+}
+
+#endif /* HERO_NLANE */
@@ -11,11 +11,33 @@
 
 #include "macro_def.h"
 #include "geometry.h"
+#include <memory>
 #include "rng.h"
 
+/**
+ * Spectrum carried by a path. With HERO_NLANE == 0 every one of the NWAVELEN
+ * wavelengths is carried; a dispersive medium makes the path monochromatic at
+ * a random wavelength cindex.
+ *
+ * Otherwise only HERO_NLANE wavelengths are carried (hero wavelength spectral
+ * sampling, Wilkie et al. 2014): a uniformly random hero bin[0] and the others
+ * evenly spaced from it around the spectrum. Directions at dispersive media
+ * follow the hero; refraction there leaves only the hero (monochromatic,
+ * cindex == bin[0]), while reflection keeps every lane with its own Fresnel
+ * factor and pdf_ratio, weighted against the other lanes being the hero with
+ * the balance heuristic in add_to().
+ */
 class SpecificIntensity {
 public:
+#if HERO_NLANE
+	/** I[l] is the value at wavelength index bin[l] */
+	float I[HERO_NLANE];
+	int bin[HERO_NLANE];
+	/** prob dens of the path had bin[l] been the hero, over that of the hero */
+	float pdf_ratio[HERO_NLANE];
+#else
 	float I[NWAVELEN];
+#endif
 	/** dispersive medium will convert path to monochromatic */
 	bool is_monochromatic;
 	/** index of color for monochromatic case */
@@ -33,9 +55,30 @@ public:
 	SpecificIntensity &operator*=(float rhs);
 	SpecificIntensity &operator/=(float rhs);
 
+	/** multiply by another spectrum carrying the same wavelengths */
+	SpecificIntensity &operator*=(const SpecificIntensity &rhs);
+
+	void start(float u);
 	int make_monochromatic(float random_float);
+	float max() const;
+	float mean() const;
+	void add_to(float *pixel) const;
+	void add_to_xyz(float *pixel) const;
+
+#if HERO_NLANE
+	/** number of live lanes */
+	int nlane() const
+	{
+		return is_monochromatic ? 1 : HERO_NLANE;
+	}
+#endif
 };
 
+/**
+ * For the naive integrator the whole path is stored. The next event
+ * estimation integrator streams it instead: vertex 1 is the current one and
+ * rays[0] is the ray that arrived at it, so depth is unbounded.
+ */
 class Path {
 public:
 	SpecificIntensity I;
@@ -43,13 +86,16 @@ public:
 	float film_y;
 
 	// the ith face/normal/prob_dens is at origin of ith ray
-	Ray rays[MAX_BOUNCES_PER_PATH + 2];
-	Face *faces[MAX_BOUNCES_PER_PATH + 2];
-	Vec normals[MAX_BOUNCES_PER_PATH + 2];
-	float prob_dens[MAX_BOUNCES_PER_PATH + 2];
+	Ray rays[MAX_BOUNCES_LIMIT + 2];
+	Face *faces[MAX_BOUNCES_LIMIT + 2];
+	Vec normals[MAX_BOUNCES_LIMIT + 2];
+	float prob_dens[MAX_BOUNCES_LIMIT + 2];
 
-	// to be used for sampling if/else probabilities
-	RandRng rng{0};
+	/**
+	 * traced from a light (bidirectional): I is then the importance-like
+	 * throughput, which refraction does not scale by ior^2
+	 */
+	bool adjoint = false;
 };
 
 #endif /* PHOTON_H */
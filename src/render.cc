@@ -11,39 +11,82 @@
  * @brief Main rendering functions.
  */
 
+#include <algorithm>
 #include <climits>
 #include "render.h"
 
-/** constructor for randr rngs */
-PathTracer::PathTracer(int tid, Scene &scene, unsigned long samples_before_update)
-: RenderThread(tid, scene, samples_before_update)
+/* see scene.cc */
+extern float global_characteristic_length_scale;
+
+RenderStats &RenderStats::operator+=(const RenderStats &other)
 {
-	std::shared_ptr<RandRng> rng = std::make_shared<RandRng>(tid * (UINT_MAX / NTHREAD));
-	for (int i = 0; i < 2; i++) {
-		for (int j = 0; j < MAX_BOUNCES_PER_PATH + 2; j++) {
-			rngs[i].push_back(rng);
-		}
-	}
-	start();
+	paths += other.paths;
+	samples += other.samples;
+	rays += other.rays;
+	shadow_rays += other.shadow_rays;
+	escaped += other.escaped;
+	max_depth += other.max_depth;
+	roulette += other.roulette;
+	reached_light += other.reached_light;
+	merges += other.merges;
+	merge_wait += other.merge_wait;
+	return *this;
 }
 
-/** constructor for halton rngs (quasi Monte Carlo) */
+/** print one line of counts and rates, with outcomes as fraction of paths */
+void RenderStats::print(const char *name, double seconds) const
+{
+	const double inv_paths = 100.0 / std::max(paths, 1ULL);
+	printf("%-6s %12llu paths %9.3g paths/s %9.3g rays/s %5.2f rays/path %5.2f shadow/path"
+		"  escaped %5.1f%%  max depth %5.1f%%  roulette %5.1f%%  light %5.1f%%"
+		"  %llu merges waited %.3g ms\n",
+		name, paths, paths / seconds, (rays + shadow_rays) / seconds,
+		rays * inv_paths / 100, shadow_rays * inv_paths / 100,
+		escaped * inv_paths, max_depth * inv_paths, roulette * inv_paths,
+		reached_light * inv_paths, merges, merge_wait * 1e3);
+}
+
+/**
+ * @param stream sample stream, distinct for each process rendering the same
+ * image (see FilmSendThread)
+ */
 PathTracer::PathTracer(int tid, Scene &scene, unsigned long samples_before_update,
-	std::vector<unsigned long> &primes)
-: RenderThread(tid, scene, samples_before_update)
+	int nthread, int stream)
+: RenderThread(tid, scene, samples_before_update, nthread), stream{stream}
 {
-	// first rng used for image is rand_r based to prevent weird image patterns
-	std::shared_ptr<RandRng> rand_r_rng = std::make_shared<RandRng>(tid * (UINT_MAX / NTHREAD));
-	rngs[0].push_back(rand_r_rng);
-	rngs[1].push_back(rand_r_rng);
-
-	for (int i = 0; i < MAX_BOUNCES_PER_PATH + 1; i++) {
-		for (int j = 0; j < 2; j++) {
-			const int index = (i*2 + j)*NTHREAD + tid;
-			rngs[j].push_back(std::make_shared<HaltonRng>(primes[index]));
-		}
+	max_samples = AVG_SAMPLE_PER_PIX * camera.nx * camera.ny / nthread;
+	tile_buffer = MultiArray<float>{TILE_SIZE, TILE_SIZE, FILM_NCHANNEL};
+	tile_buffer.fill(0);
+	tile_half = MultiArray<float>{TILE_SIZE, TILE_SIZE};
+	tile_half.fill(0);
+}
+
+/**
+ * film position of a new path: uniform over the film, or over pixel_i,
+ * pixel_j when rendering a tile
+ */
+template<typename Sampler>
+void PathTracer::sample_film_xy(Sampler &sampler)
+{
+	const float u = sampler.get(SAMPLE_FILM_X);
+	const float v = sampler.get(SAMPLE_FILM_Y);
+	if (pixel_i >= 0) {
+		camera.get_film_xy_in_pixel(&path.film_x, &path.film_y, pixel_i, pixel_j, u, v);
+	} else {
+		path.film_x = u * camera.film_width - camera.film_width / 2;
+		path.film_y = v * camera.film_height - camera.film_height / 2;
+	}
+}
+
+/** pixel of the film position of the path (exactly pixel_i, pixel_j in a tile) */
+void PathTracer::get_pixel(int *i, int *j) const
+{
+	if (pixel_i >= 0) {
+		*i = pixel_i;
+		*j = pixel_j;
+	} else {
+		camera.get_ij(i, j, path.film_x, path.film_y);
 	}
-	start();
 }
 
 /**
@@ -54,26 +97,33 @@ PathTracer::PathTracer(int tid, Scene &scene, unsigned long samples_before_updat
  *
  * @return if a light was hit
  */
-bool PathTracer::sample_new_path(int *last_path)
+template<int MAX_BOUNCES, typename Sampler>
+bool PathTracer::sample_new_path(Sampler &sampler, int *last_path)
 {
 	int &i = *last_path;
 	bool hit_light = false;
 	const Camera &camera = scene.camera;
-	Octree &octree_root = scene.octree_root;
+	AccelStruct &accel = *scene.accel;
 
 	// init path
-	path.I.is_monochromatic = false;
+	path.I.start(sampler.get(SAMPLE_WAVELENGTH));
 
 	// first ray from camera
-	path.film_x = rngs[0][0]->next() * camera.film_width - camera.film_width / 2;
-	path.film_y = rngs[1][0]->next() * camera.film_height - camera.film_height / 2;
+	sample_film_xy(sampler);
 	camera.get_init_ray(path.rays[0], path.film_x, path.film_y);
 	path.rays[0].ior = SPACE_INDEX_REFRACT;
 
-	for (i = 1; i < MAX_BOUNCES_PER_PATH + 2; i++) {
-		if (!octree_root.first_ray_face_intersect(&path.rays[i].orig,
+	const int nbounce = bounce_cap<MAX_BOUNCES>(max_bounces);
+	for (i = 1; i < nbounce + 2; i++) {
+		stats.rays++;
+		if (!accel.first_ray_face_intersect(&path.rays[i].orig,
 			&path.faces[i], path.rays[i-1])) {
 			i--;
+			if (hit_light) {
+				stats.reached_light++;
+			} else {
+				stats.escaped++;
+			}
 			return hit_light;
 		}
 
@@ -91,10 +141,17 @@ bool PathTracer::sample_new_path(int *last_path)
 			path.rays[i-1].cosines[1] = cos_in;
 		}
 
-		material.sample_ray(path, i, *rngs[0][i], *rngs[1][i]);
+		float u[MATERIAL_NRAND];
+		get_material_rand(sampler, sample_bounce_dim(i) + BOUNCE_MATERIAL, u);
+		material.sample_ray(path, i, u);
 	}
 
 	i--;
+	if (hit_light) {
+		stats.reached_light++;
+	} else {
+		stats.max_depth++;
+	}
 	return hit_light;
 }
 
@@ -109,31 +166,261 @@ void PathTracer::compute_I(const int last_path)
 	}
 }
 
-void PathTracer::render()
+/** add I to pixel i, j of splat_buffer (and probe_buffer if a probe) */
+void RenderThread::splat(int i, int j, const SpecificIntensity &I)
 {
-	int last_path;
-	unsigned long long max_samples = AVG_SAMPLE_PER_PIX * camera.nx * camera.ny / NTHREAD;
+	float *pixel = &(*splat_buffer)(i - splat_i0, j - splat_j0, 0);
+#if FILM_XYZ
+	I.add_to_xyz(pixel);
+#else
+	I.add_to(pixel);
+#endif
 
-	for (unsigned long long samples = 0, since_update_samples = 0; samples < max_samples;) {
-		if (!sample_new_path(&last_path)) {
-			continue;
+	const int probe = camera.probe_index(i, j);
+	if (unlikely(probe >= 0)) {
+		I.add_to(&probe_buffer(probe, 0));
+	}
+}
+
+/**
+ * next event estimation at vertex pind: connect to a point sampled on an
+ * emitter (with u_light, the numbers of the bounce from BOUNCE_LIGHT_POINT)
+ * and splat the MIS weighted contribution to pixel i, j
+ */
+void PathTracer::sample_light(const float *u_light, int i, int j, int pind)
+{
+	const EmitterList &emitters = scene.emitters;
+	const Vec &orig = path.rays[pind].orig;
+
+	Vec light_point;
+	Face *light_face;
+	const float pdf_area = emitters.sample(&light_point, &light_face,
+		u_light[BOUNCE_LIGHT_CHOICE - BOUNCE_LIGHT_POINT], u_light[0], u_light[1]);
+
+	Vec to_light = light_point - orig;
+	const float dist2 = to_light * to_light;
+	const float dist = sqrtf(dist2);
+	const float tol = GEOMETRY_EPSILON * global_characteristic_length_scale;
+	if (dist <= 2 * tol) {
+		return;
+	}
+	const Vec dir = (1 / dist) * to_light;
+	const float cos_light = fabsf(light_face->n * dir);
+	if (cos_light <= GEOMETRY_EPSILON) {
+		return;
+	}
+
+	SpecificIntensity I = path.I;
+	const float pdf_bsdf = path.faces[pind]->material->connect_transfer(I, path, pind, dir);
+	if (pdf_bsdf <= 0) {
+		return;
+	}
+
+	Ray shadow_ray;
+	shadow_ray.orig = orig;
+	shadow_ray.dir = dir;
+	stats.shadow_rays++;
+	if (scene.accel->occluded(shadow_ray, dist - tol)) {
+		return;
+	}
+
+	const float pdf_light = pdf_area * dist2 / cos_light;
+	const EmitterMaterial &light = *static_cast<EmitterMaterial *>(light_face->material);
+	I *= light.emission;
+	I *= mis_weight(pdf_light, pdf_bsdf) / pdf_light;
+	splat(i, j, I);
+}
+
+/**
+ * Sample one path from the camera with next event estimation, splatting
+ * its contributions as they are found; the path ends at the first light hit.
+ * The path is streamed through vertex 1 (see Path) and ended by russian
+ * roulette on the throughput past rr_min_depth.
+ */
+template<typename Sampler>
+void PathTracer::trace_nee(Sampler &sampler)
+{
+	const Camera &camera = scene.camera;
+	const EmitterList &emitters = scene.emitters;
+	AccelStruct &accel = *scene.accel;
+
+	// init path: I is the throughput
+	path.I.start(sampler.get(SAMPLE_WAVELENGTH));
+	path.I = 1.0f;
+
+	// first ray from camera
+	sample_film_xy(sampler);
+	camera.get_init_ray(path.rays[0], path.film_x, path.film_y);
+	path.rays[0].ior = SPACE_INDEX_REFRACT;
+
+	int pix_i, pix_j;
+	get_pixel(&pix_i, &pix_j);
+
+	/* prob dens of bsdf sampling the last ray if a light could have been
+	sampled instead there, else 0 */
+	float pdf_bsdf = 0;
+
+	for (int depth = 1;; depth++) {
+		stats.rays++;
+		if (!accel.first_ray_face_intersect(&path.rays[1].orig,
+			&path.faces[1], path.rays[0])) {
+			stats.escaped++;
+			return;
 		}
 
-		samples++;
-		since_update_samples++;
+		const Material &material = *path.faces[1]->material;
+
+		// set path normals[1] to be on same side of rays[1]
+		const Vec &face_normal = path.faces[1]->n;
+		const float cos_in = face_normal * path.rays[0].dir;
+		if (cos_in < 0) {
+			path.normals[1] = face_normal;
+			path.rays[0].cosines[1] = -cos_in;
+		} else {
+			path.normals[1] = -1 * face_normal;
+			path.rays[0].cosines[1] = cos_in;
+		}
+
+		if (material.is_light) {
+			float weight = 1;
+			if (pdf_bsdf > 0) {
+				Vec d = path.rays[1].orig - path.rays[0].orig;
+				float pdf_light = emitters.pdf_area(*path.faces[1]) * (d * d)
+					/ fmaxf(path.rays[0].cosines[1], GEOMETRY_EPSILON);
+				weight = mis_weight(pdf_bsdf, pdf_light);
+			}
+			path.I *= static_cast<const EmitterMaterial &>(material).emission;
+			path.I *= weight;
+			splat(pix_i, pix_j, path.I);
+			stats.reached_light++;
+			return;
+		}
+
+		// the last vertex only exists to hit lights
+		if (max_depth > 0 && depth >= max_depth) {
+			stats.max_depth++;
+			return;
+		}
+
+		const uint32_t dim = sample_bounce_dim(depth);
+		float u_light[4];
+		sampler.get4(dim + BOUNCE_LIGHT_POINT, u_light);
+		const bool connect = material.can_connect && !emitters.empty();
+		if (connect) {
+			sample_light(u_light, pix_i, pix_j, 1);
+		}
+
+		float u[MATERIAL_NRAND];
+		get_material_rand(sampler, dim + BOUNCE_MATERIAL, u);
+		material.sample_ray(path, 1, u);
+		path.I /= path.prob_dens[1];
+		material.transfer(path, 1);
+		pdf_bsdf = connect ? path.prob_dens[1] : 0;
+
+		if (depth >= rr_min_depth) {
+			const float survival = fminf(RR_MAX_SURVIVAL, path.I.max());
+			if (u_light[BOUNCE_ROULETTE - BOUNCE_LIGHT_POINT] >= survival) {
+				stats.roulette++;
+				return;
+			}
+			path.I /= survival;
+		}
 
+		// outgoing ray is the incoming ray of the next vertex
+		path.rays[0] = path.rays[1];
+	}
+}
+
+/** sample one whole path and splat it if it hit a light */
+template<int MAX_BOUNCES, typename Sampler>
+void PathTracer::trace_naive(Sampler &sampler)
+{
+	int last_path;
+	if (sample_new_path<MAX_BOUNCES>(sampler, &last_path)) {
 		compute_I(last_path);
 
 		int i, j;
-		camera.get_ij(&i, &j, path.film_x, path.film_y);
-		if (path.I.is_monochromatic) {
-			int cindex = path.I.cindex;
-			film_buffer(i, j, cindex) += path.I.I[cindex] * NWAVELEN;
-		} else {
-			for (int k = 0; k < NWAVELEN; k++) {
-				film_buffer(i, j, k) += path.I.I[k];
+		get_pixel(&i, &j);
+		splat(i, j, path.I);
+	}
+}
+
+static_assert(TILE_SPP % 2 == 0, "tile_half needs TILE_SPP even");
+
+/**
+ * render the tiles handed out by tiles until there are none left; splats
+ * only go to the pixel being sampled, so after half its samples the pixel
+ * of tile_buffer holds the first half (copied to tile_half)
+ */
+template<typename Sampler, int MAX_BOUNCES>
+void PathTracer::render_tiles()
+{
+	Sampler sampler;
+	Tile tile;
+	splat_buffer = &tile_buffer;
+
+	while (!past_deadline() && tiles->next(tid, &tile)) {
+		splat_i0 = tile.i0;
+		splat_j0 = tile.j0;
+		for (pixel_i = tile.i0; pixel_i < tile.i1; pixel_i++) {
+			for (pixel_j = tile.j0; pixel_j < tile.j1; pixel_j++) {
+				const uint32_t pixel = pixel_i * camera.nx + pixel_j;
+				for (int s = 0; s < TILE_SPP; s++) {
+					if (s == TILE_SPP / 2) {
+						tile_half(pixel_i - tile.i0, pixel_j - tile.j0) = Camera::luminance(
+							&tile_buffer(pixel_i - tile.i0, pixel_j - tile.j0, 0));
+					}
+					sampler.start(stream, pixel, tile.pass * TILE_SPP + s);
+					if (nee) {
+						trace_nee(sampler);
+					} else {
+						trace_naive<MAX_BOUNCES>(sampler);
+					}
+				}
 			}
 		}
+		stats.paths += (unsigned long long)TILE_SPP * (tile.i1 - tile.i0) * (tile.j1 - tile.j0);
+		stats.samples += (unsigned long long)TILE_SPP * (tile.i1 - tile.i0) * (tile.j1 - tile.j0);
+
+		publish_rng_state();
+
+		stats.merge_wait += camera.merge_tile(tile_buffer, tile_half, tile.i0, tile.j0,
+			tile.i1 - tile.i0, tile.j1 - tile.j0);
+		stats.merge_wait += camera.merge_probes(probe_buffer);
+		stats.merges++;
+	}
+
+	/* threads waiting for the next round would wait for this one forever */
+	if (past_deadline()) {
+		tiles->cancel();
+	}
+	pixel_i = pixel_j = -1;
+	splat_buffer = &film_buffer;
+	splat_i0 = splat_j0 = 0;
+}
+
+/** max_samples samples over the whole film, numbered as the pixels past it */
+template<typename Sampler, int MAX_BOUNCES>
+void PathTracer::render_film()
+{
+	Sampler sampler;
+
+	/* paths that miss lights contribute zero but still count */
+	for (unsigned long long samples = 0, since_update_samples = 0; samples < max_samples;) {
+		if (unlikely(samples % DEADLINE_CHECK_SAMPLES == 0) && past_deadline()) {
+			break;
+		}
+		sampler.start(stream, camera.nx * camera.ny + tid, samples);
+		if (nee) {
+			trace_nee(sampler);
+		} else {
+			trace_naive<MAX_BOUNCES>(sampler);
+		}
+
+		samples++;
+		stats.paths++;
+		stats.samples++;
+		since_update_samples++;
 
 		if (!BENCHMARKING && unlikely(since_update_samples >= samples_before_update)) {
 			since_update_samples = 0;
@@ -141,3 +428,39 @@ void PathTracer::render()
 		}
 	}
 }
+
+/** with nee, max_bounces does not apply and the kernel is that of cap 0 */
+template<typename Sampler>
+void PathTracer::render_with()
+{
+	with_bounce_cap(nee ? 0 : max_bounces, [this](auto cap) {
+		if (tiles != nullptr) {
+			render_tiles<Sampler, decltype(cap)::value>();
+		} else {
+			render_film<Sampler, decltype(cap)::value>();
+		}
+	});
+}
+
+void PathTracer::render()
+{
+	switch (sampler_type) {
+	case SAMPLER_PCG:
+		render_with<PCGSampler>();
+		break;
+	case SAMPLER_SOBOL:
+		render_with<SobolSampler>();
+		break;
+	case SAMPLER_OWEN_SOBOL:
+		render_with<OwenSobolSampler>();
+		break;
+	}
+}
+
+/* metropolis mutates a PSSRng in place of a sampler, for every bounce cap */
+template bool PathTracer::sample_new_path<0, PSSRng>(PSSRng &sampler, int *last_path);
+template bool PathTracer::sample_new_path<MAX_BOUNCES_PER_PATH, PSSRng>(PSSRng &sampler,
+	int *last_path);
+template bool PathTracer::sample_new_path<16, PSSRng>(PSSRng &sampler, int *last_path);
+template bool PathTracer::sample_new_path<MAX_BOUNCES_LIMIT, PSSRng>(PSSRng &sampler,
+	int *last_path);
@@ -10,29 +10,113 @@
 #define RENDER_H
 
 #include <unistd.h>
+#include <chrono>
 #include <cstdio>
 #include <thread>
+#include <type_traits>
 #include "scene.h"
+#include "tile.h"
+#include "sampler.h"
+
+/**
+ * Per thread counts of work done, summed at the end of a run. Every camera
+ * path ends in exactly one of escaped, max_depth, roulette, reached_light.
+ */
+class RenderStats {
+public:
+	unsigned long long paths = 0;
+	/** samples of the film: camera paths, or mutations for metropolis; the
+	 * image is the film divided by samples per pixel */
+	unsigned long long samples = 0;
+	/** closest hit rays, including camera rays */
+	unsigned long long rays = 0;
+	/** occlusion rays for next event estimation */
+	unsigned long long shadow_rays = 0;
+	/** left the scene without reaching a light */
+	unsigned long long escaped = 0;
+	/** cut at the maximum depth without reaching a light */
+	unsigned long long max_depth = 0;
+	/** ended by russian roulette */
+	unsigned long long roulette = 0;
+	/** hit a light (by bsdf sampling) */
+	unsigned long long reached_light = 0;
+	/** merges of the film into the camera pixel data */
+	unsigned long long merges = 0;
+	/** seconds spent waiting for film locks when merging */
+	double merge_wait = 0;
+
+	RenderStats &operator+=(const RenderStats &other);
+	void print(const char *name, double seconds) const;
+};
+
+/**
+ * Wall clock budget of a render, shared by its threads. Each thread checks
+ * it between tiles (or every DEADLINE_CHECK_SAMPLES samples) and the first to
+ * find it passed raises stop for the others, so every thread merges what it
+ * has and returns soon after.
+ */
+class RenderDeadline {
+public:
+	std::chrono::steady_clock::time_point end;
+	std::atomic<bool> stop{false};
+
+	RenderDeadline(double seconds)
+	: end{std::chrono::steady_clock::now() + std::chrono::duration_cast<
+		std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds))} {}
+
+	bool passed()
+	{
+		if (stop.load(std::memory_order_relaxed)) {
+			return true;
+		}
+		if (std::chrono::steady_clock::now() < end) {
+			return false;
+		}
+		stop.store(true);
+		return true;
+	}
+};
 
 class RenderThread {
 public:
 	const int tid;
+	/** number of render threads, tid is one of 0... nthread-1 */
+	const int nthread;
 	std::unique_ptr<std::thread> thread;
 	Scene &scene;
 	Camera &camera;
 	unsigned long samples_before_update;
+	RenderStats stats;
+	/** shared by the render threads, or nullptr to render every sample;
+	 * set before start() */
+	RenderDeadline *deadline = nullptr;
+	/** with rng_state_mutex, state of the rngs published before merging
+	 * (see publish_rng_state()) */
+	std::mutex rng_state_mutex;
+	std::vector<unsigned long long> rng_state;
 
 	MultiArray<float> film_buffer;
+	/** spectra of camera.probes */
+	MultiArray<float> probe_buffer;
+	/** splat() adds pixel i, j to (*splat_buffer)(i - splat_i0, j - splat_j0):
+	 * film_buffer or the buffer of a tile */
+	MultiArray<float> *splat_buffer;
+	int splat_i0 = 0;
+	int splat_j0 = 0;
 
 	/** polymorphic rendering */
 	virtual void render() {}
 
-	RenderThread(int tid, Scene &scene, unsigned long samples_before_update)
-	: tid{tid}, scene{scene}, camera{scene.camera}, samples_before_update{samples_before_update}
+	RenderThread(int tid, Scene &scene, unsigned long samples_before_update,
+		int nthread = NTHREAD)
+	: tid{tid}, nthread{nthread}, scene{scene}, camera{scene.camera},
+	samples_before_update{samples_before_update}, splat_buffer{&film_buffer}
 	{
 		const MultiArray<float> &pixel_data = camera.raw;
 		film_buffer = MultiArray<float>{pixel_data.n[0], pixel_data.n[1], pixel_data.n[2]};
 		film_buffer.fill(0);
+		probe_buffer = MultiArray<float>{camera.probe_raw.n[0], NWAVELEN};
+		probe_buffer.fill(0);
 	}
 	virtual ~RenderThread()
 	{
@@ -43,9 +127,11 @@ public:
 	{
 		thread = std::make_unique<std::thread>(&RenderThread::thread_main, this);
 	}
+	/** render, then merge what is left of the film */
 	void thread_main()
 	{
 		this->render();
+		update_pixel_data();
 	}
 	void join()
 	{
@@ -57,16 +143,53 @@ public:
 		}
 	}
 
+	/**
+	 * merge film_buffer and probe_buffer (all samples since the last
+	 * merge) into the camera and zero them; threads start merging at
+	 * spread out stripes
+	 */
 	void update_pixel_data() noexcept
 	{
-		camera.update_pixel_data(film_buffer);
+		const int first_stripe = tid * FILM_NSTRIPE / nthread % FILM_NSTRIPE;
+		stats.merge_wait += camera.update_pixel_data(film_buffer, probe_buffer, first_stripe);
+		stats.merges++;
+	}
+
+	/** rng state for checkpoints, empty if the rngs cannot be saved */
+	virtual void save_rngs(std::vector<unsigned long long> &state) const
+	{
+		state.clear();
 	}
+	/** restore save_rngs() state; before start() */
+	virtual void load_rngs(const unsigned long long *state)
+	{
+		(void)state;
+	}
+	/**
+	 * Keep the rng state in rng_state for the checkpointer. Called after
+	 * drawing the samples of a merge and before merging them, so that a
+	 * checkpoint of the film taken before reading rng_state never has
+	 * samples from random numbers past it.
+	 */
+	void publish_rng_state()
+	{
+		std::lock_guard<std::mutex> lock{rng_state_mutex};
+		save_rngs(rng_state);
+	}
+
+	/** if the render is out of time */
+	bool past_deadline()
+	{
+		return deadline != nullptr && deadline->passed();
+	}
+
+	void splat(int i, int j, const SpecificIntensity &I);
 };
 
 class DebugRender : public RenderThread {
 public:
 	DebugRender(int tid, Scene &scene, unsigned long samples_before_update)
-	: RenderThread(tid, scene, samples_before_update) { start(); }
+	: RenderThread(tid, scene, samples_before_update) {}
 
 	void render() {
 		for (int cycle = 0;; cycle++) {
@@ -81,16 +204,109 @@ public:
 	}
 };
 
+/** the MATERIAL_NRAND numbers for Material::sample_ray() from dimension dim */
+template<typename Sampler>
+static inline void get_material_rand(Sampler &sampler, uint32_t dim, float *u)
+{
+	static_assert(MATERIAL_NRAND == 4, "material numbers are one get4() group");
+	sampler.get4(dim, u);
+}
+
+static_assert(MAX_BOUNCES_PER_PATH < 16 && 16 < MAX_BOUNCES_LIMIT,
+	"the bounce caps of with_bounce_cap() must differ");
+
+/**
+ * call f(std::integral_constant<int, MAX_BOUNCES>()) for the kernel of the
+ * bounce cap max_bounces: MAX_BOUNCES_PER_PATH, 16 and MAX_BOUNCES_LIMIT have
+ * kernels of their own, other caps share the one bounded at run time
+ * (MAX_BOUNCES 0)
+ */
+template<typename F>
+static inline void with_bounce_cap(int max_bounces, F &&f)
+{
+	if (max_bounces == MAX_BOUNCES_PER_PATH) {
+		f(std::integral_constant<int, MAX_BOUNCES_PER_PATH>());
+	} else if (max_bounces == 16) {
+		f(std::integral_constant<int, 16>());
+	} else if (max_bounces == MAX_BOUNCES_LIMIT) {
+		f(std::integral_constant<int, MAX_BOUNCES_LIMIT>());
+	} else {
+		f(std::integral_constant<int, 0>());
+	}
+}
+
+/** the bounce cap of the kernel for MAX_BOUNCES from with_bounce_cap() */
+template<int MAX_BOUNCES>
+static inline int bounce_cap(int max_bounces)
+{
+	return MAX_BOUNCES > 0 ? MAX_BOUNCES : max_bounces;
+}
+
+/** power heuristic weight for sampling with prob dens pdf_a over pdf_b */
+static inline float mis_weight(float pdf_a, float pdf_b)
+{
+	return SQR(pdf_a) / (SQR(pdf_a) + SQR(pdf_b));
+}
+
+/**
+ * Unidirectional path tracer. With next event estimation (default), path.I is
+ * the throughput from the camera: at every connectable vertex a light is
+ * sampled and combined with hitting lights by bsdf sampling using multiple
+ * importance sampling. Without it, whole paths are sampled and only those
+ * that hit a light are kept, with I computed backwards from the light.
+ *
+ * With a TileScheduler, tiles are rendered TILE_SPP samples per pixel at a
+ * time into tile_buffer, which is merged into the camera when done; else
+ * max_samples paths are sampled uniformly over the film into film_buffer.
+ * Either way rendering ends early past the deadline.
+ *
+ * The random numbers of a sample come from a sampler (see sampler.h) the
+ * tracing is templated on, keyed by its pixel and number there, so a tiled
+ * render takes the same samples whatever the threads and tiles.
+ */
 class PathTracer : public RenderThread {
 public:
 	Path path;
-	std::vector<std::shared_ptr<Rng>> rngs[2];
+	/** set before start() */
+	SamplerType sampler_type = SAMPLER_OWEN_SOBOL;
+	/** sample stream of this process (see FilmSendThread) */
+	int stream;
+	/** shared by the render threads; set before start() */
+	TileScheduler *tiles = nullptr;
+	MultiArray<float> tile_buffer;
+	/** luminance of the first half of the samples of each pixel of the
+	 * tile, for estimating its error (see Camera::pixel_error()) */
+	MultiArray<float> tile_half;
+	/** pixel being sampled within a tile, or -1 for anywhere on the film */
+	int pixel_i = -1;
+	int pixel_j = -1;
+	/** next event estimation with MIS; set before start() */
+	bool nee = true;
+	/** with nee: depth from which russian roulette may end paths */
+	int rr_min_depth = RR_MIN_DEPTH;
+	/** with nee: deepest vertex, or 0 for unbounded */
+	int max_depth = 0;
+	/** without nee (and for metropolis): most bounces, at most
+	 * MAX_BOUNCES_LIMIT; the kernels are compiled per cap (see
+	 * with_bounce_cap()) */
+	int max_bounces = MAX_BOUNCES_PER_PATH;
+	/** render() returns after this many samples */
+	unsigned long long max_samples;
 
-	PathTracer(int tid, Scene &scene, unsigned long samples_before_update);
-	PathTracer(int tid, Scene &scene, unsigned long samples_before_update, std::vector<unsigned long> &primes);
+	PathTracer(int tid, Scene &scene, unsigned long samples_before_update,
+		int nthread = NTHREAD, int stream = 0);
 
-	bool sample_new_path(int *last_path);
+	template<typename Sampler> void sample_film_xy(Sampler &sampler);
+	void get_pixel(int *i, int *j) const;
+	template<int MAX_BOUNCES, typename Sampler> bool sample_new_path(Sampler &sampler,
+		int *last_path);
 	void compute_I(const int last_path);
+	void sample_light(const float *u_light, int i, int j, int pind);
+	template<int MAX_BOUNCES, typename Sampler> void trace_naive(Sampler &sampler);
+	template<typename Sampler> void trace_nee(Sampler &sampler);
+	template<typename Sampler, int MAX_BOUNCES> void render_tiles();
+	template<typename Sampler, int MAX_BOUNCES> void render_film();
+	template<typename Sampler> void render_with();
 	void render();
 };
 
@@ -13,6 +13,7 @@
 
 #include <cstdlib>
 #include <cstdint>
+#include <cmath>
 #include "rng.h"
 #include "macro_def.h"
 
@@ -100,6 +101,18 @@ float HaltonRng::next()
 	return (float)numerator / denominator;
 }
 
+void HaltonRng::save(unsigned long long *state) const
+{
+	state[0] = numerator;
+	state[1] = denominator;
+}
+
+void HaltonRng::load(const unsigned long long *state)
+{
+	numerator = state[0];
+	denominator = state[1];
+}
+
 RandRng::RandRng(unsigned int seed)
 : seed{seed} {}
 
@@ -107,3 +120,99 @@ float RandRng::next()
 {
 	return (float)rand_r(&seed) / RAND_MAX;
 }
+
+void RandRng::save(unsigned long long *state) const
+{
+	state[0] = seed;
+}
+
+void RandRng::load(const unsigned long long *state)
+{
+	seed = state[0];
+}
+
+PSSRng::PSSRng(unsigned int seed, float sigma, float large_step_prob)
+: rng{seed}, sigma{sigma}, large_step_prob{large_step_prob} {}
+
+/**
+ * forget the sample vector: the next iteration is a large step whose
+ * coordinates depend only on seed, so it can be replayed
+ */
+void PSSRng::reset(unsigned int seed)
+{
+	u.clear();
+	rng.seed = seed;
+	iteration = 0;
+	last_large_step = 0;
+	large_step = true;
+	index = 0;
+}
+
+void PSSRng::start_iteration()
+{
+	iteration++;
+	large_step = rng.next() < large_step_prob;
+	index = 0;
+}
+
+void PSSRng::accept()
+{
+	if (large_step) {
+		last_large_step = iteration;
+	}
+}
+
+void PSSRng::reject()
+{
+	for (auto &x : u) {
+		if (x.modified == iteration) {
+			x.value = x.value_backup;
+			x.modified = x.modified_backup;
+		}
+	}
+	iteration--;
+}
+
+float PSSRng::get(size_t i)
+{
+	while (i >= u.size()) {
+		/* first use: a fresh uniform, which any mutation leaves uniform */
+		PrimarySample x;
+		x.value = rng.next();
+		x.modified = iteration;
+		x.value_backup = x.value;
+		x.modified_backup = iteration > 0 ? iteration - 1 : 0;
+		u.push_back(x);
+	}
+	PrimarySample &x = u[i];
+	if (x.modified == iteration) {
+		return x.value;
+	}
+
+	// catch up with the last accepted large step
+	if (x.modified < last_large_step) {
+		x.value = rng.next();
+		x.modified = last_large_step;
+	}
+
+	x.value_backup = x.value;
+	x.modified_backup = x.modified;
+	if (large_step) {
+		x.value = rng.next();
+	} else {
+		// box muller gaussian, with the variance of all missed small steps
+		const float r0 = fmaxf(rng.next(), 1e-7f);
+		const float r1 = rng.next();
+		const float normal = sqrtf(-2 * logf(r0)) * cosf(2 * PI_F * r1);
+		x.value += normal * sigma * sqrtf((float)(iteration - x.modified));
+		x.value -= floorf(x.value);
+	}
+	x.modified = iteration;
+
+	return x.value;
+}
+
+float PSSRng::next()
+{
+	return get(index++);
+}
@@ -19,6 +19,11 @@ public:
 	virtual ~Rng() {};
 	/** returns random float between 0 and 1 */
 	virtual float next() {return 0;}
+
+	/** words of state written by save(), for checkpoints */
+	virtual int state_len() const {return 0;}
+	virtual void save(unsigned long long *state) const {(void)state;}
+	virtual void load(const unsigned long long *state) {(void)state;}
 };
 
 /** for quasi Monte Carlo */
@@ -32,6 +37,10 @@ public:
 
 	void reset();
 	float next();
+
+	int state_len() const {return 2;}
+	void save(unsigned long long *state) const;
+	void load(const unsigned long long *state);
 };
 
 /** use rand_r() */
@@ -42,6 +51,56 @@ public:
 	RandRng(unsigned int seed);
 
 	float next();
+
+	int state_len() const {return 1;}
+	void save(unsigned long long *state) const;
+	void load(const unsigned long long *state);
+};
+
+/**
+ * Replayable primary sample vector for Metropolis light transport (Kelemen
+ * et al. 2002): get(i) returns coordinate i (as does the ith call to next()
+ * in an iteration), which is mutated lazily when first used in an iteration;
+ * it can stand in for a sampler (see sampler.h). A large step replaces coordinates
+ * with uniform ones, a small step perturbs them by a gaussian of width sigma
+ * (per iteration since last used). reject() restores the previous state.
+ */
+class PSSRng : public Rng {
+public:
+	class PrimarySample {
+	public:
+		float value = 0;
+		unsigned long long modified = 0;
+		float value_backup = 0;
+		unsigned long long modified_backup = 0;
+	};
+
+	std::vector<PrimarySample> u;
+	/** for the mutations */
+	RandRng rng;
+	float sigma;
+	float large_step_prob;
+	unsigned long long iteration = 0;
+	unsigned long long last_large_step = 0;
+	bool large_step = true;
+	size_t index = 0;
+
+	PSSRng(unsigned int seed, float sigma, float large_step_prob);
+
+	void reset(unsigned int seed);
+	void start_iteration();
+	void accept();
+	void reject();
+	float get(size_t i);
+	float next();
+
+	/** get(i)... get(i + 3) in v */
+	void get4(size_t i, float *v)
+	{
+		for (size_t d = 0; d < 4; d++) {
+			v[d] = get(i + d);
+		}
+	}
 };
 
 #endif /* RNG_H */
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+/**
+ * Samplers are value types the integrators are templated on: after
+ * start(stream, pixel, sample), get(dim) is a uniform number in [0, 1) for
+ * dimension dim of sample number sample of pixel, a pure function of them.
+ * So there is no virtual call or heap state per number, and the samples of a
+ * pixel do not depend on the thread drawing them or on the order.
+ *
+ * Dimensions of a path tracer sample are laid out as below so each has the
+ * same meaning in every sample, which the Sobol samplers stratify 4 at a
+ * time; pairs that are best stratified (e.g. a direction) come first in a
+ * group of 4.
+ */
+enum SampleDim {
+	SAMPLE_FILM_X = 0,
+	SAMPLE_FILM_Y = 1,
+	/** hero wavelength */
+	SAMPLE_WAVELENGTH = 2,
+	/** dimensions before those of the first bounce */
+	SAMPLE_CAMERA_DIMS = 4
+};
+
+/**
+ * dimensions of a bounce, from sample_bounce_dim(): the material numbers and
+ * the light and roulette numbers are each a group of 4, drawn by get4()
+ */
+enum BounceDim {
+	/** MATERIAL_NRAND numbers for Material::sample_ray() */
+	BOUNCE_MATERIAL = 0,
+	/** 2 numbers for a point on a light, then which light */
+	BOUNCE_LIGHT_POINT = 4,
+	BOUNCE_LIGHT_CHOICE = 6,
+	BOUNCE_ROULETTE = 7,
+	BOUNCE_DIMS = 8
+};
+
+static_assert(SAMPLE_CAMERA_DIMS % 4 == 0 && BOUNCE_MATERIAL % 4 == 0
+	&& BOUNCE_LIGHT_POINT % 4 == 0 && BOUNCE_DIMS % 4 == 0,
+	"get4() groups must start at multiples of 4");
+
+/** first dimension of bounce depth (1 for the first vertex past the camera) */
+static inline uint32_t sample_bounce_dim(int depth)
+{
+	return SAMPLE_CAMERA_DIMS + (uint32_t)(depth - 1) * BOUNCE_DIMS;
+}
+
+enum SamplerType {
+	SAMPLER_PCG,
+	SAMPLER_SOBOL,
+	SAMPLER_OWEN_SOBOL
+};
+
+/** 32 random bits to a float in [0, 1) */
+static inline float bits_to_unit(uint32_t x)
+{
+	return (x >> 8) * 0x1p-24f;
+}
+
+/** a good 32 bit integer hash (Wellons' lowbias32) */
+static inline uint32_t hash_u32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+/** the output permutation of PCG applied to one LCG step of x */
+static inline uint32_t pcg_hash(uint32_t x)
+{
+	const uint32_t state = x * 747796405U + 2891336453U;
+	const uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737U;
+	return (word >> 22) ^ word;
+}
+
+static inline constexpr uint32_t reverse_bits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+	x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+	return __builtin_bswap32(x);
+}
+
+/**
+ * Owen scrambling of bit reversed x (Burley 2020, "Practical Hash-based Owen
+ * Scrambling"): the Laine-Karras permutation flips each bit by a hash of seed
+ * and the bits below it, so reversed each bit is flipped by those above it
+ */
+static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+	x ^= x * 0x3d20adeaU;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56U;
+	x ^= x * 0x53a22864U;
+	return x;
+}
+
+/** Owen scrambling of x given bit reversed, as reversed_x */
+static inline uint32_t nested_uniform_scramble_reversed(uint32_t reversed_x, uint32_t seed)
+{
+	return reverse_bits(laine_karras_permutation(reversed_x, seed));
+}
+
+/**
+ * The first 4 dimensions of the Sobol sequence. Direction numbers are those
+ * of Joe and Kuo (dimension 0 is van der Corput), built at compile time into
+ * tables of the xor of the directions of each byte value of the bit reversed
+ * index (which is what the index scrambling makes), so a point is 4 lookups
+ * without branches. reversed_table holds the same bit reversed, for Owen
+ * scrambling, which works on reversed points.
+ */
+class Sobol4 {
+public:
+	uint32_t table[4][4][256];
+	uint32_t reversed_table[4][4][256];
+
+	constexpr Sobol4() : table{}, reversed_table{}
+	{
+		/* degree s, coefficients a and initial m_k of the primitive
+		 * polynomial of dimensions 1, 2, 3 */
+		const uint32_t s[4] = {0, 1, 2, 3};
+		const uint32_t a[4] = {0, 0, 1, 1};
+		const uint32_t m[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+		uint32_t v[4][32] = {};
+
+		for (int k = 0; k < 32; k++) {
+			v[0][k] = 1U << (31 - k);
+		}
+		for (int d = 1; d < 4; d++) {
+			for (uint32_t k = 0; k < 32; k++) {
+				if (k < s[d]) {
+					v[d][k] = m[d][k] << (31 - k);
+					continue;
+				}
+				v[d][k] = v[d][k - s[d]] ^ (v[d][k - s[d]] >> s[d]);
+				for (uint32_t i = 1; i < s[d]; i++) {
+					if ((a[d] >> (s[d] - 1 - i)) & 1) {
+						v[d][k] ^= v[d][k - i];
+					}
+				}
+			}
+		}
+
+		for (int d = 0; d < 4; d++) {
+			for (int byte = 0; byte < 4; byte++) {
+				for (int x = 0; x < 256; x++) {
+					for (int bit = 0; bit < 8; bit++) {
+						if ((x >> bit) & 1) {
+							table[d][byte][x] ^= v[d][31 - 8*byte - bit];
+						}
+					}
+					reversed_table[d][byte][x] = reverse_bits(table[d][byte][x]);
+				}
+			}
+		}
+	}
+
+	/** point reverse_bits(r) of dimension dim (0... 3), as 32 bits */
+	uint32_t point_reversed(uint32_t r, uint32_t dim) const
+	{
+		return table[dim][0][r & 0xff] ^ table[dim][1][(r >> 8) & 0xff]
+			^ table[dim][2][(r >> 16) & 0xff] ^ table[dim][3][r >> 24];
+	}
+
+	/** reverse_bits(point_reversed(r, dim)) */
+	uint32_t reversed_point_reversed(uint32_t r, uint32_t dim) const
+	{
+		return reversed_table[dim][0][r & 0xff] ^ reversed_table[dim][1][(r >> 8) & 0xff]
+			^ reversed_table[dim][2][(r >> 16) & 0xff] ^ reversed_table[dim][3][r >> 24];
+	}
+};
+
+static constexpr Sobol4 sobol4{};
+
+/** independent numbers: a PCG hash of the sample key and dimension */
+class PCGSampler {
+public:
+	uint32_t seed = 0;
+
+	void start(uint32_t stream, uint32_t pixel, uint64_t sample)
+	{
+		seed = pcg_hash(pcg_hash(pixel + pcg_hash(stream)) ^ (uint32_t)sample)
+			+ (uint32_t)(sample >> 32);
+	}
+
+	float get(uint32_t dim) const
+	{
+		return bits_to_unit(pcg_hash(seed ^ (dim * 0x9e3779b9U)));
+	}
+
+	/** get(dim)... get(dim + 3) in u */
+	void get4(uint32_t dim, float *u) const
+	{
+		for (uint32_t d = 0; d < 4; d++) {
+			u[d] = get(dim + d);
+		}
+	}
+};
+
+/**
+ * Sobol points padded 4 dimensions at a time: each group of 4 dimensions of
+ * a pixel takes the point at a sample index shuffled by a hash of the pixel
+ * and group (so groups are not correlated with each other), randomized by
+ * a digital shift (an xor) per pixel and dimension.
+ */
+class SobolSampler {
+public:
+	uint32_t seed = 0;
+	/** bit reversed sample number */
+	uint32_t sample_reversed = 0;
+
+	void start(uint32_t stream, uint32_t pixel, uint64_t sample)
+	{
+		seed = hash_u32(pixel ^ hash_u32(stream));
+		sample_reversed = reverse_bits(sample);
+	}
+
+	float get(uint32_t dim) const
+	{
+		const uint32_t group_seed = hash_u32(seed ^ ((dim >> 2) * 0x9e3779b9U));
+		const uint32_t index_reversed = laine_karras_permutation(sample_reversed, group_seed);
+		const uint32_t x = sobol4.point_reversed(index_reversed, dim & 3);
+		return bits_to_unit(x ^ hash_u32(group_seed + (dim & 3)));
+	}
+
+	/**
+	 * get(dim)... get(dim + 3) in u for dim a multiple of 4, hashing the
+	 * group and shuffling the index once
+	 */
+	void get4(uint32_t dim, float *u) const
+	{
+		const uint32_t group_seed = hash_u32(seed ^ ((dim >> 2) * 0x9e3779b9U));
+		const uint32_t index_reversed = laine_karras_permutation(sample_reversed, group_seed);
+		for (uint32_t d = 0; d < 4; d++) {
+			const uint32_t x = sobol4.point_reversed(index_reversed, d);
+			u[d] = bits_to_unit(x ^ hash_u32(group_seed + d));
+		}
+	}
+};
+
+/**
+ * As SobolSampler but Owen scrambled instead of shifted, which keeps the
+ * stratification of the points while making their errors random and
+ * decorrelated between pixels (Burley 2020)
+ */
+class OwenSobolSampler {
+public:
+	uint32_t seed = 0;
+	/** bit reversed sample number */
+	uint32_t sample_reversed = 0;
+
+	void start(uint32_t stream, uint32_t pixel, uint64_t sample)
+	{
+		seed = hash_u32(pixel ^ hash_u32(stream));
+		sample_reversed = reverse_bits(sample);
+	}
+
+	float get(uint32_t dim) const
+	{
+		const uint32_t group_seed = hash_u32(seed ^ ((dim >> 2) * 0x9e3779b9U));
+		const uint32_t index_reversed = laine_karras_permutation(sample_reversed, group_seed);
+		const uint32_t x = sobol4.reversed_point_reversed(index_reversed, dim & 3);
+		return bits_to_unit(nested_uniform_scramble_reversed(x,
+			hash_u32(group_seed + (dim & 3))));
+	}
+
+	/** as SobolSampler::get4() */
+	void get4(uint32_t dim, float *u) const
+	{
+		const uint32_t group_seed = hash_u32(seed ^ ((dim >> 2) * 0x9e3779b9U));
+		const uint32_t index_reversed = laine_karras_permutation(sample_reversed, group_seed);
+		for (uint32_t d = 0; d < 4; d++) {
+			const uint32_t x = sobol4.reversed_point_reversed(index_reversed, d);
+			u[d] = bits_to_unit(nested_uniform_scramble_reversed(x, hash_u32(group_seed + d)));
+		}
+	}
+};
+
+#endif /* SAMPLER_H */
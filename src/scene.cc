@@ -13,7 +13,9 @@
 
 #include <algorithm>
 #include <cfloat>
+#include <chrono>
 #include "scene.h"
+#include "parallel.h"
 
 /**
  * This should be set once at beginning to be the order of magnitude scale size
@@ -37,6 +39,7 @@ Camera::Camera(float focal_len, float film_diagonal, const Vec &position,
 	this->normal.normalize();
 	this->ny = ny;
 	this->nx = nx;
+	init_basis();
 }
 
 Camera::Camera(const Camera &camera)
@@ -55,24 +58,287 @@ Camera &Camera::operator=(const Camera &camera)
 
 	nx = camera.nx;
 	ny = camera.ny;
+	init_basis();
 
 	return *this;
 }
 
+void Camera::init_basis()
+{
+	for (int i = 0; i < 3; i++) {
+		basis[i] = Vec{0, 0, 0};
+		basis[i].x[i] = 1;
+		z_to_normal_rotation(normal, basis[i], 1);
+	}
+}
+
 void Camera::init_pixel_data()
 {
-	raw = MultiArray<float>{ny, nx, NWAVELEN};
+	raw = MultiArray<float>{ny, nx, FILM_NCHANNEL};
 	raw.fill(0);
+
+	probes.clear();
+	probe_index = MultiArray<int>{ny, nx};
+	probe_index.fill(-1);
+	probe_raw = MultiArray<float>{0, NWAVELEN};
+	raw_half = MultiArray<float>{};
+	spp = MultiArray<float>{};
+}
+
+/**
+ * keep spp and raw_half, counted by merge_tile(), for adaptive sampling
+ * (see AdaptiveTileScheduler) or when tiles may get unequal passes (a time
+ * budget); snapshot() then gives the mean per sample of each pixel. Call
+ * after init_pixel_data().
+ */
+void Camera::init_sample_counts()
+{
+	raw_half = MultiArray<float>{ny, nx};
+	raw_half.fill(0);
+	spp = MultiArray<float>{ny, nx};
+	spp.fill(0);
+}
+
+/** luminance per sample over the film, with sample counts */
+float Camera::mean_luminance() const
+{
+	double sum = 0;
+	double nsample = 0;
+	for (int i = 0; i < ny; i++) {
+		for (int j = 0; j < nx; j++) {
+			sum += luminance(&raw.data[(i*nx + j)*FILM_NCHANNEL]);
+			nsample += spp.data[i*nx + j];
+		}
+	}
+	return nsample > 0 ? sum / nsample : 0;
+}
+
+/**
+ * Estimated relative error of the luminance of pixel i, j, with sample
+ * counts. If the sums of the two halves of its samples are a and b, the
+ * standard error of the mean is about |a - b| / 2 of that of (a + b) / 2,
+ * so the relative error is |a - b| / (a + b). The denominator is at least
+ * floor per sample.
+ */
+float Camera::pixel_error(int i, int j, float floor) const
+{
+	const float n = spp.data[i*nx + j];
+	if (n <= 0) {
+		return INFINITY;
+	}
+	const float a = raw_half.data[i*nx + j];
+	const float sum = luminance(&raw.data[(i*nx + j)*FILM_NCHANNEL]);
+	return fabsf(2 * a - sum) / fmaxf(sum, floor * n);
 }
 
-void Camera::update_pixel_data(MultiArray<float> &other) noexcept
+/**
+ * keep the full spectrum of pixel i, j in probe_raw too; call after
+ * init_pixel_data() and before render threads are made
+ *
+ * @return false if out of the image
+ */
+bool Camera::add_probe(int i, int j)
 {
-	mutex.lock();
-	raw += other;
-	pixel_data_updated = true;
-	mutex.unlock();
+	if (i < 0 || i >= ny || j < 0 || j >= nx) {
+		return false;
+	}
+	if (probe_index(i, j) < 0) {
+		probe_index(i, j) = probes.size();
+		probes.emplace_back(i, j);
+		probe_raw = MultiArray<float>{(int)probes.size(), NWAVELEN};
+		probe_raw.fill(0);
+	}
+	return true;
+}
+
+/** lock m, adding the seconds spent waiting for it to *wait */
+static inline void timed_lock(std::mutex &m, double *wait)
+{
+	if (likely(m.try_lock())) {
+		return;
+	}
+	const auto t0 = std::chrono::steady_clock::now();
+	m.lock();
+	*wait += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/** add stripe of other to raw, whose lock is held, unlock and zero other there */
+void Camera::merge_stripe(int stripe, MultiArray<float> &other) noexcept
+{
+	const int row_len = nx * raw.n[2];
+	const int begin = stripe_begin(stripe) * row_len;
+	const int end = stripe_begin(stripe + 1) * row_len;
+
+	for (int i = begin; i < end; i++) {
+		raw(i) += other(i);
+	}
+	stripe_mutex[stripe].unlock();
+
+	memset(&other.data[begin], 0, (end - begin) * sizeof(other.data[0]));
+}
 
+/**
+ * Add other (a render thread's film since its last merge) and other_probes
+ * to the pixel data, then zero them. Stripes of rows are locked one at a
+ * time, from first_stripe on, so threads starting at different stripes
+ * rarely meet and never wait for a whole frame. Busy stripes are skipped and
+ * retried; only when every remaining stripe is busy does the thread wait.
+ *
+ * @return seconds spent waiting for locks
+ */
+double Camera::update_pixel_data(MultiArray<float> &other, MultiArray<float> &other_probes,
+	int first_stripe) noexcept
+{
+	double wait = 0;
+	bool merged[FILM_NSTRIPE] = {false};
+
+	for (int nmerged = 0; nmerged < FILM_NSTRIPE;) {
+		int first_busy = -1;
+		bool progress = false;
+		for (int k = 0; k < FILM_NSTRIPE; k++) {
+			const int stripe = (first_stripe + k) % FILM_NSTRIPE;
+			if (merged[stripe]) {
+				continue;
+			}
+			if (!stripe_mutex[stripe].try_lock()) {
+				if (first_busy < 0) {
+					first_busy = stripe;
+				}
+				continue;
+			}
+			merge_stripe(stripe, other);
+			merged[stripe] = true;
+			nmerged++;
+			progress = true;
+		}
+
+		if (!progress) {
+			/* every remaining stripe is busy: wait for one rather than spin */
+			timed_lock(stripe_mutex[first_busy], &wait);
+			merge_stripe(first_busy, other);
+			merged[first_busy] = true;
+			nmerged++;
+		}
+	}
+
+	wait += merge_probes(other_probes);
+
+	pixel_data_updated.store(true);
 	cond.notify_all();
+	return wait;
+}
+
+/**
+ * add tile (pixels i0... i0+ni-1, j0... j0+nj-1 of the film, tile(0, 0) is
+ * the first) to the pixel data and zero it, locking the stripes it is in;
+ * the image broadcaster polls for these. With sample counts, tile_half
+ * (luminance of the first half of the samples) is added to raw_half and
+ * TILE_SPP to spp, else it is only zeroed.
+ *
+ * @return seconds spent waiting for locks
+ */
+double Camera::merge_tile(MultiArray<float> &tile, MultiArray<float> &tile_half,
+	int i0, int j0, int ni, int nj) noexcept
+{
+	double wait = 0;
+	const int nchannel = raw.n[2];
+	const bool counted = spp.len > 0;
+
+	for (int i = 0; i < ni;) {
+		const int stripe = stripe_of_row(i0 + i);
+		const int stripe_end = std::min(stripe_begin(stripe + 1) - i0, ni);
+
+		timed_lock(stripe_mutex[stripe], &wait);
+		for (; i < stripe_end; i++) {
+			float *dst = &raw(i0 + i, j0, 0);
+			const float *src = &tile(i, 0, 0);
+			for (int k = 0; k < nj * nchannel; k++) {
+				dst[k] += src[k];
+			}
+			if (counted) {
+				for (int j = 0; j < nj; j++) {
+					raw_half(i0 + i, j0 + j) += tile_half(i, j);
+					spp(i0 + i, j0 + j) += TILE_SPP;
+				}
+			}
+		}
+		stripe_mutex[stripe].unlock();
+	}
+
+	tile.fill(0);
+	tile_half.fill(0);
+	pixel_data_updated.store(true);
+	return wait;
+}
+
+/**
+ * add other_probes to probe_raw and zero them
+ *
+ * @return seconds spent waiting for the lock
+ */
+double Camera::merge_probes(MultiArray<float> &other_probes) noexcept
+{
+	double wait = 0;
+	if (other_probes.len > 0) {
+		timed_lock(probe_mutex, &wait);
+		probe_raw += other_probes;
+		probe_mutex.unlock();
+		other_probes.fill(0);
+	}
+	return wait;
+}
+
+/**
+ * copy raw to out one stripe at a time, so mergers only wait for a copy;
+ * with sample counts, pixels are divided by their samples
+ */
+void Camera::snapshot(MultiArray<float> &out)
+{
+	if (out.len != raw.len) {
+		out = MultiArray<float>{raw.n[0], raw.n[1], raw.n[2]};
+	}
+
+	const int row_len = nx * raw.n[2];
+	for (int stripe = 0; stripe < FILM_NSTRIPE; stripe++) {
+		const int begin = stripe_begin(stripe) * row_len;
+		const int end = stripe_begin(stripe + 1) * row_len;
+
+		stripe_mutex[stripe].lock();
+		memcpy(&out.data[begin], &raw.data[begin], (end - begin) * sizeof(raw.data[0]));
+		if (spp.len > 0) {
+			for (int i = begin; i < end; i++) {
+				const float n = spp(i / raw.n[2]);
+				out(i) = n > 0 ? out(i) / n : 0;
+			}
+		}
+		stripe_mutex[stripe].unlock();
+	}
+}
+
+/**
+ * copy raw, spp, raw_half (with sample counts) and probe_raw as they are,
+ * for checkpoints; like snapshot(), a stripe at a time so that each pixel's
+ * sums and count agree
+ */
+void Camera::copy_counted(float *out_raw, float *out_spp, float *out_half, float *out_probes)
+{
+	const int row_len = nx * raw.n[2];
+	for (int stripe = 0; stripe < FILM_NSTRIPE; stripe++) {
+		const int begin = stripe_begin(stripe);
+		const int end = stripe_begin(stripe + 1);
+
+		stripe_mutex[stripe].lock();
+		memcpy(&out_raw[begin * row_len], &raw.data[begin * row_len],
+			(end - begin) * row_len * sizeof(float));
+		memcpy(&out_spp[begin * nx], &spp.data[begin * nx], (end - begin) * nx * sizeof(float));
+		memcpy(&out_half[begin * nx], &raw_half.data[begin * nx],
+			(end - begin) * nx * sizeof(float));
+		stripe_mutex[stripe].unlock();
+	}
+
+	probe_mutex.lock();
+	memcpy(out_probes, probe_raw.data, probe_raw.len * sizeof(float));
+	probe_mutex.unlock();
 }
 
 /**
@@ -81,23 +347,44 @@ void Camera::update_pixel_data(MultiArray<float> &other) noexcept
  * film_x increases to the right, film_y increases downwards, film_z is camera normal.
  *
  * First, film is placed parallel to xy plane at z = -focal len, the ray is
- * drawn, then the z-axis and ray are rotated to the final camera normal
+ * drawn, then the z-axis and ray are rotated to the final camera normal: the
+ * ray through the lens is along (-film_x, -film_y, focal_len) in the rotated
+ * basis.
  *
  * (TODO: extra film rotation in xy plane so that camera is always level after
  * rotating to normal)
  */
 void Camera::get_init_ray(Ray &ray, const float film_x, const float film_y) const
 {
-	float theta, phi;
-
-	theta = atanf(sqrtf(SQR(film_x) + SQR(film_y)) / focal_len);
-	phi = atan2f(film_y, film_x) + PI_F;
-
+	float *const dir[3] = {&ray.dir.x[0], &ray.dir.x[1], &ray.dir.x[2]};
 	ray.orig = position;
-	ray.dir.x[0] = sinf(theta) * cosf(phi);
-	ray.dir.x[1] = sinf(theta) * sinf(phi);
-	ray.dir.x[2] = cosf(theta);
-	z_to_normal_rotation(normal, ray.dir, 1);
+	get_init_dirs(dir, &film_x, &film_y, 1);
+}
+
+/**
+ * get_init_ray() for n film points at once, in a loop the compiler
+ * vectorizes: directions of the rays from position in dir[xyz][0...n-1]
+ */
+void Camera::get_init_dirs(float *const dir[3], const float *film_x, const float *film_y,
+	int n) const
+{
+	float *__restrict__ dx = dir[0];
+	float *__restrict__ dy = dir[1];
+	float *__restrict__ dz = dir[2];
+	const Vec bx = basis[0];
+	const Vec by = basis[1];
+	const Vec bz = focal_len * basis[2];
+	for (int k = 0; k < n; k++) {
+		const float x = -film_x[k];
+		const float y = -film_y[k];
+		const float vx = x * bx.x[0] + y * by.x[0] + bz.x[0];
+		const float vy = x * bx.x[1] + y * by.x[1] + bz.x[1];
+		const float vz = x * bx.x[2] + y * by.x[2] + bz.x[2];
+		const float inv_len = 1.0f / sqrtf(vx * vx + vy * vy + vz * vz);
+		dx[k] = vx * inv_len;
+		dy[k] = vy * inv_len;
+		dz[k] = vz * inv_len;
+	}
 }
 
 /**
@@ -119,6 +406,49 @@ void Camera::get_ij(int *i, int *j, const float film_x, const float film_y) cons
 	*i = std::max(0, std::min(ny-1, *i));
 }
 
+/**
+ * inverse of get_ij(): film point at fractions u, v (from 0 to 1) across
+ * pixel i, j
+ */
+void Camera::get_film_xy_in_pixel(float *film_x, float *film_y, int i, int j,
+	float u, float v) const
+{
+	*film_x = film_width / 2 - (j + u) * (film_width / nx);
+	*film_y = film_height / 2 - (i + v) * (film_height / ny);
+}
+
+/**
+ * inverse of get_init_ray(): the film point whose ray leaves the camera in
+ * direction dir
+ *
+ * @return false if dir misses the film
+ */
+bool Camera::get_film_xy(float *film_x, float *film_y, const Vec &dir) const
+{
+	Vec v = dir;
+	z_to_normal_rotation(normal, v, -1);
+	if (v.x[2] <= 0) {
+		return false;
+	}
+
+	*film_x = -focal_len * v.x[0] / v.x[2];
+	*film_y = -focal_len * v.x[1] / v.x[2];
+	return fabsf(*film_x) < film_width / 2 && fabsf(*film_y) < film_height / 2;
+}
+
+/**
+ * prob dens wrt solid angle of get_init_ray() giving direction dir when the
+ * film point is uniform: film area is focal_len^2 / cos^3 per solid angle
+ */
+float Camera::pdf_dir(const Vec &dir) const
+{
+	const float cos_theta = normal * dir;
+	if (cos_theta <= 0) {
+		return 0;
+	}
+	return SQR(focal_len) / (film_width * film_height * CUBE(cos_theta));
+}
+
 static Box all_faces_bounding_box(const std::vector<std::unique_ptr<Face>> &all_faces)
 {
 	Vec corners[2];
@@ -173,33 +503,130 @@ Scene::Scene(const Box &bounding_box,
 	const Camera &camera)
 : bounding_box{bounding_box}, all_faces{std::move(all_faces)}, all_materials{std::move(all_materials)}, camera{camera} {}
 
-void Scene::init()
+void Scene::init(AccelType accel_type, int nthread)
 {
 	// setup camera
 	camera.init_pixel_data();
 
-	// ensure faces are id'ed and normals and bounding boxes are computed
-	std::vector<std::shared_ptr<Box>> faces_bounding_boxes;
+	// ensure faces are id'ed and normals are computed
 	for (auto &face : all_faces) {
 		face->compute_normal();
-		faces_bounding_boxes.push_back(std::make_shared<Box>(face_bounding_box(*face)));
 	}
+	for (size_t i = 0; i < all_materials.size(); i++) {
+		all_materials[i]->index = i;
+	}
+	for (auto &face : all_faces) {
+		face->material_index = face->material->index;
+	}
+	materials.init(all_materials);
 
 	// set char len
 	Vec lower{bounding_box.corners[0][0], bounding_box.corners[0][1], bounding_box.corners[0][2]};
 	Vec upper{bounding_box.corners[1][0], bounding_box.corners[1][1], bounding_box.corners[1][2]};
 	global_characteristic_length_scale = (upper - lower).len() / 32;
 
-	// build octree
+	emitters.init(all_faces);
+	build_accel(accel_type, nthread);
+}
+
+/**
+ * (re)build the acceleration structure for ray face intersection
+ *
+ * @param nthread number of threads to build with
+ */
+void Scene::build_accel(AccelType accel_type, int nthread)
+{
 	std::vector<Face*> all_faces_raw;
 	for (auto &face : all_faces) {
 		all_faces_raw.push_back(face.get());
 	}
-	octree_root = Octree{bounding_box, all_faces_raw, faces_bounding_boxes,
-		OCTREE_MAX_FACE_PER_BOX, OCTREE_MAX_SUBDIV};
+
+	switch (accel_type) {
+	case ACCEL_BVH:
+		accel = std::make_unique<BVH>(all_faces_raw, BVH_MAX_FACE_PER_LEAF, nthread);
+		break;
+	case ACCEL_BVH4:
+		accel = std::make_unique<BVH4>(all_faces_raw, BVH_MAX_FACE_PER_LEAF, nthread);
+		break;
+	case ACCEL_OCTREE:
+	default:
+		std::vector<Box> faces_bounding_boxes(all_faces.size());
+		parallel_for(all_faces.size(), 4096, nthread, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				faces_bounding_boxes[i] = face_bounding_box(*all_faces[i]);
+			}
+		});
+		accel = std::make_unique<Octree>(bounding_box, all_faces_raw,
+			faces_bounding_boxes, octree_max_face_per_box, octree_max_subdiv,
+			nthread);
+		break;
+	}
+}
+
+static float face_area(const Face &face)
+{
+	return 0.5f * ((face.v[1] - face.v[0]) ^ (face.v[2] - face.v[0])).len();
+}
+
+/** collect faces with emitter materials and their power cdf */
+void EmitterList::init(const std::vector<std::unique_ptr<Face>> &all_faces)
+{
+	faces.clear();
+	cdf.clear();
+	total_power = 0;
+
+	for (auto &face : all_faces) {
+		if (!face->material->is_light) {
+			continue;
+		}
+		const EmitterMaterial &material = *static_cast<EmitterMaterial *>(face->material);
+		const float power = face_area(*face) * material.mean_emission;
+		if (power <= 0) {
+			continue;
+		}
+		faces.push_back(face.get());
+		total_power += power;
+		cdf.push_back(total_power);
+	}
+
+	for (auto &c : cdf) {
+		c /= total_power;
+	}
+}
+
+/**
+ * sample point on an emitter
+ *
+ * @param point stores the sampled point here
+ * @param face stores the emitting face here
+ * @param r0 chooses the face
+ * @param r1,r2 choose the point on the face
+ *
+ * @return prob dens wrt area
+ */
+float EmitterList::sample(Vec *point, Face **face, float r0, float r1, float r2) const
+{
+	size_t ind = std::upper_bound(cdf.begin(), cdf.end(), r0) - cdf.begin();
+	ind = std::min(ind, faces.size() - 1);
+	const Face &f = *faces[ind];
+
+	/* uniform in triangle */
+	const float su = sqrtf(r1);
+	const float b0 = 1 - su;
+	const float b1 = r2 * su;
+	*point = b0 * f.v[0] + b1 * f.v[1] + (1 - b0 - b1) * f.v[2];
+	*face = faces[ind];
+
+	return pdf_area(f);
+}
+
+/** @return prob dens wrt area of sample() choosing a point on face */
+float EmitterList::pdf_area(const Face &face) const
+{
+	return static_cast<EmitterMaterial *>(face.material)->mean_emission / total_power;
 }
 
-Scene build_test_scene()
+Scene build_test_scene(int nx, int ny)
 {
 	std::vector<std::unique_ptr<Material>> all_materials;
 	float emission[3] = {1, 0, 1};
@@ -216,12 +643,12 @@ Scene build_test_scene()
 
 	Box bounding_box = all_faces_bounding_box(all_faces);
 
-	Camera camera{35, 35, Vec{0,-10,0}, Vec{0,1,0}, IMAGE_WIDTH, IMAGE_HEIGHT};
+	Camera camera{35, 35, Vec{0,-10,0}, Vec{0,1,0}, nx, ny};
 
 	return Scene{bounding_box, std::move(all_faces), std::move(all_materials), camera};
 }
 
-Scene build_test_scene2()
+Scene build_test_scene2(int nx, int ny)
 {
 	std::vector<std::unique_ptr<Material>> all_materials;
 	float white[3] = {0.9, 0.9, 0.9};
@@ -262,7 +689,7 @@ Scene build_test_scene2()
 
 	Box bounding_box = all_faces_bounding_box(all_faces);
 
-	Camera camera{35, 35, Vec{0.5,-3,0.5}, Vec{0,1,0}, IMAGE_WIDTH, IMAGE_HEIGHT};
+	Camera camera{35, 35, Vec{0.5,-3,0.5}, Vec{0,1,0}, nx, ny};
 
 	return Scene{bounding_box, std::move(all_faces), std::move(all_materials), camera};
 }
@@ -9,11 +9,13 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include "multiarray.h"
 #include "material.h"
 #include "octree.h"
+#include "bvh4.h"
 
 /**
  * Represents a physical camera with film
@@ -30,14 +32,34 @@ public:
 	Vec position;
 	/** direction camera is pointing */
 	Vec normal;
+	/** unit x, y, z rotated to the camera as get_init_ray() rotates rays
+	 * (basis[2] is normal), set by init_basis() */
+	Vec basis[3];
 
 	int nx;
 	int ny;
 
-	bool pixel_data_updated = false;
+	std::atomic<bool> pixel_data_updated{false};
 	/** indexing order: same convention as image:
-	 * y, x, freq; use macro campera_pix to access */
+	 * y, x, channel: CIE XYZ if FILM_XYZ, else wavelength */
 	MultiArray<float> raw;
+	/** pixels (i, j) whose full spectrum is also kept, see add_probe() */
+	std::vector<std::pair<int, int>> probes;
+	/** index into probes of each pixel, or -1 */
+	MultiArray<int> probe_index;
+	/** probe, wavelength: spectra of the probe pixels */
+	MultiArray<float> probe_raw;
+	/** with sample counts (see init_sample_counts()), y, x: luminance of
+	 * the first half of the samples of every tile task */
+	MultiArray<float> raw_half;
+	/** with sample counts, y, x: samples of each pixel */
+	MultiArray<float> spp;
+	/** locks rows stripe_begin(s) to stripe_begin(s+1) of raw (and
+	 * raw_half, spp) */
+	std::mutex stripe_mutex[FILM_NSTRIPE];
+	/** locks probe_raw */
+	std::mutex probe_mutex;
+	/** with mutex, signals pixel_data_updated */
 	std::mutex mutex;
 	std::condition_variable cond;
 
@@ -47,11 +69,68 @@ public:
 	Camera(const Camera &camera);
 	Camera &operator=(const Camera &camera);
 
+	void init_basis();
 	void init_pixel_data();
-	void update_pixel_data(MultiArray<float> &other) noexcept;
+	void init_sample_counts();
+	bool add_probe(int i, int j);
+	/** Y of CIE XYZ, or the mean over wavelengths */
+	static float luminance(const float *pixel)
+	{
+		if (FILM_XYZ) {
+			return pixel[1];
+		}
+		float sum = 0;
+		for (int k = 0; k < FILM_NCHANNEL; k++) {
+			sum += pixel[k];
+		}
+		return sum / FILM_NCHANNEL;
+	}
+	float mean_luminance() const;
+	float pixel_error(int i, int j, float floor) const;
+	int stripe_begin(int stripe) const
+	{
+		return stripe * ny / FILM_NSTRIPE;
+	}
+	/** the stripe containing row i: last one beginning at or before it */
+	int stripe_of_row(int i) const
+	{
+		return ((i + 1) * FILM_NSTRIPE + ny - 1) / ny - 1;
+	}
+	void merge_stripe(int stripe, MultiArray<float> &other) noexcept;
+	double update_pixel_data(MultiArray<float> &other, MultiArray<float> &other_probes,
+		int first_stripe) noexcept;
+	double merge_tile(MultiArray<float> &tile, MultiArray<float> &tile_half,
+		int i0, int j0, int ni, int nj) noexcept;
+	double merge_probes(MultiArray<float> &other_probes) noexcept;
+	void snapshot(MultiArray<float> &out);
+	void copy_counted(float *out_raw, float *out_spp, float *out_half, float *out_probes);
 
 	void get_init_ray(Ray &ray, const float film_x, const float film_y) const;
+	void get_init_dirs(float *const dir[3], const float *film_x, const float *film_y,
+		int n) const;
 	void get_ij(int *i, int *j, const float film_x, const float film_y) const;
+	void get_film_xy_in_pixel(float *film_x, float *film_y, int i, int j,
+		float u, float v) const;
+	bool get_film_xy(float *film_x, float *film_y, const Vec &dir) const;
+	float pdf_dir(const Vec &dir) const;
+};
+
+/**
+ * emitting faces for next event estimation: a face is chosen in proportion to
+ * its power (area * mean emission) then a point uniformly on it, so the
+ * density wrt area is mean emission / total power
+ */
+class EmitterList {
+public:
+	std::vector<Face*> faces;
+	/** cdf[i] is the probability of choosing one of faces[0...i] */
+	std::vector<float> cdf;
+	float total_power = 0;
+
+	void init(const std::vector<std::unique_ptr<Face>> &all_faces);
+	bool empty() const { return faces.empty(); }
+	float sample(Vec *point, Face **face, float r0, float r1, float r2) const;
+	float pdf_area(const Face &face) const;
 };
 
 class Scene {
@@ -59,8 +138,13 @@ public:
 	Box bounding_box;
 	std::vector<std::unique_ptr<Face>> all_faces;
 	std::vector<std::unique_ptr<Material>> all_materials;
-	Octree octree_root;
+	MaterialTable materials;
+	std::unique_ptr<AccelStruct> accel;
+	EmitterList emitters;
 	Camera camera;
+	/** octree limits, set before init() */
+	int octree_max_face_per_box = OCTREE_MAX_FACE_PER_BOX;
+	int octree_max_subdiv = OCTREE_MAX_SUBDIV;
 
 	Scene() {}
 	Scene(std::vector<std::unique_ptr<Face>> &&all_faces,
@@ -71,10 +155,11 @@ public:
 		std::vector<std::unique_ptr<Material>> &&all_materials,
 		const Camera &camera);
 
-	void init();
+	void init(AccelType accel_type = DEFAULT_ACCEL, int nthread = NTHREAD);
+	void build_accel(AccelType accel_type, int nthread = NTHREAD);
 };
 
-Scene build_test_scene();
-Scene build_test_scene2();
+Scene build_test_scene(int nx = IMAGE_WIDTH, int ny = IMAGE_HEIGHT);
+Scene build_test_scene2(int nx = IMAGE_WIDTH, int ny = IMAGE_HEIGHT);
 
 #endif /* SCENE_H */
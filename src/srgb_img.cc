@@ -8,6 +8,7 @@
 
 #include <cstdio>
 #include <cfloat>
+#include <vector>
 #include "srgb_img.h"
 #include "color.h"
 
@@ -114,3 +115,79 @@ void SRGBImgPhysicalConverter::make_image(const MultiArray<float> &raw)
 	alloc_same_size(raw);
 	percentile_linmap(img_data, srgb_float);
 }
+
+void SRGBImgXYZConverter::make_image(const MultiArray<float> &raw)
+{
+	const int height = raw.n[0];
+	const int width = raw.n[1];
+	MultiArray<float> srgb_float{height, width, 3};
+
+	ColorRGB rgb;
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++) {
+			rgb = Color::XYZ_to_RGB(ColorXYZ{raw(i, j, 0), raw(i, j, 1), raw(i, j, 2)});
+			for (int k = 0; k < 3; k++) {
+				srgb_float(i, j, k) = rgb.rgb[k];
+			}
+		}
+	}
+
+	alloc_same_size(raw);
+	percentile_linmap(img_data, srgb_float);
+}
+
+/**
+ * write img (e.g. SRGBImgConverter::img_data) as a binary PPM
+ *
+ * @return false if the file could not be written
+ */
+bool write_ppm(const char *fname, const MultiArray<uint8_t> &img)
+{
+	FILE *file = fopen(fname, "wb");
+	if (file == NULL) {
+		return false;
+	}
+	fprintf(file, "P6\n%d %d\n255\n", img.n[1], img.n[0]);
+	const bool ok = fwrite(img.data, 1, img.len, file) == (size_t)img.len;
+	return fclose(file) == 0 && ok;
+}
+
+/**
+ * write raw pixel data (as in Camera::raw) as a PFM of linear sRGB, without
+ * clipping or scaling: the values are those of the film
+ *
+ * @return false if the file could not be written
+ */
+bool write_pfm(const char *fname, const MultiArray<float> &raw)
+{
+	const int height = raw.n[0];
+	const int width = raw.n[1];
+
+	FILE *file = fopen(fname, "wb");
+	if (file == NULL) {
+		return false;
+	}
+	/* negative scale: little endian; rows go from the bottom up */
+	fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+	bool ok = true;
+	std::vector<float> row(3 * width);
+	for (int i = height - 1; i >= 0; i--) {
+		for (int j = 0; j < width; j++) {
+			const float *pixel = &raw.data[(i*width + j)*raw.n[2]];
+			ColorRGB rgb;
+			if (NWAVELEN == 3) {
+				rgb = ColorRGB{pixel[0], pixel[1], pixel[2]};
+			} else if (FILM_XYZ) {
+				rgb = Color::XYZ_to_linear_RGB(ColorXYZ{pixel[0], pixel[1], pixel[2]});
+			} else {
+				rgb = Color::XYZ_to_linear_RGB(Color::physical_to_XYZ(pixel));
+			}
+			for (int k = 0; k < 3; k++) {
+				row[3*j + k] = rgb.rgb[k];
+			}
+		}
+		ok = ok && fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+	}
+	return fclose(file) == 0 && ok;
+}
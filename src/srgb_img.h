@@ -36,4 +36,13 @@ public:
 	void make_image(const MultiArray<float> &raw);
 };
 
+/** treats the 3 values as CIE XYZ (see FILM_XYZ) */
+class SRGBImgXYZConverter : public SRGBImgConverter {
+public:
+	void make_image(const MultiArray<float> &raw);
+};
+
+bool write_ppm(const char *fname, const MultiArray<uint8_t> &img);
+bool write_pfm(const char *fname, const MultiArray<float> &raw);
+
 #endif /* SRGB_IMG_H */
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Work stealing scheduler of image tiles, and adaptive sampling.
+ */
+
+#include <algorithm>
+#include "tile.h"
+
+/** one round of npass passes of every tile */
+TileScheduler::TileScheduler(int ny, int nx, unsigned long long npass, int nthread)
+: ny{ny}, nx{nx}, nthread{std::max(nthread, 1)}, npass{npass}
+{
+	ntile_i = (ny + TILE_SIZE - 1) / TILE_SIZE;
+	ntile_j = (nx + TILE_SIZE - 1) / TILE_SIZE;
+	ntile = ntile_i * ntile_j;
+
+	ranges = std::make_unique<TaskRange[]>(this->nthread);
+	start_round(std::vector<unsigned long long>(ntile, npass));
+}
+
+/**
+ * make the tasks of a round, one group of tiles per thread; no thread may be
+ * taking tasks
+ *
+ * @param passes passes of each tile (0 for none)
+ */
+void TileScheduler::start_round(const std::vector<unsigned long long> &passes)
+{
+	if (passes_before.empty()) {
+		passes_before.assign(ntile, 0);
+		next_pass = std::make_unique<std::atomic<unsigned long long>[]>(ntile);
+	} else {
+		for (int t = 0; t < ntile; t++) {
+			passes_before[t] += round_passes[t];
+		}
+	}
+	round_passes = passes;
+	for (int t = 0; t < ntile; t++) {
+		next_pass[t].store(passes_before[t], std::memory_order_relaxed);
+	}
+
+	round_ntask = 0;
+	for (int t = 0; t < ntile; t++) {
+		round_ntask += passes[t];
+	}
+
+	/* group g has the tiles whose first task would be in thread g's share
+	 * of the round if the tiles went in order */
+	round_tiles.clear();
+	group_tile_start.assign(nthread + 1, 0);
+	group_task_start.assign(nthread + 1, round_ntask);
+	layer_start.clear();
+	group_layer_start.assign(nthread + 1, 0);
+	unsigned long long tasks_before = 0;
+	int t = 0;
+	for (int g = 0; g < nthread; g++) {
+		group_tile_start[g] = round_tiles.size();
+		group_task_start[g] = tasks_before;
+		group_layer_start[g] = layer_start.size();
+		for (; t < ntile && tasks_before * nthread / std::max(round_ntask, 1ULL)
+				<= (unsigned long long)g; t++) {
+			if (passes[t] > 0) {
+				round_tiles.push_back(t);
+				tasks_before += passes[t];
+			}
+		}
+
+		const auto tiles = round_tiles.begin() + group_tile_start[g];
+		std::stable_sort(tiles, round_tiles.end(), [&](int a, int b) {
+			return passes[a] > passes[b];
+		});
+
+		/* pass p has the tiles with more than p passes: the first m */
+		size_t m = round_tiles.end() - tiles;
+		const unsigned long long max_passes = m > 0 ? passes[tiles[0]] : 0;
+		for (unsigned long long p = 0, task = group_task_start[g]; p < max_passes; p++) {
+			while (passes[tiles[m-1]] <= p) {
+				m--;
+			}
+			layer_start.push_back(task);
+			task += m;
+		}
+	}
+	group_tile_start[nthread] = round_tiles.size();
+	group_layer_start[nthread] = layer_start.size();
+
+	for (int g = 0; g < nthread; g++) {
+		ranges[g].begin = group_task_start[g];
+		ranges[g].end = group_task_start[g + 1];
+	}
+	ntask += round_ntask;
+	rounds++;
+}
+
+/** pixels of tile t */
+void TileScheduler::get_tile(int t, Tile *tile) const
+{
+	tile->i0 = (t / ntile_j) * TILE_SIZE;
+	tile->j0 = (t % ntile_j) * TILE_SIZE;
+	tile->i1 = std::min(tile->i0 + TILE_SIZE, ny);
+	tile->j1 = std::min(tile->j0 + TILE_SIZE, nx);
+}
+
+/**
+ * passes of tile t in the pixel data of camera (with sample counts): those
+ * of its least sampled pixel, as a checkpoint may catch a tile halfway
+ * through merging
+ */
+unsigned long long TileScheduler::passes_done(const Camera &camera, int t) const
+{
+	Tile tile;
+	get_tile(t, &tile);
+	float spp = INFINITY;
+	for (int i = tile.i0; i < tile.i1; i++) {
+		for (int j = tile.j0; j < tile.j1; j++) {
+			spp = fminf(spp, camera.spp.data[i*nx + j]);
+		}
+	}
+	return spp / TILE_SPP;
+}
+
+/**
+ * Redo the first round for a render resumed with camera pixel data from a
+ * checkpoint (see Checkpoint), giving each tile the passes it still lacks;
+ * before any thread takes tasks. As passes are handed out in order, a tile
+ * has finished its first passes_done() ones, but for a checkpoint written
+ * while rendering: pixels of tiles caught halfway through a merge, or tiles
+ * a stolen pass of which was merged before an earlier one, get a pass more
+ * than the others, which Camera::spp accounts for (the pass redone repeats
+ * its sample numbers there).
+ */
+void TileScheduler::resume(const Camera &camera)
+{
+	std::vector<unsigned long long> passes(ntile);
+	for (int t = 0; t < ntile; t++) {
+		const unsigned long long done = passes_done(camera, t);
+		passes[t] = npass - std::min(done, npass);
+		passes_before[t] = done;
+	}
+	round_passes.assign(ntile, 0);
+
+	ntask -= round_ntask;
+	rounds--;
+	start_round(passes);
+}
+
+/**
+ * get the next tile for thread tid, stealing if its own range is empty and
+ * waiting for the next round if every range is
+ *
+ * @return false if there is no work left
+ */
+bool TileScheduler::next(int tid, Tile *tile)
+{
+	TaskRange &own = ranges[tid];
+	unsigned long long task;
+
+	for (;;) {
+		own.mutex.lock();
+		if (own.begin < own.end) {
+			task = own.begin++;
+			own.mutex.unlock();
+			break;
+		}
+		own.mutex.unlock();
+
+		if (!steal(tid) && !end_round()) {
+			return false;
+		}
+	}
+
+	const int g = std::upper_bound(group_task_start.begin(), group_task_start.end(), task)
+		- group_task_start.begin() - 1;
+	const unsigned long long *layers = &layer_start[group_layer_start[g]];
+	const size_t nlayer = group_layer_start[g + 1] - group_layer_start[g];
+	const size_t p = std::upper_bound(layers, layers + nlayer, task) - layers - 1;
+	const int t = round_tiles[group_tile_start[g] + task - layers[p]];
+	get_tile(t, tile);
+	tile->pass = next_pass[t].fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * move the back half of the largest other range to thread tid
+ *
+ * @return false if every range is empty
+ */
+bool TileScheduler::steal(int tid)
+{
+	for (;;) {
+		int victim = -1;
+		unsigned long long most = 0;
+		for (int k = 1; k < nthread; k++) {
+			const int t = (tid + k) % nthread;
+			ranges[t].mutex.lock();
+			const unsigned long long left = ranges[t].end - ranges[t].begin;
+			ranges[t].mutex.unlock();
+			if (left > most) {
+				most = left;
+				victim = t;
+			}
+		}
+		if (victim < 0) {
+			return false;
+		}
+
+		/* the victim may have advanced since: re-check under its lock */
+		TaskRange &from = ranges[victim];
+		from.mutex.lock();
+		if (from.begin >= from.end) {
+			from.mutex.unlock();
+			continue;
+		}
+		const unsigned long long mid = from.begin + (from.end - from.begin) / 2;
+		const unsigned long long end = from.end;
+		from.end = mid;
+		from.mutex.unlock();
+
+		/* with one task left, mid == begin and the whole range moves */
+		TaskRange &own = ranges[tid];
+		own.mutex.lock();
+		own.begin = mid;
+		own.end = end;
+		own.mutex.unlock();
+		steals++;
+		return true;
+	}
+}
+
+/**
+ * wait for every thread to run out of tasks; the last one plans the next
+ * round (each thread merges its tile before asking for another, so the film
+ * is complete then)
+ *
+ * @return false if there is no next round
+ */
+bool TileScheduler::end_round()
+{
+	std::unique_lock<std::mutex> lock{round_mutex};
+	if (finished) {
+		return false;
+	}
+
+	const int round = rounds;
+	if (++nwaiting == nthread) {
+		nwaiting = 0;
+		finished = !next_round();
+		round_cond.notify_all();
+	} else {
+		round_cond.wait(lock, [&]() {
+			return finished || rounds != round;
+		});
+	}
+	return !finished;
+}
+
+/** end rendering: next() returns false from now on, also to threads waiting
+ * for the next round */
+void TileScheduler::cancel()
+{
+	std::lock_guard<std::mutex> lock{round_mutex};
+	finished = true;
+	round_cond.notify_all();
+}
+
+/** the first round, min_pass passes of every tile */
+AdaptiveTileScheduler::AdaptiveTileScheduler(Camera &camera, unsigned long long min_pass,
+	unsigned long long max_pass, float target, int nthread)
+: TileScheduler(camera.ny, camera.nx, std::min(min_pass, max_pass), nthread),
+camera{camera}, target{target}, max_pass{max_pass}
+{
+	camera.init_sample_counts();
+	tile_passes.assign(ntile, std::min(min_pass, max_pass));
+	tile_error.assign(ntile, INFINITY);
+}
+
+/** the first round continued: afterwards each tile has had at least
+ * min_pass passes */
+void AdaptiveTileScheduler::resume(const Camera &camera)
+{
+	TileScheduler::resume(camera);
+	for (int t = 0; t < ntile; t++) {
+		tile_passes[t] = std::max(passes_done(camera, t), npass);
+	}
+}
+
+/** mean relative error of the pixels of tile t */
+float AdaptiveTileScheduler::compute_tile_error(int t, float floor) const
+{
+	Tile tile;
+	get_tile(t, &tile);
+
+	double sum = 0;
+	for (int i = tile.i0; i < tile.i1; i++) {
+		for (int j = tile.j0; j < tile.j1; j++) {
+			sum += camera.pixel_error(i, j, floor);
+		}
+	}
+	return sum / ((tile.i1 - tile.i0) * (tile.j1 - tile.j0));
+}
+
+bool AdaptiveTileScheduler::next_round()
+{
+	const float floor = ADAPTIVE_DARK_FLOOR * camera.mean_luminance();
+
+	std::vector<unsigned long long> passes(ntile, 0);
+	bool more = false;
+	for (int t = 0; t < ntile; t++) {
+		tile_error[t] = compute_tile_error(t, floor);
+		const unsigned long long n = tile_passes[t];
+		if (tile_error[t] <= target || n >= max_pass) {
+			continue;
+		}
+
+		const double needed = n * (SQR((double)tile_error[t] / target) - 1);
+		passes[t] = std::min({(unsigned long long)ceil(needed), n, max_pass - n});
+		passes[t] = std::max(passes[t], 1ULL);
+		tile_passes[t] += passes[t];
+		more = true;
+	}
+
+	if (more) {
+		start_round(passes);
+	}
+	return more;
+}
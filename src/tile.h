@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef TILE_H
+#define TILE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "macro_def.h"
+#include "scene.h"
+
+/** pixels [i0, i1) x [j0, j1) of the film, rendered by one task */
+class Tile {
+public:
+	int i0;
+	int j0;
+	int i1;
+	int j1;
+	/** which pass of the tile this task is (set by TileScheduler::next()):
+	 * its samples are numbers TILE_SPP * pass... of each pixel */
+	unsigned long long pass;
+};
+
+/** tasks [begin, end) owned by one thread */
+class TaskRange {
+public:
+	std::mutex mutex;
+	unsigned long long begin = 0;
+	unsigned long long end = 0;
+};
+
+/**
+ * Hands out tiles of TILE_SIZE^2 pixels to nthread render threads, one pass
+ * of TILE_SPP samples per pixel of a tile per task. Work comes in rounds,
+ * each giving every tile some number of passes. The tiles of a round are
+ * split into one group of contiguous tiles per thread, with about equal
+ * passes, and each thread owns the tasks of its group, done pass-major so
+ * that the film fills in evenly. Threads take from the front of their range;
+ * a thread out of tasks steals the back half of the largest other range, so
+ * threads that are slower (or get less cpu) are relieved by the others.
+ *
+ * A task is a tile; its pass number is handed out when it is taken, in order
+ * for each tile. So however the tasks are split and stolen, the passes a
+ * tile has finished when rendering stops are its first ones, which is what
+ * resume() continues from.
+ *
+ * When all tasks of a round are done, the last thread out plans the next
+ * with next_round() while the others wait: here there is only one round of
+ * npass passes of every tile.
+ */
+class TileScheduler {
+public:
+	int ntile_i;
+	int ntile_j;
+	int ntile;
+	int ny;
+	int nx;
+	int nthread;
+	/** passes of every tile in the first round */
+	unsigned long long npass;
+	/** tasks of all rounds so far, and of this round */
+	unsigned long long ntask = 0;
+	unsigned long long round_ntask = 0;
+	int rounds = 0;
+	std::unique_ptr<TaskRange[]> ranges;
+	std::atomic<unsigned long long> steals{0};
+
+	/** tiles of this round by group, each group most passes first: group g
+	 * is round_tiles[group_tile_start[g]...group_tile_start[g+1]-1] and has
+	 * tasks group_task_start[g]...group_task_start[g+1]-1 */
+	std::vector<int> round_tiles;
+	std::vector<size_t> group_tile_start;
+	std::vector<unsigned long long> group_task_start;
+	/** with layers = &layer_start[group_layer_start[g]], tasks layers[p]...
+	 * layers[p+1]-1 are pass layer p of group g: the first of its tiles (all
+	 * with more than p passes this round) */
+	std::vector<unsigned long long> layer_start;
+	std::vector<size_t> group_layer_start;
+	/** passes of each tile before this round, and in it */
+	std::vector<unsigned long long> passes_before;
+	std::vector<unsigned long long> round_passes;
+	/** pass of each tile to hand out next */
+	std::unique_ptr<std::atomic<unsigned long long>[]> next_pass;
+
+	/** with round_cond, end of round barrier */
+	std::mutex round_mutex;
+	std::condition_variable round_cond;
+	int nwaiting = 0;
+	bool finished = false;
+
+	TileScheduler(int ny, int nx, unsigned long long npass, int nthread);
+	virtual ~TileScheduler() {}
+
+	bool next(int tid, Tile *tile);
+	bool steal(int tid);
+	bool end_round();
+	void cancel();
+	void start_round(const std::vector<unsigned long long> &passes);
+	void get_tile(int t, Tile *tile) const;
+	unsigned long long passes_done(const Camera &camera, int t) const;
+	virtual void resume(const Camera &camera);
+
+	/**
+	 * called with every thread waiting, all tasks merged into the camera
+	 *
+	 * @return false to end rendering, else start_round() must have been called
+	 */
+	virtual bool next_round() { return false; }
+};
+
+/**
+ * Adaptive sampling: every tile gets min_pass passes, then rounds give more
+ * to the tiles whose mean estimated relative error (Camera::pixel_error())
+ * is above target, until none are or they have max_pass passes. As error
+ * goes as 1/sqrt(samples), a tile with error e after n passes needs about
+ * n (e / target)^2 in all; at most n more are given per round since e is
+ * itself noisy.
+ */
+class AdaptiveTileScheduler : public TileScheduler {
+public:
+	Camera &camera;
+	float target;
+	unsigned long long max_pass;
+	/** passes of each tile so far */
+	std::vector<unsigned long long> tile_passes;
+	/** mean relative error of each tile at the end of the last round */
+	std::vector<float> tile_error;
+
+	AdaptiveTileScheduler(Camera &camera, unsigned long long min_pass,
+		unsigned long long max_pass, float target, int nthread);
+
+	float compute_tile_error(int t, float floor) const;
+	bool next_round();
+	void resume(const Camera &camera);
+};
+
+#endif /* TILE_H */
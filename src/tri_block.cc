@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief SoA triangle blocks and SIMD ray intersection kernels for
+ * acceleration structure leaves.
+ *
+ * The kernels are compiled with target attributes and selected at runtime
+ * so that the binary still runs (scalar) on cpus without avx2/sse4.1.
+ */
+
+#include <cfloat>
+#include <cstring>
+#include "tri_block.h"
+#include "macro_def.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRI_BLOCK_X86 1
+#include <immintrin.h>
+#else
+#define TRI_BLOCK_X86 0
+#endif
+
+/* see scene.cc */
+extern float global_characteristic_length_scale;
+
+/**
+ * pack faces into blocks[0...tri_block_count(nfaces)-1], padding the last
+ * block; blocks must already be allocated
+ */
+void write_tri_blocks(TriBlock *blocks, Face *const *faces, size_t nfaces)
+{
+	for (size_t i = 0; i < nfaces; i += TRI_BLOCK_WIDTH) {
+		TriBlock &block = blocks[i / TRI_BLOCK_WIDTH];
+		memset(&block, 0, sizeof(block));
+
+		for (size_t k = 0; k < TRI_BLOCK_WIDTH && i + k < nfaces; k++) {
+			const Face &f = *faces[i + k];
+			Vec e0 = f.v[1] - f.v[0];
+			Vec e1 = f.v[2] - f.v[0];
+			for (int j = 0; j < 3; j++) {
+				block.v0[j][k] = f.v[0].x[j];
+				block.e0[j][k] = e0.x[j];
+				block.e1[j][k] = e1.x[j];
+			}
+			block.face[k] = faces[i + k];
+			block.material_index[k] = f.material_index;
+		}
+	}
+}
+
+/** pack faces into blocks appended to the end of blocks */
+void append_tri_blocks(std::vector<TriBlock> &blocks, Face *const *faces, size_t nfaces)
+{
+	const size_t first = blocks.size();
+	blocks.resize(first + tri_block_count(nfaces));
+	write_tri_blocks(&blocks[first], faces, nfaces);
+}
+
+/*
+ * Each kernel is a template on ANY_HIT: if true it returns at the first hit
+ * found in [tlo, *t) instead of searching for the nearest, for occlusion
+ * queries.
+ */
+
+/** one face at a time, same arithmetic as ray_face_intersect() */
+template<bool ANY_HIT>
+static bool intersect_scalar(const TriBlock *blocks, uint32_t nblocks,
+	const Ray &r, float tlo, float *t, Face **face, int *material_index)
+{
+	const float eps_vol = GEOMETRY_EPSILON * CUBE(global_characteristic_length_scale);
+	const float tmin = fmaxf(tlo, GEOMETRY_EPSILON * global_characteristic_length_scale);
+	float tbest = *t;
+	Face *hit_face = nullptr;
+	int hit_material = -1;
+
+	for (uint32_t b = 0; b < nblocks; b++) {
+		const TriBlock &block = blocks[b];
+		for (int k = 0; k < TRI_BLOCK_WIDTH; k++) {
+			Vec v0{block.v0[0][k], block.v0[1][k], block.v0[2][k]};
+			Vec e0{block.e0[0][k], block.e0[1][k], block.e0[2][k]};
+			Vec e1{block.e1[0][k], block.e1[1][k], block.e1[2][k]};
+
+			Vec vxe1 = r.dir ^ e1;
+			float pyramid_vol = vxe1 * e0;
+			if (fabsf(pyramid_vol) < eps_vol)
+				continue;
+
+			Vec r0v0 = r.orig - v0;
+			float u1 = vxe1 * r0v0;
+			Vec tmp = r0v0 ^ e0;
+			float u2 = tmp * r.dir;
+			if (u1 * pyramid_vol < 0 || u2 * pyramid_vol < 0 || fabsf(u1 + u2) > fabsf(pyramid_vol))
+				continue;
+
+			float tcand = (tmp * e1) / pyramid_vol;
+			if (tcand >= tmin && tcand < tbest) {
+				tbest = tcand;
+				hit_face = block.face[k];
+				hit_material = block.material_index[k];
+				if (ANY_HIT) {
+					goto done;
+				}
+			}
+		}
+	}
+
+done:
+	if (hit_face != nullptr) {
+		*t = tbest;
+		*face = hit_face;
+		*material_index = hit_material;
+		return true;
+	}
+	return false;
+}
+
+#if TRI_BLOCK_X86
+
+/** reduce per lane best t and face index to the overall nearest hit */
+static bool reduce_lanes(const TriBlock *blocks, const float *lane_t,
+	const int *lane_ind, int nlane, float *t, Face **face, int *material_index)
+{
+	int best = -1;
+	float tbest = *t;
+	for (int k = 0; k < nlane; k++) {
+		if (lane_t[k] < tbest) {
+			tbest = lane_t[k];
+			best = k;
+		}
+	}
+	if (best < 0) {
+		return false;
+	}
+
+	const int ind = lane_ind[best];
+	*t = tbest;
+	*face = blocks[ind / TRI_BLOCK_WIDTH].face[ind % TRI_BLOCK_WIDTH];
+	*material_index = blocks[ind / TRI_BLOCK_WIDTH].material_index[ind % TRI_BLOCK_WIDTH];
+	return true;
+}
+
+/** for ANY_HIT: store the hit of the first lane set in mask */
+static bool first_lane_hit(const TriBlock &block, int h, const float *lane_t,
+	int lane_mask, float *t, Face **face, int *material_index)
+{
+	const int k = __builtin_ctz(lane_mask);
+	*t = lane_t[k];
+	*face = block.face[h + k];
+	*material_index = block.material_index[h + k];
+	return true;
+}
+
+/** 4 faces at a time: each block is processed as two halves */
+template<bool ANY_HIT>
+__attribute__((target("sse4.1")))
+static bool intersect_sse4(const TriBlock *blocks, uint32_t nblocks,
+	const Ray &r, float tlo, float *t, Face **face, int *material_index)
+{
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 eps_vol = _mm_set1_ps(GEOMETRY_EPSILON * CUBE(global_characteristic_length_scale));
+	const __m128 tmin = _mm_set1_ps(fmaxf(tlo, GEOMETRY_EPSILON * global_characteristic_length_scale));
+	const __m128 dx = _mm_set1_ps(r.dir.x[0]);
+	const __m128 dy = _mm_set1_ps(r.dir.x[1]);
+	const __m128 dz = _mm_set1_ps(r.dir.x[2]);
+	const __m128 ox = _mm_set1_ps(r.orig.x[0]);
+	const __m128 oy = _mm_set1_ps(r.orig.x[1]);
+	const __m128 oz = _mm_set1_ps(r.orig.x[2]);
+
+	__m128 tbest = _mm_set1_ps(*t);
+	__m128i ibest = _mm_set1_epi32(-1);
+	__m128i ind = _mm_setr_epi32(0, 1, 2, 3);
+	const __m128i four = _mm_set1_epi32(4);
+
+	for (uint32_t b = 0; b < nblocks; b++) {
+		const TriBlock &block = blocks[b];
+		for (int h = 0; h < TRI_BLOCK_WIDTH; h += 4) {
+			__m128 e0x = _mm_load_ps(&block.e0[0][h]);
+			__m128 e0y = _mm_load_ps(&block.e0[1][h]);
+			__m128 e0z = _mm_load_ps(&block.e0[2][h]);
+			__m128 e1x = _mm_load_ps(&block.e1[0][h]);
+			__m128 e1y = _mm_load_ps(&block.e1[1][h]);
+			__m128 e1z = _mm_load_ps(&block.e1[2][h]);
+
+			/* vxe1 = dir x e1, pyramid_vol = vxe1 . e0 */
+			__m128 cx = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+			__m128 cy = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+			__m128 cz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+			__m128 vol = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, e0x), _mm_mul_ps(cy, e0y)), _mm_mul_ps(cz, e0z));
+
+			/* r0v0 = orig - v0 */
+			__m128 sx = _mm_sub_ps(ox, _mm_load_ps(&block.v0[0][h]));
+			__m128 sy = _mm_sub_ps(oy, _mm_load_ps(&block.v0[1][h]));
+			__m128 sz = _mm_sub_ps(oz, _mm_load_ps(&block.v0[2][h]));
+			__m128 u1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, sx), _mm_mul_ps(cy, sy)), _mm_mul_ps(cz, sz));
+
+			/* tmp = r0v0 x e0 */
+			__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e0z), _mm_mul_ps(sz, e0y));
+			__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e0x), _mm_mul_ps(sx, e0z));
+			__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e0y), _mm_mul_ps(sy, e0x));
+			__m128 u2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, dx), _mm_mul_ps(qy, dy)), _mm_mul_ps(qz, dz));
+			__m128 tnum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, e1x), _mm_mul_ps(qy, e1y)), _mm_mul_ps(qz, e1z));
+
+			__m128 abs_vol = _mm_andnot_ps(sign_mask, vol);
+			__m128 mask = _mm_cmpge_ps(abs_vol, eps_vol);
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_mul_ps(u1, vol), zero));
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_mul_ps(u2, vol), zero));
+			mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_andnot_ps(sign_mask, _mm_add_ps(u1, u2)), abs_vol));
+
+			/* avoid dividing by zero in rejected lanes */
+			__m128 tcand = _mm_div_ps(tnum, _mm_blendv_ps(one, vol, mask));
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(tcand, tmin));
+			mask = _mm_and_ps(mask, _mm_cmplt_ps(tcand, tbest));
+
+			if (ANY_HIT) {
+				int lane_mask = _mm_movemask_ps(mask);
+				if (lane_mask) {
+					alignas(16) float lane_t[4];
+					_mm_store_ps(lane_t, tcand);
+					return first_lane_hit(block, h, lane_t, lane_mask, t, face, material_index);
+				}
+				continue;
+			}
+
+			tbest = _mm_blendv_ps(tbest, tcand, mask);
+			ibest = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(ibest),
+				_mm_castsi128_ps(ind), mask));
+			ind = _mm_add_epi32(ind, four);
+		}
+	}
+
+	alignas(16) float lane_t[4];
+	alignas(16) int lane_ind[4];
+	_mm_store_ps(lane_t, tbest);
+	_mm_store_si128((__m128i *)lane_ind, ibest);
+	return reduce_lanes(blocks, lane_t, lane_ind, 4, t, face, material_index);
+}
+
+/** 8 faces (one block) at a time */
+template<bool ANY_HIT>
+__attribute__((target("avx2,fma")))
+static bool intersect_avx2(const TriBlock *blocks, uint32_t nblocks,
+	const Ray &r, float tlo, float *t, Face **face, int *material_index)
+{
+	const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 eps_vol = _mm256_set1_ps(GEOMETRY_EPSILON * CUBE(global_characteristic_length_scale));
+	const __m256 tmin = _mm256_set1_ps(fmaxf(tlo, GEOMETRY_EPSILON * global_characteristic_length_scale));
+	const __m256 dx = _mm256_set1_ps(r.dir.x[0]);
+	const __m256 dy = _mm256_set1_ps(r.dir.x[1]);
+	const __m256 dz = _mm256_set1_ps(r.dir.x[2]);
+	const __m256 ox = _mm256_set1_ps(r.orig.x[0]);
+	const __m256 oy = _mm256_set1_ps(r.orig.x[1]);
+	const __m256 oz = _mm256_set1_ps(r.orig.x[2]);
+
+	__m256 tbest = _mm256_set1_ps(*t);
+	__m256i ibest = _mm256_set1_epi32(-1);
+	__m256i ind = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i eight = _mm256_set1_epi32(8);
+
+	for (uint32_t b = 0; b < nblocks; b++) {
+		const TriBlock &block = blocks[b];
+		__m256 e0x = _mm256_load_ps(block.e0[0]);
+		__m256 e0y = _mm256_load_ps(block.e0[1]);
+		__m256 e0z = _mm256_load_ps(block.e0[2]);
+		__m256 e1x = _mm256_load_ps(block.e1[0]);
+		__m256 e1y = _mm256_load_ps(block.e1[1]);
+		__m256 e1z = _mm256_load_ps(block.e1[2]);
+
+		/* vxe1 = dir x e1, pyramid_vol = vxe1 . e0 */
+		__m256 cx = _mm256_fmsub_ps(dy, e1z, _mm256_mul_ps(dz, e1y));
+		__m256 cy = _mm256_fmsub_ps(dz, e1x, _mm256_mul_ps(dx, e1z));
+		__m256 cz = _mm256_fmsub_ps(dx, e1y, _mm256_mul_ps(dy, e1x));
+		__m256 vol = _mm256_fmadd_ps(cz, e0z, _mm256_fmadd_ps(cy, e0y, _mm256_mul_ps(cx, e0x)));
+
+		/* r0v0 = orig - v0 */
+		__m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(block.v0[0]));
+		__m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(block.v0[1]));
+		__m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(block.v0[2]));
+		__m256 u1 = _mm256_fmadd_ps(cz, sz, _mm256_fmadd_ps(cy, sy, _mm256_mul_ps(cx, sx)));
+
+		/* tmp = r0v0 x e0 */
+		__m256 qx = _mm256_fmsub_ps(sy, e0z, _mm256_mul_ps(sz, e0y));
+		__m256 qy = _mm256_fmsub_ps(sz, e0x, _mm256_mul_ps(sx, e0z));
+		__m256 qz = _mm256_fmsub_ps(sx, e0y, _mm256_mul_ps(sy, e0x));
+		__m256 u2 = _mm256_fmadd_ps(qz, dz, _mm256_fmadd_ps(qy, dy, _mm256_mul_ps(qx, dx)));
+		__m256 tnum = _mm256_fmadd_ps(qz, e1z, _mm256_fmadd_ps(qy, e1y, _mm256_mul_ps(qx, e1x)));
+
+		__m256 abs_vol = _mm256_andnot_ps(sign_mask, vol);
+		__m256 mask = _mm256_cmp_ps(abs_vol, eps_vol, _CMP_GE_OQ);
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_mul_ps(u1, vol), zero, _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_mul_ps(u2, vol), zero, _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(
+			_mm256_andnot_ps(sign_mask, _mm256_add_ps(u1, u2)), abs_vol, _CMP_LE_OQ));
+
+		/* avoid dividing by zero in rejected lanes */
+		__m256 tcand = _mm256_div_ps(tnum, _mm256_blendv_ps(one, vol, mask));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(tcand, tmin, _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(tcand, tbest, _CMP_LT_OQ));
+
+		if (ANY_HIT) {
+			int lane_mask = _mm256_movemask_ps(mask);
+			if (lane_mask) {
+				alignas(32) float lane_t[8];
+				_mm256_store_ps(lane_t, tcand);
+				return first_lane_hit(block, 0, lane_t, lane_mask, t, face, material_index);
+			}
+			continue;
+		}
+
+		tbest = _mm256_blendv_ps(tbest, tcand, mask);
+		ibest = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(ibest),
+			_mm256_castsi256_ps(ind), mask));
+		ind = _mm256_add_epi32(ind, eight);
+	}
+
+	alignas(32) float lane_t[8];
+	alignas(32) int lane_ind[8];
+	_mm256_store_ps(lane_t, tbest);
+	_mm256_store_si256((__m256i *)lane_ind, ibest);
+	return reduce_lanes(blocks, lane_t, lane_ind, 8, t, face, material_index);
+}
+
+#endif /* TRI_BLOCK_X86 */
+
+class TriBlockKernel {
+public:
+	const char *name;
+	TriBlockIntersectFunc func;
+	TriBlockIntersectFunc occluded_func;
+	bool supported;
+};
+
+static std::vector<TriBlockKernel> get_kernels()
+{
+	std::vector<TriBlockKernel> kernels;
+#if TRI_BLOCK_X86
+	__builtin_cpu_init();
+	kernels.push_back({"avx2", intersect_avx2<false>, intersect_avx2<true>,
+		__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")});
+	kernels.push_back({"sse4.1", intersect_sse4<false>, intersect_sse4<true>,
+		(bool)__builtin_cpu_supports("sse4.1")});
+#endif
+	kernels.push_back({"scalar", intersect_scalar<false>, intersect_scalar<true>, true});
+	return kernels;
+}
+
+/** widest kernel supported by the cpu */
+static TriBlockKernel default_kernel()
+{
+	for (auto &kernel : get_kernels()) {
+		if (kernel.supported) {
+			return kernel;
+		}
+	}
+	return TriBlockKernel{"scalar", intersect_scalar<false>, intersect_scalar<true>, true};
+}
+
+TriBlockIntersectFunc tri_blocks_intersect = default_kernel().func;
+TriBlockIntersectFunc tri_blocks_occluded = default_kernel().occluded_func;
+
+/**
+ * override the kernel selected at startup (e.g. for benchmarking)
+ *
+ * @param name one of avx2, sse4.1, scalar
+ * @return false if unknown or unsupported by the cpu
+ */
+bool tri_block_select_kernel(const char *name)
+{
+	for (auto &kernel : get_kernels()) {
+		if (strcmp(kernel.name, name) == 0 && kernel.supported) {
+			tri_blocks_intersect = kernel.func;
+			tri_blocks_occluded = kernel.occluded_func;
+			return true;
+		}
+	}
+	return false;
+}
+
+/** @return name of the kernel in use */
+const char *tri_block_kernel_name()
+{
+	for (auto &kernel : get_kernels()) {
+		if (kernel.func == tri_blocks_intersect) {
+			return kernel.name;
+		}
+	}
+	return "unknown";
+}
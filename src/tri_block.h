@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef TRI_BLOCK_H
+#define TRI_BLOCK_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+
+#define TRI_BLOCK_WIDTH 8
+
+/**
+ * TRI_BLOCK_WIDTH faces in SoA layout with precomputed edges for SIMD ray
+ * intersection. Unused lanes are degenerate (zero edges) so they never hit.
+ */
+class alignas(32) TriBlock {
+public:
+	/** vertex 0 of faces: v0[xyz][lane] */
+	float v0[3][TRI_BLOCK_WIDTH];
+	/** edge v1 - v0 */
+	float e0[3][TRI_BLOCK_WIDTH];
+	/** edge v2 - v0 */
+	float e1[3][TRI_BLOCK_WIDTH];
+	/** points into Scene::all_faces, nullptr for unused lanes */
+	Face *face[TRI_BLOCK_WIDTH];
+	/** Face::material_index of the faces, so hits can be sorted by
+	 * material without loading the faces */
+	int material_index[TRI_BLOCK_WIDTH];
+};
+
+/**
+ * Finds the nearest intersection of ray with the faces in
+ * blocks[0...nblocks-1] with tlo <= t < *t (Moller-Trumbore, same tolerances
+ * as ray_face_intersect()).
+ *
+ * @param t in: upper bound for t; out: t of nearest hit if found
+ * @param face stores the face hit here if found
+ * @param material_index stores its Face::material_index here if found
+ *
+ * @return true if a hit was found
+ */
+typedef bool (*TriBlockIntersectFunc)(const TriBlock *blocks, uint32_t nblocks,
+	const Ray &r, float tlo, float *t, Face **face, int *material_index);
+
+/** kernel selected at startup: avx2, sse4.1 or scalar depending on cpu */
+extern TriBlockIntersectFunc tri_blocks_intersect;
+/**
+ * same as tri_blocks_intersect but returns at the first hit found in
+ * [tlo, *t), which need not be the nearest (for occlusion queries)
+ */
+extern TriBlockIntersectFunc tri_blocks_occluded;
+
+bool tri_block_select_kernel(const char *name);
+const char *tri_block_kernel_name();
+void write_tri_blocks(TriBlock *blocks, Face *const *faces, size_t nfaces);
+void append_tri_blocks(std::vector<TriBlock> &blocks, Face *const *faces, size_t nfaces);
+
+/** @return number of blocks needed for nfaces */
+static inline uint32_t tri_block_count(uint32_t nfaces)
+{
+	return (nfaces + TRI_BLOCK_WIDTH - 1) / TRI_BLOCK_WIDTH;
+}
+
+#endif /* TRI_BLOCK_H */
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief Wavefront path tracer over structure of arrays queues.
+ */
+
+#include <algorithm>
+#include <type_traits>
+#include "wavefront.h"
+
+/* see scene.cc */
+extern float global_characteristic_length_scale;
+
+PathQueue::PathQueue(int capacity)
+{
+	for (int d = 0; d < 3; d++) {
+		orig[d].resize(capacity);
+		dir[d].resize(capacity);
+		hit[d].resize(capacity);
+	}
+	ior.resize(capacity);
+	cos_orig.resize(capacity);
+	face.resize(capacity);
+	material.resize(capacity);
+	I.resize(capacity);
+	pdf_bsdf.resize(capacity);
+	id.resize(capacity);
+}
+
+ShadowQueue::ShadowQueue(int capacity)
+{
+	for (int d = 0; d < 3; d++) {
+		orig[d].resize(capacity);
+		dir[d].resize(capacity);
+	}
+	tmax.resize(capacity);
+	I.resize(capacity);
+	id.resize(capacity);
+}
+
+WavefrontPathTracer::WavefrontPathTracer(int tid, Scene &scene,
+	unsigned long samples_before_update, int nthread, int stream)
+: PathTracer(tid, scene, samples_before_update, nthread, stream)
+{
+	order.resize(WAVEFRONT_SIZE);
+	film_x.resize(WAVEFRONT_SIZE);
+	film_y.resize(WAVEFRONT_SIZE);
+	material_begin.resize(scene.all_materials.size() + 2);
+	tile_first_half = MultiArray<float>{TILE_SIZE, TILE_SIZE, FILM_NCHANNEL};
+	tile_first_half.fill(0);
+}
+
+/** splat I of path id to its pixel of the tile */
+void WavefrontPathTracer::splat_id(const Tile &tile, uint32_t id, const SpecificIntensity &I)
+{
+	const int local = id / TILE_SPP;
+	const int i = tile.i0 + local / TILE_SIZE;
+	const int j = tile.j0 + local % TILE_SIZE;
+	splat(i, j, I);
+
+	if (id % TILE_SPP < TILE_SPP / 2) {
+		float *pixel = &tile_first_half(i - tile.i0, j - tile.j0, 0);
+#if FILM_XYZ
+		I.add_to_xyz(pixel);
+#else
+		I.add_to(pixel);
+#endif
+	}
+}
+
+/** start sampler at the sample of path id, as PathTracer::render_tiles() */
+template<typename Sampler>
+void WavefrontPathTracer::start_sample(Sampler &sampler, const Tile &tile, uint32_t id)
+{
+	const int local = id / TILE_SPP;
+	const int i = tile.i0 + local / TILE_SIZE;
+	const int j = tile.j0 + local % TILE_SIZE;
+	sampler.start(stream, i * camera.nx + j, tile.pass * TILE_SPP + id % TILE_SPP);
+}
+
+/**
+ * camera rays of samples first... first+n-1 of the tile, numbered pixel by
+ * pixel, TILE_SPP each: the film points are drawn per sample, then the rays
+ * made all at once by Camera::get_init_dirs()
+ */
+template<typename Sampler>
+void WavefrontPathTracer::generate(Sampler &sampler, const Tile &tile, int first, int n)
+{
+	const int width = tile.j1 - tile.j0;
+	for (int k = 0; k < n; k++) {
+		const int pixel = (first + k) / TILE_SPP;
+		const int i = tile.i0 + pixel / width;
+		const int j = tile.j0 + pixel % width;
+		const uint32_t id = ((i - tile.i0) * TILE_SIZE + j - tile.j0) * TILE_SPP
+			+ (first + k) % TILE_SPP;
+		start_sample(sampler, tile, id);
+
+		SpecificIntensity &I = paths.I[k];
+		I.start(sampler.get(SAMPLE_WAVELENGTH));
+		I = 1.0f;
+
+		camera.get_film_xy_in_pixel(&film_x[k], &film_y[k], i, j,
+			sampler.get(SAMPLE_FILM_X), sampler.get(SAMPLE_FILM_Y));
+		paths.pdf_bsdf[k] = 0;
+		paths.id[k] = id;
+	}
+
+	float *const dir[3] = {paths.dir[0].data(), paths.dir[1].data(), paths.dir[2].data()};
+	camera.get_init_dirs(dir, film_x.data(), film_y.data(), n);
+	for (int k = 0; k < n; k++) {
+		for (int d = 0; d < 3; d++) {
+			paths.orig[d][k] = camera.position.x[d];
+		}
+		paths.ior[k] = SPACE_INDEX_REFRACT;
+		paths.cos_orig[k] = 1;
+	}
+	paths.size = n;
+}
+
+/** closest hits of the rays of paths */
+void WavefrontPathTracer::intersect()
+{
+	AccelStruct &accel = *scene.accel;
+
+	for (int k = 0; k < paths.size; k++) {
+		const Ray ray = paths.ray(k);
+		Vec point;
+		Face *face;
+		if (accel.first_ray_material_intersect(&point, &face, &paths.material[k], ray)) {
+			for (int d = 0; d < 3; d++) {
+				paths.hit[d][k] = point.x[d];
+			}
+			paths.face[k] = face;
+		} else {
+			paths.face[k] = nullptr;
+		}
+	}
+	stats.rays += paths.size;
+}
+
+/**
+ * closest hits of the camera rays of paths, which generate() makes in packets
+ * of a few neighbouring pixels' samples, so they are traced together (see
+ * AccelStruct::first_ray_face_intersect_packet())
+ */
+void WavefrontPathTracer::intersect_primary()
+{
+	const float *const dir[3] = {paths.dir[0].data(), paths.dir[1].data(),
+		paths.dir[2].data()};
+	float *const hit[3] = {paths.hit[0].data(), paths.hit[1].data(), paths.hit[2].data()};
+	scene.accel->first_ray_face_intersect_packet(camera.position, dir, paths.size, hit,
+		paths.face.data(), paths.material.data());
+	stats.rays += paths.size;
+}
+
+/**
+ * order the paths by material hit; those that escaped go last. Only the
+ * queue is read, not the faces hit.
+ */
+void WavefrontPathTracer::sort_by_material()
+{
+	const int nmaterial = scene.all_materials.size();
+
+	std::fill(material_begin.begin(), material_begin.end(), 0);
+	for (int k = 0; k < paths.size; k++) {
+		material_begin[(paths.face[k] != nullptr ? paths.material[k] : nmaterial) + 1]++;
+	}
+	for (int m = 0; m <= nmaterial; m++) {
+		material_begin[m + 1] += material_begin[m];
+	}
+
+	material_end.assign(material_begin.begin(), material_begin.end() - 1);
+	for (int k = 0; k < paths.size; k++) {
+		order[material_end[paths.face[k] != nullptr ? paths.material[k] : nmaterial]++] = k;
+	}
+
+	stats.escaped += paths.size - material_begin[nmaterial];
+}
+
+/**
+ * next event estimation from vertex 1 of path (path id, on material) as
+ * sample_light(), but queueing the shadow ray for trace_shadows()
+ */
+template<typename M>
+void WavefrontPathTracer::queue_shadow(const float *u_light, const M &material, uint32_t id)
+{
+	const EmitterList &emitters = scene.emitters;
+	const Vec &orig = path.rays[1].orig;
+
+	Vec light_point;
+	Face *light_face;
+	const float pdf_area = emitters.sample(&light_point, &light_face,
+		u_light[BOUNCE_LIGHT_CHOICE - BOUNCE_LIGHT_POINT], u_light[0], u_light[1]);
+
+	Vec to_light = light_point - orig;
+	const float dist2 = to_light * to_light;
+	const float dist = sqrtf(dist2);
+	const float tol = GEOMETRY_EPSILON * global_characteristic_length_scale;
+	if (dist <= 2 * tol) {
+		return;
+	}
+	const Vec dir = (1 / dist) * to_light;
+	const float cos_light = fabsf(light_face->n * dir);
+	if (cos_light <= GEOMETRY_EPSILON) {
+		return;
+	}
+
+	const int n = shadows.size;
+	SpecificIntensity &I = shadows.I[n];
+	I = path.I;
+	const float pdf_bsdf = material.connect_transfer(I, path, 1, dir);
+	if (pdf_bsdf <= 0) {
+		return;
+	}
+
+	const float pdf_light = pdf_area * dist2 / cos_light;
+	const EmitterParams &light = scene.materials.entries[light_face->material_index].emitter;
+	I *= light.emission;
+	I *= mis_weight(pdf_light, pdf_bsdf) / pdf_light;
+	for (int d = 0; d < 3; d++) {
+		shadows.orig[d][n] = orig.x[d];
+		shadows.dir[d][n] = dir.x[d];
+	}
+	shadows.tmax[n] = dist - tol;
+	shadows.id[n] = id;
+	shadows.size++;
+}
+
+/**
+ * continue the paths order[begin...end-1], which hit material, as
+ * trace_nee() does at depth: splat those that hit a light, queue a shadow
+ * ray to a sampled light and the sampled ray continuing the path. M is the
+ * parameter class of material (see MaterialTable), so its calls are direct.
+ */
+template<typename Sampler, typename M>
+void WavefrontPathTracer::shade(Sampler &sampler, const Tile &tile,
+	const M &material, const int *begin, const int *end, int depth)
+{
+	const EmitterList &emitters = scene.emitters;
+	const uint32_t dim = sample_bounce_dim(depth);
+	const bool connect = M::can_connect && !emitters.empty();
+
+	for (const int *p = begin; p < end; p++) {
+		const int k = *p;
+		const uint32_t id = paths.id[k];
+		path.rays[0] = paths.ray(k);
+		path.rays[1].orig = Vec{paths.hit[0][k], paths.hit[1][k], paths.hit[2][k]};
+		path.faces[1] = paths.face[k];
+		path.I = paths.I[k];
+
+		// set path normals[1] to be on same side of rays[1]
+		const Vec &face_normal = path.faces[1]->n;
+		const float cos_in = face_normal * path.rays[0].dir;
+		if (cos_in < 0) {
+			path.normals[1] = face_normal;
+			path.rays[0].cosines[1] = -cos_in;
+		} else {
+			path.normals[1] = -1 * face_normal;
+			path.rays[0].cosines[1] = cos_in;
+		}
+
+		if constexpr (std::is_same<M, EmitterParams>::value) {
+			float weight = 1;
+			if (paths.pdf_bsdf[k] > 0) {
+				Vec d = path.rays[1].orig - path.rays[0].orig;
+				float pdf_light = emitters.pdf_area(*path.faces[1]) * (d * d)
+					/ fmaxf(path.rays[0].cosines[1], GEOMETRY_EPSILON);
+				weight = mis_weight(paths.pdf_bsdf[k], pdf_light);
+			}
+			path.I *= material.emission;
+			path.I *= weight;
+			splat_id(tile, id, path.I);
+			stats.reached_light++;
+			continue;
+		}
+
+		if (max_depth > 0 && depth >= max_depth) {
+			stats.max_depth++;
+			continue;
+		}
+
+		start_sample(sampler, tile, id);
+
+		float u_light[4];
+		sampler.get4(dim + BOUNCE_LIGHT_POINT, u_light);
+		if constexpr (M::can_connect) {
+			if (connect) {
+				queue_shadow(u_light, material, id);
+			}
+		}
+
+		float u[MATERIAL_NRAND];
+		get_material_rand(sampler, dim + BOUNCE_MATERIAL, u);
+		material.sample_ray(path, 1, u);
+		path.I /= path.prob_dens[1];
+		material.transfer(path, 1);
+
+		if (depth >= rr_min_depth) {
+			const float survival = fminf(RR_MAX_SURVIVAL, path.I.max());
+			if (u_light[BOUNCE_ROULETTE - BOUNCE_LIGHT_POINT] >= survival) {
+				stats.roulette++;
+				continue;
+			}
+			path.I /= survival;
+		}
+
+		const int n = next_paths.size++;
+		next_paths.set_ray(n, path.rays[1]);
+		next_paths.I[n] = path.I;
+		next_paths.pdf_bsdf[n] = connect ? path.prob_dens[1] : 0;
+		next_paths.id[n] = id;
+	}
+}
+
+/** splat the shadow rays that are not occluded, emptying the queue */
+void WavefrontPathTracer::trace_shadows(const Tile &tile)
+{
+	AccelStruct &accel = *scene.accel;
+
+	for (int k = 0; k < shadows.size; k++) {
+		Ray ray;
+		for (int d = 0; d < 3; d++) {
+			ray.orig.x[d] = shadows.orig[d][k];
+			ray.dir.x[d] = shadows.dir[d][k];
+		}
+		if (!accel.occluded(ray, shadows.tmax[k])) {
+			splat_id(tile, shadows.id[k], shadows.I[k]);
+		}
+	}
+	stats.shadow_rays += shadows.size;
+	shadows.size = 0;
+}
+
+/** as PathTracer::render_tiles(), a wavefront per tile */
+template<typename Sampler>
+void WavefrontPathTracer::render_wavefront()
+{
+	Sampler sampler;
+	Tile tile;
+	splat_buffer = &tile_buffer;
+
+	while (!past_deadline() && tiles->next(tid, &tile)) {
+		splat_i0 = tile.i0;
+		splat_j0 = tile.j0;
+
+		const int nsample = TILE_SPP * (tile.i1 - tile.i0) * (tile.j1 - tile.j0);
+		for (int first = 0; first < nsample; first += WAVEFRONT_SIZE) {
+			generate(sampler, tile, first, std::min(WAVEFRONT_SIZE, nsample - first));
+			for (int depth = 1; paths.size > 0; depth++) {
+				if (depth == 1) {
+					intersect_primary();
+				} else {
+					intersect();
+				}
+				sort_by_material();
+				next_paths.size = 0;
+				for (size_t m = 0; m < scene.all_materials.size(); m++) {
+					if (material_begin[m] == material_begin[m + 1]) {
+						continue;
+					}
+					scene.materials.dispatch(m, [&](const auto &material) {
+						shade(sampler, tile, material, &order[material_begin[m]],
+							&order[material_begin[m + 1]], depth);
+					});
+				}
+				trace_shadows(tile);
+				std::swap(paths, next_paths);
+			}
+		}
+
+		for (int i = 0; i < tile.i1 - tile.i0; i++) {
+			for (int j = 0; j < tile.j1 - tile.j0; j++) {
+				tile_half(i, j) = Camera::luminance(&tile_first_half(i, j, 0));
+			}
+		}
+		tile_first_half.fill(0);
+
+		stats.paths += nsample;
+		stats.samples += nsample;
+
+		publish_rng_state();
+
+		stats.merge_wait += camera.merge_tile(tile_buffer, tile_half, tile.i0, tile.j0,
+			tile.i1 - tile.i0, tile.j1 - tile.j0);
+		stats.merge_wait += camera.merge_probes(probe_buffer);
+		stats.merges++;
+	}
+
+	/* threads waiting for the next round would wait for this one forever */
+	if (past_deadline()) {
+		tiles->cancel();
+	}
+	splat_buffer = &film_buffer;
+	splat_i0 = splat_j0 = 0;
+}
+
+void WavefrontPathTracer::render()
+{
+	if (!nee || tiles == nullptr) {
+		PathTracer::render();
+		return;
+	}
+
+	switch (sampler_type) {
+	case SAMPLER_PCG:
+		render_wavefront<PCGSampler>();
+		break;
+	case SAMPLER_SOBOL:
+		render_wavefront<SobolSampler>();
+		break;
+	case SAMPLER_OWEN_SOBOL:
+		render_wavefront<OwenSobolSampler>();
+		break;
+	}
+}
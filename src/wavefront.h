@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "render.h"
+
+/**
+ * Paths of a wavefront in structure of arrays layout: the ray arriving at
+ * the next vertex of each, where it hits, and what shading needs to go on.
+ * A path is identified by id = ((i - i0) * TILE_SIZE + j - j0) * TILE_SPP + s
+ * for sample s of pixel i, j of the tile.
+ */
+class PathQueue {
+public:
+	int size = 0;
+	std::vector<float> orig[3];
+	std::vector<float> dir[3];
+	std::vector<float> ior;
+	/** cosines[0] of the ray */
+	std::vector<float> cos_orig;
+	/** the hit, with face nullptr if the ray escaped */
+	std::vector<float> hit[3];
+	std::vector<Face *> face;
+	/** Face::material_index of face, from the acceleration structure */
+	std::vector<int> material;
+	/** throughput */
+	std::vector<SpecificIntensity> I;
+	/** see PathTracer::trace_nee() */
+	std::vector<float> pdf_bsdf;
+	std::vector<uint32_t> id;
+
+	PathQueue(int capacity = WAVEFRONT_SIZE);
+
+	Ray ray(int k) const
+	{
+		Ray ray;
+		for (int d = 0; d < 3; d++) {
+			ray.orig.x[d] = orig[d][k];
+			ray.dir.x[d] = dir[d][k];
+		}
+		ray.ior = ior[k];
+		ray.cosines[0] = cos_orig[k];
+		return ray;
+	}
+
+	void set_ray(int k, const Ray &ray)
+	{
+		for (int d = 0; d < 3; d++) {
+			orig[d][k] = ray.orig.x[d];
+			dir[d][k] = ray.dir.x[d];
+		}
+		ior[k] = ray.ior;
+		cos_orig[k] = ray.cosines[0];
+	}
+};
+
+/** shadow rays of next event estimation, each splatting I unless occluded */
+class ShadowQueue {
+public:
+	int size = 0;
+	std::vector<float> orig[3];
+	std::vector<float> dir[3];
+	std::vector<float> tmax;
+	std::vector<SpecificIntensity> I;
+	/** of the path (see PathQueue) */
+	std::vector<uint32_t> id;
+
+	ShadowQueue(int capacity = WAVEFRONT_SIZE);
+};
+
+/**
+ * Wavefront path tracer (Laine et al. 2013, "Megakernels Considered Harmful"):
+ * the next event estimation tracer restructured to advance the paths of a tile,
+ * WAVEFRONT_SIZE at a time, one bounce at a time in stages over whole queues,
+ * rather than one path at a time through every stage:
+ *
+ * - intersect: closest hits of every ray of the queue, camera rays in packets
+ * - sort: the paths by the material hit (a counting sort)
+ * - shade: each material over its contiguous run of paths, dispatched on its
+ *   type once per run (MaterialTable), pushing shadow rays and the rays
+ *   continuing the paths onto the next queue
+ * - shadow: occlusion of every shadow ray, splatting those that reach lights
+ *
+ * Each stage is one tight loop over arrays, where vector traversal and
+ * shading can go. Samples take the same sampler dimensions as trace_nee(), so
+ * the image is that of PathTracer up to float rounding of the splat order.
+ * Without next event estimation or tiles, renders as PathTracer.
+ */
+class WavefrontPathTracer : public PathTracer {
+public:
+	PathQueue paths;
+	PathQueue next_paths;
+	ShadowQueue shadows;
+	/** paths of material m are order[material_begin[m]...
+	 * material_begin[m+1]-1] */
+	std::vector<int> order;
+	std::vector<int> material_begin;
+	/** scratch for sort_by_material() */
+	std::vector<int> material_end;
+	/** scratch for generate() */
+	std::vector<float> film_x;
+	std::vector<float> film_y;
+	/** of the first TILE_SPP / 2 samples, for tile_half */
+	MultiArray<float> tile_first_half;
+
+	WavefrontPathTracer(int tid, Scene &scene, unsigned long samples_before_update,
+		int nthread = NTHREAD, int stream = 0);
+
+	void splat_id(const Tile &tile, uint32_t id, const SpecificIntensity &I);
+	template<typename Sampler> void start_sample(Sampler &sampler, const Tile &tile,
+		uint32_t id);
+	template<typename Sampler> void generate(Sampler &sampler, const Tile &tile,
+		int first, int n);
+	void intersect();
+	void intersect_primary();
+	void sort_by_material();
+	template<typename M> void queue_shadow(const float *u_light, const M &material,
+		uint32_t id);
+	template<typename Sampler, typename M> void shade(Sampler &sampler, const Tile &tile,
+		const M &material, const int *begin, const int *end, int depth);
+	void trace_shadows(const Tile &tile);
+	template<typename Sampler> void render_wavefront();
+	void render();
+};
+
+#endif /* WAVEFRONT_H */